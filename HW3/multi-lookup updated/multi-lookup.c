@@ -5,33 +5,77 @@
 #include <string.h>
 #include <errno.h>
 #include <time.h>
+#include <getopt.h>
+#include <limits.h>
 
 #include "util.h"
 #include "queue.h"
+#include "ringio.h"
+#include "trace.h"
 
 
 #define MINARGS 3
 #define SBUFSIZE 1025
-#define INPUTFS "%1024s"
-#define USAGE "<inputFilePath> <outputFilePath>"
+#define USAGE "[-r] [-n <threads>] [-t <trace.json>] [-p <priority>] <inputFilePath> ... <outputFilePath>"
 #define QUEUE_MAX 100
 
+// Priority lanes: 0 is the most urgent, later lanes get a smaller
+// share of the resolver threads while earlier lanes have work.
+#define PRIORITY_LANES 3
+#define DEFAULT_PRIORITY 1
+static const int lane_weights[PRIORITY_LANES] = {8, 4, 1};
+
 #define NUM_THREADS	3
+#define MAX_THREADS	64
 
 // Global variables defined
-queue q;
+prio_queue q;
 char debug = 0;
 char exit_write = 0;
 pthread_mutex_t queue_access;
 pthread_mutex_t output_file_access;
 pthread_mutex_t terminate_ok;
 pthread_cond_t queue_full;
+pthread_cond_t lane_space[PRIORITY_LANES];
+
+// dnslookup() by default, reverselookup() with --reverse
+int (*lookup)(const char*, char*, int) = dnslookup;
+const char* lookup_name = "dnslookup";
 
 typedef struct {
 	char hostname[SBUFSIZE];
-    char firstipstr[INET6_ADDRSTRLEN];
+    char answer[SBUFSIZE]; // first IP, or the name in --reverse mode
+    trace_times times;
 } Map_IP;
 
+typedef struct {
+	ringio_reader reader;
+	const char* path;
+	int priority;
+	int id;
+} Input_File;
+
+typedef struct {
+	ringio_writer* writer;
+	int id;
+} Resolver;
+
+// Format one record and hand it to the asynchronous writer
+static void write_record(Resolver* resolver, Map_IP* full_info) {
+	char line[2 * SBUFSIZE + 2];
+	int len;
+	
+	len = snprintf(line, sizeof(line), "%s,%s\n", full_info->hostname, full_info->answer);
+	if (ringio_writer_write(resolver->writer, line, len) == RINGIO_FAILURE) {
+		perror("Error Writing Output File");
+	}
+	
+	if (trace_enabled()) {
+		full_info->times.write = trace_now();
+		trace_commit(full_info->hostname, &full_info->times, resolver->id);
+	}
+}
+
 
 
 // write to file
@@ -40,11 +84,12 @@ void *writeFile(void* output_file_ptr) {
 		printf("Entered writeFile\n");
 	}
 	char still_running = 1;
-	FILE* outputfp = (FILE *) output_file_ptr;
+	int lane;
+	Resolver* resolver = (Resolver *) output_file_ptr;
 	
 	while(still_running) {
 		
-		static struct timespec time_to_wait = {0,0};
+		struct timespec time_to_wait = {0,0};
 		time_to_wait.tv_sec = time(NULL) + 10;
 		Map_IP *full_info = NULL;
 		
@@ -57,7 +102,7 @@ void *writeFile(void* output_file_ptr) {
 		pthread_mutex_unlock(&terminate_ok);
 	
 		// Queue is empty
-		while (queue_is_empty(&q) && still_running) {
+		while (prio_queue_is_empty(&q) && still_running) {
 			
 			
 			pthread_mutex_lock(&terminate_ok);
@@ -71,8 +116,9 @@ void *writeFile(void* output_file_ptr) {
 		}
 		
 		// The queue is not empty
-		if (still_running && !queue_is_empty(&q)) {
-			full_info = queue_pop(&q); 
+		if (still_running && !prio_queue_is_empty(&q)) {
+			full_info = prio_queue_pop(&q); 
+			full_info->times.dequeue = trace_now();
 			
 			//pthread_mutex_unlock(&queue_access);
 		
@@ -81,19 +127,20 @@ void *writeFile(void* output_file_ptr) {
 			//printf("Entered output file critical section\n");
 			
 			if (debug) {
-				printf("Writing %s,%s to output\n", full_info->hostname, full_info->firstipstr); 
+				printf("Writing %s,%s to output\n", full_info->hostname, full_info->answer); 
 			}
 			
-			fprintf(outputfp, "%s,%s\n", full_info->hostname, full_info->firstipstr);
+			write_record(resolver, full_info);
 			
 			pthread_mutex_unlock(&output_file_access);
 			//printf("Released output file semaphore\n");
 			
 			free(full_info);
 		}
-		else if (!still_running && !queue_is_empty(&q)) {
-			while(!queue_is_empty(&q)) {
-				full_info = queue_pop(&q); 
+		else if (!still_running && !prio_queue_is_empty(&q)) {
+			while(!prio_queue_is_empty(&q)) {
+				full_info = prio_queue_pop(&q); 
+				full_info->times.dequeue = trace_now();
 			
 				// Write to output file
 				pthread_mutex_lock(&output_file_access);
@@ -101,9 +148,9 @@ void *writeFile(void* output_file_ptr) {
 				
 				
 				if (debug) {
-					printf("Writing %s,%s to output (while)\n", full_info->hostname, full_info->firstipstr); 
+					printf("Writing %s,%s to output (while)\n", full_info->hostname, full_info->answer); 
 				}
-				fprintf(outputfp, "%s,%s\n", full_info->hostname, full_info->firstipstr);
+				write_record(resolver, full_info);
 				
 				pthread_mutex_unlock(&output_file_access);
 				//printf("Released output file semaphore in while loop\n");
@@ -117,7 +164,10 @@ void *writeFile(void* output_file_ptr) {
 		}	
 		
 		pthread_mutex_unlock(&queue_access);
-		pthread_cond_signal(&queue_full);
+		// One waiter per lane; a lane that did not get room just waits again
+		for (lane = 0; lane < PRIORITY_LANES; lane++) {
+			pthread_cond_signal(&lane_space[lane]);
+		}
 		//printf("Unlocked queue_access\n");
 	} 
 	
@@ -136,41 +186,55 @@ void *readFile(void* input_file_ptr) {
 		printf("Entered readFile\n");
 	}
 	
-	FILE* inputfp = (FILE*) input_file_ptr;
+	Input_File* input = (Input_File*) input_file_ptr;
 	char hostname[SBUFSIZE];
+	char errorstr[SBUFSIZE + PATH_MAX];
+	int len;
 	
-	while (fscanf(inputfp, INPUTFS, hostname) > 0) {
+	while ((len = ringio_reader_next(&input->reader, hostname, sizeof(hostname))) > 0) {
 		Map_IP *full_info = malloc(sizeof(Map_IP));
 		strncpy(full_info->hostname, hostname, sizeof(hostname));
+		memset(&full_info->times, 0, sizeof(full_info->times));
+		full_info->times.requester = input->id;
+		full_info->times.lane = input->priority;
 		
 		if (debug) {
 			printf("The first entry in the file is: %s\n", full_info->hostname);
 		}
 		
-		if (dnslookup(full_info->hostname, full_info->firstipstr, sizeof(full_info->firstipstr)) == UTIL_FAILURE) {
-			fprintf(stderr, "dnslookup error: %s\n", full_info->hostname);
-			strncpy(full_info->firstipstr, "", sizeof(full_info->firstipstr));
+		full_info->times.resolve_start = trace_now();
+		if (lookup(full_info->hostname, full_info->answer, sizeof(full_info->answer)) == UTIL_FAILURE) {
+			fprintf(stderr, "%s error: %s\n", lookup_name, full_info->hostname);
+			strncpy(full_info->answer, "", sizeof(full_info->answer));
 		}
+		full_info->times.resolve_end = trace_now();
 		
 		if (debug) {
-			printf("It's IP address is: %s\n", full_info->firstipstr);
+			printf("The answer is: %s\n", full_info->answer);
 		}
 		
 		// Add to queue
 		pthread_mutex_lock(&queue_access);
 		
-		// The Queue is full
-		if (queue_is_full(&q)) {
-			pthread_cond_wait(&queue_full, &queue_access);
+		// This file's lane is full, other lanes may still have room
+		while (prio_queue_is_full(&q, input->priority)) {
+			pthread_cond_wait(&lane_space[input->priority], &queue_access);
 		}
 		
-		queue_push(&q, (void *) full_info);
+		prio_queue_push(&q, input->priority, (void *) full_info);
+		full_info->times.enqueue = trace_now();
 		
 		pthread_mutex_unlock(&queue_access);
 		pthread_cond_signal(&queue_full);
 		
 	}
 	
+	// 0 is the end of the file, anything else lost the rest of it
+	if (len == RINGIO_FAILURE) {
+		snprintf(errorstr, sizeof(errorstr), "Error Reading Input File: %s", input->path);
+		perror(errorstr);
+	}
+	
 	if (debug) {
 		printf("finished reading in file\n");
 	}
@@ -178,24 +242,102 @@ void *readFile(void* input_file_ptr) {
 	return NULL;
 }
 
+// Parse a whole decimal option value into [min, max], 0 on success.
+// atoi() took "4x" as 4 and "x" as 0 without a word.
+static int parse_int(const char* arg, int min, int max, int* value)
+{
+	char* end;
+	long n;
+	
+	errno = 0;
+	n = strtol(arg, &end, 10);
+	if (end == arg || *end != '\0' || errno == ERANGE || n < min || n > max) {
+		return -1;
+	}
+	*value = (int) n;
+	return 0;
+}
+
 
 int main(int argc, char *argv[])
 {
-	if (argc < MINARGS) {
-		fprintf(stderr, "Not enough arguments: %d\n", (argc - 1));
-		fprintf(stderr, "Usage:\n %s %s\n", argv[0], USAGE);
-	}
+	static struct option long_options[] = {
+		{"priority", required_argument, NULL, 'p'},
+		{"trace", required_argument, NULL, 't'},
+		{"threads", required_argument, NULL, 'n'},
+		{"reverse", no_argument, NULL, 'r'},
+		{NULL, 0, NULL, 0}
+	};
 	
 	// Declare needed variables
-	FILE* outputfp = NULL;
-	FILE* inputfp[argc-2];
-	pthread_t requester_threads[argc-2]; // one thread per file
-	pthread_t resolver_threads[argc-2]; // one thread per file
+	ringio_writer output;
+	char* paths[argc];
+	int priorities[argc];
+	int num_paths = 0;
+	int priority = DEFAULT_PRIORITY;
+	int num_resolvers = NUM_THREADS;
+	char* trace_path = NULL;
+	char thread_name[SBUFSIZE + 16];
+	int num_inputs, num_started = 0;
 	char errorstr[SBUFSIZE];
-	int i, rc;
+	int i, rc, opt;
+	
+	// A leading '-' in the option string hands back file names in order,
+	// so a -p applies to every input file after it
+	while ((opt = getopt_long(argc, argv, "-p:t:n:r", long_options, NULL)) != -1) {
+		switch (opt) {
+		case 'p':
+			if (parse_int(optarg, 0, PRIORITY_LANES - 1, &priority) != 0) {
+				fprintf(stderr, "Priority must be between 0 and %d: %s\n", PRIORITY_LANES - 1, optarg);
+				fprintf(stderr, "Usage:\n %s %s\n", argv[0], USAGE);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 't':
+			trace_path = optarg;
+			break;
+		case 'n':
+			if (parse_int(optarg, 1, MAX_THREADS, &num_resolvers) != 0) {
+				fprintf(stderr, "Threads must be between 1 and %d: %s\n", MAX_THREADS, optarg);
+				fprintf(stderr, "Usage:\n %s %s\n", argv[0], USAGE);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'r':
+			lookup = reverselookup;
+			lookup_name = "reverselookup";
+			break;
+		case 1:
+			paths[num_paths] = optarg;
+			priorities[num_paths] = priority;
+			num_paths++;
+			break;
+		default:
+			fprintf(stderr, "Usage:\n %s %s\n", argv[0], USAGE);
+			return EXIT_FAILURE;
+		}
+	}
+	
+	if (num_paths < MINARGS - 1) {
+		fprintf(stderr, "Not enough arguments: %d\n", num_paths);
+		fprintf(stderr, "Usage:\n %s %s\n", argv[0], USAGE);
+		return EXIT_FAILURE;
+	}
 	
-	if(queue_init(&q, QUEUE_MAX) == QUEUE_FAILURE) {
+	num_inputs = num_paths - 1;
+	Input_File inputs[num_inputs];
+	pthread_t requester_threads[num_inputs]; // one thread per file
+	pthread_t resolver_threads[num_resolvers];
+	Resolver resolvers[num_resolvers];
+	
+	// Ring is allocated before any thread starts so tracing never mallocs
+	if (trace_path && trace_init(TRACE_CAPACITY) == TRACE_FAILURE) {
+		return EXIT_FAILURE;
+	}
+	
+	if(prio_queue_init(&q, PRIORITY_LANES, QUEUE_MAX, lane_weights) == QUEUE_FAILURE) {
 		fprintf(stderr,"error: queue_init failed!\n");
+		return EXIT_FAILURE;
 	}
 	
 	// Initialize semaphores and condition variables
@@ -214,33 +356,50 @@ int main(int argc, char *argv[])
 		perror("Error Inititializing Condition Variable");
 	}
 	
+	for (i = 0; i < PRIORITY_LANES; i++) {
+		rc = pthread_cond_init(&lane_space[i], NULL);
+		if (rc < 0) {
+			perror("Error Inititializing Condition Variable");
+		}
+	}
+	
 	
-	outputfp = fopen(argv[(argc-1)], "w");
-    if(!outputfp){
+    if(ringio_writer_open(&output, paths[num_inputs]) == RINGIO_FAILURE){
 		perror("Error Opening Output File");
 		return EXIT_FAILURE;
     }
 	
 	// Open each input file and send it on its merry way with a thread
-	for (i = 1; i < argc-1; i++) {
-		inputfp[i-1] = fopen(argv[i], "r");
-		if(!inputfp[i-1]){
-		    sprintf(errorstr, "Error Opening Input File: %s", argv[i]);
+	for (i = 0; i < num_inputs; i++) {
+		inputs[i].path = paths[i];
+		inputs[i].priority = priorities[i];
+		inputs[i].id = i + 1;
+		if(ringio_reader_open(&inputs[i].reader, paths[i]) == RINGIO_FAILURE){
+		    sprintf(errorstr, "Error Opening Input File: %s", paths[i]);
 		    perror(errorstr);
 		    break;
 		}	
 		
+		snprintf(thread_name, sizeof(thread_name), "requester %s", paths[i]);
+		trace_thread_name(inputs[i].id, thread_name);
+		
 		// Create Requester Threads
-		rc = pthread_create(&(requester_threads[i-1]), NULL, readFile, (void *) inputfp[i-1]);
+		rc = pthread_create(&(requester_threads[i]), NULL, readFile, (void *) &inputs[i]);
 		if (rc) {
 			printf("ERROR; return code from pthread_create() is %d\n", rc);
 			exit(EXIT_FAILURE);
-		}		
+		}
+		num_started++;
 	}
 	
 	// Create Resolver Threads
-	for (i = 0; i < NUM_THREADS; i++)  {
-		rc = pthread_create(&(resolver_threads[i]), NULL, writeFile, (void *) outputfp);
+	for (i = 0; i < num_resolvers; i++)  {
+		resolvers[i].writer = &output;
+		resolvers[i].id = num_inputs + 1 + i;
+		snprintf(thread_name, sizeof(thread_name), "resolver %d", i);
+		trace_thread_name(resolvers[i].id, thread_name);
+		
+		rc = pthread_create(&(resolver_threads[i]), NULL, writeFile, (void *) &resolvers[i]);
 		if (rc) {
 			printf("ERROR; return code from pthread_create() is %d\n", rc);
 			exit(EXIT_FAILURE);
@@ -248,10 +407,10 @@ int main(int argc, char *argv[])
 	}
 	
 	 // All Requester Threads have finished executing
-	for (i = 0; i < argc-2; i++) {
+	for (i = 0; i < num_started; i++) {
 		//printf("Trying to join Resolver Threads\n");
 		pthread_join(requester_threads[i], NULL);
-		fclose(inputfp[i]);
+		ringio_reader_close(&inputs[i].reader);
 		if (debug) {
 			printf("Resolver Thread %d joined\n", i);
 		}
@@ -261,26 +420,55 @@ int main(int argc, char *argv[])
 		printf("Requester threads terminated\n");	
 	}
 	
+#ifdef STRESS_TEST
+	// stress-test.sh reads this to catch resolvers stuck in the timed wait
+	struct timespec shutdown_start, shutdown_end;
+	clock_gettime(CLOCK_MONOTONIC, &shutdown_start);
+#endif
+	
+	// Hold queue_access as well so a resolver can't check exit_write
+	// and then miss the broadcast on its way into the timed wait
+	pthread_mutex_lock(&queue_access);
 	pthread_mutex_lock(&terminate_ok);
 	
 	exit_write = 1;
 	
 	pthread_mutex_unlock(&terminate_ok);
+	pthread_mutex_unlock(&queue_access);
 	pthread_cond_broadcast(&queue_full);
 	
 	// All Resolver Threads have finished executing
-	for (i = 0; i < NUM_THREADS; i++) {
+	for (i = 0; i < num_resolvers; i++) {
 		pthread_join(resolver_threads[i], NULL);
 	}
+	
+#ifdef STRESS_TEST
+	clock_gettime(CLOCK_MONOTONIC, &shutdown_end);
+	fprintf(stderr, "stress: shutdown_ms=%.3f\n",
+		(shutdown_end.tv_sec - shutdown_start.tv_sec) * 1000.0
+		+ (shutdown_end.tv_nsec - shutdown_start.tv_nsec) / 1000000.0);
+#endif
    
 	// Clean memory
-    queue_cleanup(&q);
-    fclose(outputfp);
+    prio_queue_cleanup(&q);
+    if (ringio_writer_close(&output) == RINGIO_FAILURE) {
+		perror("Error Closing Output File");
+	}
+	
+	if (trace_path) {
+		if (trace_dump(trace_path) == TRACE_FAILURE) {
+			perror("Error Writing Trace File");
+		}
+		trace_cleanup();
+	}
     
     // de-initialize semaphores and condition variables
     pthread_mutex_destroy(&queue_access);
     pthread_mutex_destroy(&output_file_access);
     pthread_cond_destroy(&queue_full);
+    for (i = 0; i < PRIORITY_LANES; i++) {
+		pthread_cond_destroy(&lane_space[i]);
+	}
 
     return 0;
 }
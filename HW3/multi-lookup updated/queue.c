@@ -10,7 +10,8 @@
  * Modify Date: 2012/02/01
  * Modify Date: 2016/09/26
  * Description:
- * 	This file contains an implementation of a simple FIFO queue.
+ * 	This file contains an implementation of a simple FIFO queue
+ *      and a multi-lane weighted priority queue.
  *  
  */
 
@@ -102,3 +103,115 @@ void queue_cleanup(queue* q)
 
     free(q->array);
 }
+
+int prio_queue_init(prio_queue* pq, int numLanes, int size,
+		    const int* weights){
+
+    int i;
+
+    if(numLanes <= 0){
+	return QUEUE_FAILURE;
+    }
+
+    pq->numLanes = numLanes;
+    pq->lanes = malloc(sizeof(queue) * numLanes);
+    pq->weights = malloc(sizeof(int) * numLanes);
+    pq->credits = malloc(sizeof(int) * numLanes);
+    if(!(pq->lanes) || !(pq->weights) || !(pq->credits)){
+	perror("Error on prio_queue Malloc");
+	free(pq->lanes);
+	free(pq->weights);
+	free(pq->credits);
+	return QUEUE_FAILURE;
+    }
+
+    for(i=0; i < numLanes; ++i){
+	if(queue_init(&(pq->lanes[i]), size) == QUEUE_FAILURE){
+	    while(--i >= 0){
+		queue_cleanup(&(pq->lanes[i]));
+	    }
+	    free(pq->lanes);
+	    free(pq->weights);
+	    free(pq->credits);
+	    return QUEUE_FAILURE;
+	}
+	/* non-positive weights would starve the lane forever */
+	if(weights && weights[i] > 0){
+	    pq->weights[i] = weights[i];
+	}
+	else{
+	    pq->weights[i] = 1;
+	}
+	pq->credits[i] = 0;
+    }
+
+    return pq->numLanes;
+}
+
+int prio_queue_is_empty(prio_queue* pq){
+    int i;
+
+    for(i=0; i < pq->numLanes; ++i){
+	if(!queue_is_empty(&(pq->lanes[i]))){
+	    return 0;
+	}
+    }
+
+    return 1;
+}
+
+int prio_queue_is_full(prio_queue* pq, int lane){
+    if(lane < 0 || lane >= pq->numLanes){
+	return 1;
+    }
+
+    return queue_is_full(&(pq->lanes[lane]));
+}
+
+int prio_queue_push(prio_queue* pq, int lane, void* new_payload){
+    if(lane < 0 || lane >= pq->numLanes){
+	return QUEUE_FAILURE;
+    }
+
+    return queue_push(&(pq->lanes[lane]), new_payload);
+}
+
+void* prio_queue_pop(prio_queue* pq){
+    int i;
+    int best = -1;
+    int total = 0;
+
+    /* smooth weighted round-robin over the non-empty lanes only,
+     * so idle lanes do not bank credit while they have no work */
+    for(i=0; i < pq->numLanes; ++i){
+	if(queue_is_empty(&(pq->lanes[i]))){
+	    continue;
+	}
+	pq->credits[i] += pq->weights[i];
+	total += pq->weights[i];
+	if(best < 0 || pq->credits[i] > pq->credits[best]){
+	    best = i;
+	}
+    }
+
+    if(best < 0){
+	return NULL;
+    }
+
+    pq->credits[best] -= total;
+
+    return queue_pop(&(pq->lanes[best]));
+}
+
+void prio_queue_cleanup(prio_queue* pq)
+{
+    int i;
+
+    for(i=0; i < pq->numLanes; ++i){
+	queue_cleanup(&(pq->lanes[i]));
+    }
+
+    free(pq->lanes);
+    free(pq->weights);
+    free(pq->credits);
+}
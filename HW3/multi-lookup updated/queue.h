@@ -10,7 +10,8 @@
  * Modify Date: 2012/02/01
  * Modify Date: 2016/09/26
  * Description:
- * 	This is the header file for an implemenation of a simple FIFO queue.
+ * 	This is the header file for an implemenation of a simple FIFO queue
+ *      and a multi-lane weighted priority queue built on top of it.
  * 
  */
 
@@ -35,6 +36,17 @@ typedef struct queue_s{
     int maxSize;
 } queue;
 
+/* A set of FIFO lanes drained by smooth weighted round-robin:
+ * over any window a non-empty lane i gets weights[i] pops out of
+ * every sum(weights) pops, and empty lanes give up their share.
+ * Lane 0 is conventionally the highest priority. */
+typedef struct prio_queue_s{
+    queue* lanes;
+    int* weights;
+    int* credits;
+    int numLanes;
+} prio_queue;
+
 /* Function to initilze a new queue
  * On success, returns queue size
  * On failure, returns QUEUE_FAILURE
@@ -66,4 +78,38 @@ void* queue_pop(queue* q);
 /* Function to free queue memory */
 void queue_cleanup(queue* q);
 
+/* Function to initilize a new priority queue of numLanes lanes
+ * each holding up to size elements. weights[i] is the share of
+ * pops lane i gets while it is non-empty (NULL means equal shares)
+ * On success, returns number of lanes
+ * On failure, returns QUEUE_FAILURE
+ */
+int prio_queue_init(prio_queue* pq, int numLanes, int size,
+		    const int* weights);
+
+/* Function to test if every lane is empty
+ * Returns 1 if empty, 0 otherwise
+ */
+int prio_queue_is_empty(prio_queue* pq);
+
+/* Function to test if a single lane is full
+ * Returns 1 if full, 0 otherwise
+ */
+int prio_queue_is_full(prio_queue* pq, int lane);
+
+/* Function add payload to end of the given lane
+ * Returns QUEUE_SUCCESS if the push successeds.
+ * Returns QUEUE_FAILURE if the push fails or lane is out of range
+ */
+int prio_queue_push(prio_queue* pq, int lane, void* payload);
+
+/* Function to return element from the lane picked by the
+ * weighted round-robin, FIFO order within a lane
+ * Returns NULL pointer if all lanes are empty
+ */
+void* prio_queue_pop(prio_queue* pq);
+
+/* Function to free priority queue memory */
+void prio_queue_cleanup(prio_queue* pq);
+
 #endif
@@ -0,0 +1,507 @@
+/*
+ * File: ringio.c
+ * Author: Shane Sarnac
+ * Project: CSCI 3753 Programming Assignment 3
+ * Description:
+ * 	This file contains the io_uring backed input and output path
+ *      for multi-lookup. The ring is driven with the raw syscalls so
+ *      no liburing is needed.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include "ringio.h"
+
+/* IORING_OP_READ and IORING_OP_WRITE came in 5.6, with the probe.
+ * Older kernels set up the ring but fail every such request with
+ * -EINVAL, so a ring that can't be probed is no use here */
+static int ring_supports(int fd, int opcode){
+    struct io_uring_probe* probe;
+    int ok;
+
+    probe = calloc(1, sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op));
+    if(!probe){
+	return 0;
+    }
+    ok = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE,
+		 probe, 256) == 0
+	&& opcode <= probe->last_op
+	&& (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+
+    return ok;
+}
+
+static int ring_setup(ringio_ring* ring, unsigned entries, int opcode){
+    struct io_uring_params p;
+    int fd;
+
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+
+    memset(&p, 0, sizeof(p));
+    fd = syscall(__NR_io_uring_setup, entries, &p);
+    if(fd < 0){
+	/* no io_uring here, callers fall back to pread/pwrite */
+	return RINGIO_FAILURE;
+    }
+    if(!ring_supports(fd, opcode)){
+	close(fd);
+	return RINGIO_FAILURE;
+    }
+
+    ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP){
+	if(ring->cq_len > ring->sq_len){
+	    ring->sq_len = ring->cq_len;
+	}
+	ring->cq_len = ring->sq_len;
+    }
+
+    ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if(ring->sq_ptr == MAP_FAILED){
+	close(fd);
+	return RINGIO_FAILURE;
+    }
+
+    if(p.features & IORING_FEAT_SINGLE_MMAP){
+	ring->cq_ptr = ring->sq_ptr;
+    }
+    else{
+	ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+			    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	if(ring->cq_ptr == MAP_FAILED){
+	    munmap(ring->sq_ptr, ring->sq_len);
+	    close(fd);
+	    return RINGIO_FAILURE;
+	}
+    }
+
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if(ring->sqes == MAP_FAILED){
+	if(ring->cq_ptr != ring->sq_ptr){
+	    munmap(ring->cq_ptr, ring->cq_len);
+	}
+	munmap(ring->sq_ptr, ring->sq_len);
+	close(fd);
+	return RINGIO_FAILURE;
+    }
+
+    ring->sq_head = (unsigned*)((char*)ring->sq_ptr + p.sq_off.head);
+    ring->sq_tail = (unsigned*)((char*)ring->sq_ptr + p.sq_off.tail);
+    ring->sq_mask = (unsigned*)((char*)ring->sq_ptr + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)((char*)ring->sq_ptr + p.sq_off.array);
+    ring->cq_head = (unsigned*)((char*)ring->cq_ptr + p.cq_off.head);
+    ring->cq_tail = (unsigned*)((char*)ring->cq_ptr + p.cq_off.tail);
+    ring->cq_mask = (unsigned*)((char*)ring->cq_ptr + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)((char*)ring->cq_ptr + p.cq_off.cqes);
+
+    ring->fd = fd;
+    return RINGIO_SUCCESS;
+}
+
+static void ring_teardown(ringio_ring* ring){
+    if(ring->fd < 0){
+	return;
+    }
+    munmap(ring->sqes, ring->sqes_len);
+    if(ring->cq_ptr != ring->sq_ptr){
+	munmap(ring->cq_ptr, ring->cq_len);
+    }
+    munmap(ring->sq_ptr, ring->sq_len);
+    close(ring->fd);
+    ring->fd = -1;
+}
+
+/* Queue one read/write and hand it to the kernel right away.
+ * Callers never queue more than the ring was sized for. */
+static int ring_submit(ringio_ring* ring, int opcode, int fd, void* buf,
+		       size_t len, off_t off, int buf_index,
+		       unsigned long long user_data){
+    struct io_uring_sqe* sqe;
+    unsigned tail;
+    unsigned idx;
+    int rc;
+
+    tail = *ring->sq_tail;
+    idx = tail & *ring->sq_mask;
+    sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long long)(unsigned long)buf;
+    sqe->len = len;
+    sqe->off = off;
+    sqe->buf_index = buf_index;
+    sqe->user_data = user_data;
+    ring->sq_array[idx] = idx;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    do{
+	rc = syscall(__NR_io_uring_enter, ring->fd, 1, 0, 0, NULL, 0);
+    } while(rc < 0 && errno == EINTR);
+    /* the kernel never took the entry: take it back, or the next
+     * enter would submit it behind the caller's synchronous fallback */
+    if(rc <= 0 && __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == tail){
+	__atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+	if(rc == 0){
+	    errno = EAGAIN;
+	}
+	return RINGIO_FAILURE;
+    }
+
+    ring->inflight++;
+    return RINGIO_SUCCESS;
+}
+
+/* Block until one completion is available and pop it */
+static int ring_wait(ringio_ring* ring, unsigned long long* user_data,
+		     int* res){
+    struct io_uring_cqe* cqe;
+    unsigned head;
+    int rc;
+
+    for(;;){
+	head = *ring->cq_head;
+	if(head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)){
+	    break;
+	}
+	rc = syscall(__NR_io_uring_enter, ring->fd, 0, 1,
+		     IORING_ENTER_GETEVENTS, NULL, 0);
+	if(rc < 0 && errno != EINTR){
+	    return RINGIO_FAILURE;
+	}
+    }
+
+    cqe = &ring->cqes[head & *ring->cq_mask];
+    *user_data = cqe->user_data;
+    *res = cqe->res;
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    ring->inflight--;
+
+    return RINGIO_SUCCESS;
+}
+
+/* Read the chunk at r->next_off into bufs[next] with pread
+ * Returns the bytes read or -errno */
+static int reader_read_sync(ringio_reader* r, int next){
+    int res;
+
+    do{
+	res = pread(r->fd, r->bufs[next], RINGIO_READ_CHUNK, r->next_off);
+    } while(res < 0 && errno == EINTR);
+
+    return res < 0 ? -errno : res;
+}
+
+/* Start reading the chunk at r->next_off into the buffer not in use */
+static int reader_start(ringio_reader* r){
+    int next = !r->cur;
+
+    r->pending = 1;
+    if(r->ring.fd >= 0){
+	if(ring_submit(&r->ring, IORING_OP_READ, r->fd, r->bufs[next],
+		       RINGIO_READ_CHUNK, r->next_off, 0, next) == RINGIO_SUCCESS){
+	    return RINGIO_SUCCESS;
+	}
+	ring_teardown(&r->ring);
+    }
+
+    r->sync_res = reader_read_sync(r, next);
+
+    return RINGIO_SUCCESS;
+}
+
+/* Swap in the chunk that was in flight and queue the one after it
+ * Returns 1 if there is new data, 0 at end of file */
+static int reader_fill(ringio_reader* r){
+    unsigned long long user_data;
+    int res;
+
+    if(!r->pending){
+	return 0;
+    }
+
+    if(r->ring.fd >= 0){
+	if(ring_wait(&r->ring, &user_data, &res) == RINGIO_FAILURE){
+	    return RINGIO_FAILURE;
+	}
+	/* the ring refused the request, pread reports a real error */
+	if(res < 0){
+	    res = reader_read_sync(r, !r->cur);
+	}
+    }
+    else{
+	res = r->sync_res;
+    }
+    r->pending = 0;
+
+    if(res < 0){
+	errno = -res;
+	return RINGIO_FAILURE;
+    }
+
+    r->cur = !r->cur;
+    r->len = res;
+    r->pos = 0;
+    r->next_off += res;
+
+    if(res == 0){
+	return 0;
+    }
+
+    reader_start(r);
+    return 1;
+}
+
+int ringio_reader_open(ringio_reader* r, const char* path){
+    memset(r, 0, sizeof(*r));
+    r->ring.fd = -1;
+
+    r->fd = open(path, O_RDONLY);
+    if(r->fd < 0){
+	return RINGIO_FAILURE;
+    }
+
+    r->bufs[0] = malloc(RINGIO_READ_CHUNK);
+    r->bufs[1] = malloc(RINGIO_READ_CHUNK);
+    if(!r->bufs[0] || !r->bufs[1]){
+	free(r->bufs[0]);
+	free(r->bufs[1]);
+	close(r->fd);
+	errno = ENOMEM;
+	return RINGIO_FAILURE;
+    }
+
+    ring_setup(&r->ring, 2, IORING_OP_READ);
+
+    /* cur starts on bufs[1] so the first read lands in bufs[0] */
+    r->cur = 1;
+    reader_start(r);
+
+    return RINGIO_SUCCESS;
+}
+
+int ringio_reader_next(ringio_reader* r, char* word, int maxSize){
+    int wlen = 0;
+    int rc;
+    char c;
+
+    for(;;){
+	if(r->pos == r->len){
+	    rc = reader_fill(r);
+	    if(rc == RINGIO_FAILURE){
+		return RINGIO_FAILURE;
+	    }
+	    if(rc == 0){
+		break;
+	    }
+	}
+
+	c = r->bufs[r->cur][r->pos];
+	if(isspace((unsigned char)c)){
+	    if(wlen > 0){
+		break;
+	    }
+	    r->pos++;
+	    continue;
+	}
+
+	/* word is full, the rest is picked up by the next call */
+	if(wlen == maxSize - 1){
+	    break;
+	}
+	word[wlen++] = c;
+	r->pos++;
+    }
+
+    word[wlen] = '\0';
+    return wlen;
+}
+
+void ringio_reader_close(ringio_reader* r){
+    unsigned long long user_data;
+    int res;
+
+    /* the kernel may still be writing into a buffer */
+    while(r->ring.fd >= 0 && r->ring.inflight > 0){
+	if(ring_wait(&r->ring, &user_data, &res) == RINGIO_FAILURE){
+	    break;
+	}
+    }
+
+    ring_teardown(&r->ring);
+    free(r->bufs[0]);
+    free(r->bufs[1]);
+    close(r->fd);
+}
+
+/* Finish one completed write, writing out any short remainder. A
+ * write the ring refused is done over with pwrite, which reports a
+ * real error */
+static int writer_complete(ringio_writer* w, int i, int res){
+    size_t done;
+    ssize_t n;
+
+    w->busy[i] = 0;
+    done = res < 0 ? 0 : res;
+    while(done < w->lens[i]){
+	n = pwrite(w->fd, w->bufs[i] + done, w->lens[i] - done, w->offs[i] + done);
+	if(n < 0){
+	    if(errno == EINTR){
+		continue;
+	    }
+	    w->lens[i] = 0;
+	    return RINGIO_FAILURE;
+	}
+	done += n;
+    }
+
+    w->lens[i] = 0;
+    return RINGIO_SUCCESS;
+}
+
+/* Reap completions until bufs[i] may be reused */
+static int writer_wait(ringio_writer* w, int i){
+    unsigned long long user_data;
+    int res;
+    int rc = RINGIO_SUCCESS;
+
+    while(w->busy[i]){
+	if(ring_wait(&w->ring, &user_data, &res) == RINGIO_FAILURE){
+	    return RINGIO_FAILURE;
+	}
+	if(writer_complete(w, (int)user_data, res) == RINGIO_FAILURE){
+	    rc = RINGIO_FAILURE;
+	}
+    }
+
+    return rc;
+}
+
+/* Submit the current buffer and move on to the next one */
+static int writer_flush(ringio_writer* w){
+    int i = w->cur;
+    int rc = RINGIO_SUCCESS;
+
+    if(w->lens[i] == 0){
+	return RINGIO_SUCCESS;
+    }
+
+    w->offs[i] = w->next_off;
+    w->next_off += w->lens[i];
+    w->busy[i] = 1;
+
+    if(w->ring.fd < 0
+       || ring_submit(&w->ring,
+		      w->registered ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE,
+		      w->fd, w->bufs[i], w->lens[i], w->offs[i],
+		      w->registered ? i : 0, i) == RINGIO_FAILURE){
+	rc = writer_complete(w, i, 0);
+    }
+
+    w->cur = (i + 1) % RINGIO_WRITE_BUFS;
+    if(w->ring.fd >= 0 && writer_wait(w, w->cur) == RINGIO_FAILURE){
+	rc = RINGIO_FAILURE;
+    }
+
+    return rc;
+}
+
+int ringio_writer_open(ringio_writer* w, const char* path){
+    struct iovec iov[RINGIO_WRITE_BUFS];
+    int i;
+
+    memset(w, 0, sizeof(*w));
+    w->ring.fd = -1;
+
+    w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if(w->fd < 0){
+	return RINGIO_FAILURE;
+    }
+
+    for(i = 0; i < RINGIO_WRITE_BUFS; i++){
+	w->bufs[i] = malloc(RINGIO_WRITE_CHUNK);
+	if(!w->bufs[i]){
+	    while(--i >= 0){
+		free(w->bufs[i]);
+	    }
+	    close(w->fd);
+	    errno = ENOMEM;
+	    return RINGIO_FAILURE;
+	}
+	iov[i].iov_base = w->bufs[i];
+	iov[i].iov_len = RINGIO_WRITE_CHUNK;
+    }
+
+    if(ring_setup(&w->ring, RINGIO_WRITE_BUFS, IORING_OP_WRITE) == RINGIO_SUCCESS){
+	/* pinned buffers skip the per-write page lookups, but they
+	 * count against RLIMIT_MEMLOCK so plain writes are the fallback */
+	w->registered = syscall(__NR_io_uring_register, w->ring.fd,
+				IORING_REGISTER_BUFFERS, iov,
+				RINGIO_WRITE_BUFS) == 0;
+    }
+
+    return RINGIO_SUCCESS;
+}
+
+int ringio_writer_write(ringio_writer* w, const char* data, size_t len){
+    size_t n;
+
+    while(len > 0){
+	if(w->lens[w->cur] == RINGIO_WRITE_CHUNK
+	   && writer_flush(w) == RINGIO_FAILURE){
+	    return RINGIO_FAILURE;
+	}
+	n = RINGIO_WRITE_CHUNK - w->lens[w->cur];
+	if(n > len){
+	    n = len;
+	}
+	memcpy(w->bufs[w->cur] + w->lens[w->cur], data, n);
+	w->lens[w->cur] += n;
+	data += n;
+	len -= n;
+    }
+
+    return RINGIO_SUCCESS;
+}
+
+int ringio_writer_close(ringio_writer* w){
+    int rc = RINGIO_SUCCESS;
+    int i;
+
+    if(writer_flush(w) == RINGIO_FAILURE){
+	rc = RINGIO_FAILURE;
+    }
+    if(w->ring.fd >= 0){
+	for(i = 0; i < RINGIO_WRITE_BUFS; i++){
+	    if(writer_wait(w, i) == RINGIO_FAILURE){
+		rc = RINGIO_FAILURE;
+	    }
+	}
+    }
+
+    ring_teardown(&w->ring);
+    for(i = 0; i < RINGIO_WRITE_BUFS; i++){
+	free(w->bufs[i]);
+    }
+    if(close(w->fd) < 0){
+	rc = RINGIO_FAILURE;
+    }
+
+    return rc;
+}
@@ -0,0 +1,105 @@
+/*
+ * File: ringio.h
+ * Author: Shane Sarnac
+ * Project: CSCI 3753 Programming Assignment 3
+ * Description:
+ * 	This is the header file for the io_uring backed input and
+ *      output path used by multi-lookup. Input files are read in
+ *      large chunks with the next chunk always in flight, and output
+ *      is gathered into registered buffers that are written
+ *      asynchronously. When the kernel has no io_uring (or it is
+ *      disallowed) the same calls fall back to pread/pwrite.
+ *
+ */
+
+#ifndef RINGIO_H
+#define RINGIO_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <linux/io_uring.h>
+
+#define RINGIO_FAILURE -1
+#define RINGIO_SUCCESS 0
+
+#define RINGIO_READ_CHUNK (128 * 1024)
+#define RINGIO_WRITE_CHUNK (256 * 1024)
+#define RINGIO_WRITE_BUFS 4
+
+typedef struct ringio_ring_s{
+    int fd;                     /* -1 when running synchronously */
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+    void* sq_ptr;
+    size_t sq_len;
+    void* cq_ptr;
+    size_t cq_len;
+    size_t sqes_len;
+    unsigned inflight;
+} ringio_ring;
+
+typedef struct ringio_reader_s{
+    ringio_ring ring;
+    int fd;
+    char* bufs[2];
+    int cur;                    /* buffer being parsed */
+    size_t len;
+    size_t pos;
+    off_t next_off;             /* file offset of the in-flight read */
+    int pending;                /* a read into bufs[!cur] is queued */
+    int sync_res;               /* result of the fallback pread */
+} ringio_reader;
+
+typedef struct ringio_writer_s{
+    ringio_ring ring;
+    int fd;
+    int registered;             /* bufs are registered with the ring */
+    char* bufs[RINGIO_WRITE_BUFS];
+    size_t lens[RINGIO_WRITE_BUFS];
+    int busy[RINGIO_WRITE_BUFS];
+    off_t offs[RINGIO_WRITE_BUFS];
+    int cur;
+    off_t next_off;
+} ringio_writer;
+
+/* Function to open path for chunked asynchronous reading
+ * Returns RINGIO_SUCCESS or RINGIO_FAILURE (errno is set)
+ */
+int ringio_reader_open(ringio_reader* r, const char* path);
+
+/* Function to copy the next whitespace separated word into word,
+ * at most maxSize-1 characters, in the same way as fscanf("%1024s")
+ * Returns the length of the word, 0 at end of file or
+ * RINGIO_FAILURE on a read error
+ */
+int ringio_reader_next(ringio_reader* r, char* word, int maxSize);
+
+/* Function to wait for any outstanding read and free the reader */
+void ringio_reader_close(ringio_reader* r);
+
+/* Function to create/truncate path for asynchronous writing
+ * Returns RINGIO_SUCCESS or RINGIO_FAILURE (errno is set)
+ */
+int ringio_writer_open(ringio_writer* w, const char* path);
+
+/* Function to append len bytes of data to the output. Data is
+ * copied, the write is submitted once a buffer fills up
+ * Not thread safe, callers serialize access to a writer
+ * Returns RINGIO_SUCCESS or RINGIO_FAILURE
+ */
+int ringio_writer_write(ringio_writer* w, const char* data, size_t len);
+
+/* Function to submit buffered data, wait for every write to
+ * complete and close the file
+ * Returns RINGIO_SUCCESS or RINGIO_FAILURE if any write failed
+ */
+int ringio_writer_close(ringio_writer* w);
+
+#endif
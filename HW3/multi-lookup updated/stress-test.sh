@@ -0,0 +1,102 @@
+#!/bin/bash
+# File: stress-test.sh
+# Author: Shane Sarnac
+# Project: CSCI 3753 Programming Assignment 3
+# Description:
+#	Stress test for the multi-lookup requester/resolver shutdown.
+#	Every iteration writes a random number of tiny input files,
+#	runs multi_lookup_stress (fake dnslookup with random delays)
+#	with a random resolver count and random priorities, and checks
+#	that every name comes out exactly once. The shutdown time the
+#	binary reports must stay under SHUTDOWN_LIMIT_MS.
+#
+# Usage: ./stress-test.sh [iterations]
+# Tunables (environment): MAX_FILES MAX_LINES MAX_THREADS
+#	SHUTDOWN_LIMIT_MS STRESS_MAX_DELAY_US STRESS_FAIL_PERCENT SEED
+
+ITERATIONS=${1:-20}
+MAX_FILES=${MAX_FILES:-2000}
+MAX_LINES=${MAX_LINES:-4}
+MAX_THREADS=${MAX_THREADS:-16}
+SHUTDOWN_LIMIT_MS=${SHUTDOWN_LIMIT_MS:-1000}
+RANDOM=${SEED:-$$}
+
+BIN=./multi_lookup_stress
+if [ ! -x $BIN ]; then
+	echo "$BIN not built, run make multi_lookup_stress" >&2
+	exit 1
+fi
+
+# two fds per input file (the file and its ring)
+ulimit -n $(ulimit -Hn) 2>/dev/null
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+failures=0
+worst_ms=0
+
+for ((iter = 1; iter <= ITERATIONS; iter++)); do
+	rm -rf "$WORK"/*
+	nfiles=$((RANDOM % MAX_FILES + 1))
+	threads=$((RANDOM % MAX_THREADS + 1))
+
+	# one awk process for all files, names are unique per run
+	awk -v n=$nfiles -v max=$MAX_LINES -v dir="$WORK" -v seed=$RANDOM '
+	BEGIN {
+		srand(seed)
+		for (f = 0; f < n; f++) {
+			file = sprintf("%s/in%05d.txt", dir, f)
+			lines = int(rand() * (max + 1))
+			for (l = 0; l < lines; l++)
+				printf "s%d-f%d-l%d.test\n", seed, f, l > file
+			printf "" > file
+			close(file)
+		}
+	}'
+	cat "$WORK"/in*.txt | sort > "$WORK/expected"
+
+	args=()
+	for f in "$WORK"/in*.txt; do
+		args+=(-p $((RANDOM % 3)) "$f")
+	done
+
+	start=$(date +%s%N)
+	timeout 120 $BIN -n $threads "${args[@]}" "$WORK/out.txt" 2> "$WORK/stderr"
+	rc=$?
+	end=$(date +%s%N)
+
+	shutdown_ms=$(sed -n 's/^stress: shutdown_ms=//p' "$WORK/stderr")
+	cut -d, -f1 "$WORK/out.txt" | sort > "$WORK/actual"
+	expected=$(wc -l < "$WORK/expected")
+	actual=$(wc -l < "$WORK/actual")
+	dups=$(uniq -d "$WORK/actual" | wc -l)
+	missing=$(comm -23 "$WORK/expected" "$WORK/actual" | wc -l)
+	extra=$(comm -13 "$WORK/expected" "$WORK/actual" | wc -l)
+	empty=$(grep -c ',$' "$WORK/out.txt")
+
+	status=ok
+	if [ $rc -ne 0 ] || [ -z "$shutdown_ms" ]; then
+		status="exit $rc"
+	elif [ $dups -ne 0 ] || [ $missing -ne 0 ] || [ $extra -ne 0 ]; then
+		status="records"
+	elif [ "${STRESS_FAIL_PERCENT:-0}" -eq 0 ] && [ $empty -ne 0 ]; then
+		status="empty answers"
+	elif awk -v s="$shutdown_ms" -v l=$SHUTDOWN_LIMIT_MS 'BEGIN { exit !(s > l) }'; then
+		status="slow shutdown"
+	fi
+
+	printf "%3d files=%-5d threads=%-3d names=%-5d/%-5d dup=%d miss=%d extra=%d wall_ms=%d shutdown_ms=%s %s\n" \
+		$iter $nfiles $threads $actual $expected $dups $missing $extra \
+		$(((end - start) / 1000000)) "${shutdown_ms:-?}" "$status"
+
+	if [ "$status" != ok ]; then
+		failures=$((failures + 1))
+	fi
+	if [ -n "$shutdown_ms" ] && awk -v s="$shutdown_ms" -v w=$worst_ms 'BEGIN { exit !(s > w) }'; then
+		worst_ms=$shutdown_ms
+	fi
+done
+
+echo "$failures of $ITERATIONS iterations failed, worst shutdown ${worst_ms}ms"
+[ $failures -eq 0 ]
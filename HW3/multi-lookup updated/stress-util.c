@@ -0,0 +1,91 @@
+/*
+ * File: stress-util.c
+ * Author: Shane Sarnac
+ * Project: CSCI 3753 Programming Assignment 3
+ * Description:
+ * 	Stand-in for util.c used by the stress build. dnslookup()
+ *      and reverselookup() never touch the network: they sleep for a
+ *      random time and answer with a value derived from the query,
+ *      so a run can be checked line by line.
+ *
+ *      STRESS_MAX_DELAY_US  upper bound of the random delay (default 2000)
+ *      STRESS_FAIL_PERCENT  chance a lookup fails (default 0)
+ *
+ */
+
+#include <unistd.h>
+#include <pthread.h>
+
+#include "util.h"
+
+static pthread_once_t stress_once = PTHREAD_ONCE_INIT;
+static unsigned int max_delay_us = 2000;
+static unsigned int fail_percent = 0;
+
+static void stress_init(void){
+    char* env;
+
+    env = getenv("STRESS_MAX_DELAY_US");
+    if(env){
+	max_delay_us = strtoul(env, NULL, 10);
+    }
+    env = getenv("STRESS_FAIL_PERCENT");
+    if(env){
+	fail_percent = strtoul(env, NULL, 10);
+    }
+}
+
+/* FNV-1a, a fixed answer per name */
+static unsigned int stress_hash(const char* s){
+    unsigned int h = 2166136261u;
+
+    for(; *s; s++){
+	h ^= (unsigned char)*s;
+	h *= 16777619u;
+    }
+
+    return h;
+}
+
+/* Random delay and failure shared by both lookups
+ * Returns UTIL_FAILURE when this lookup should fail */
+static int stress_delay(const char* name){
+    /* seeded from the name so threads never share rand() state */
+    unsigned int seed = stress_hash(name) ^ (unsigned int)pthread_self();
+
+    pthread_once(&stress_once, stress_init);
+
+    if(max_delay_us > 0){
+	usleep(rand_r(&seed) % (max_delay_us + 1));
+    }
+
+    if(fail_percent > 0 && (unsigned int)(rand_r(&seed) % 100) < fail_percent){
+	return UTIL_FAILURE;
+    }
+
+    return UTIL_SUCCESS;
+}
+
+int dnslookup(const char* hostname, char* firstIPstr, int maxSize){
+    unsigned int h;
+
+    if(stress_delay(hostname) == UTIL_FAILURE){
+	return UTIL_FAILURE;
+    }
+
+    h = stress_hash(hostname);
+    snprintf(firstIPstr, maxSize, "10.%u.%u.%u",
+	     (h >> 16) & 0xff, (h >> 8) & 0xff, h & 0xff);
+
+    return UTIL_SUCCESS;
+}
+
+int reverselookup(const char* ipstr, char* hostname, int maxSize){
+    if(stress_delay(ipstr) == UTIL_FAILURE){
+	return UTIL_FAILURE;
+    }
+
+    snprintf(hostname, maxSize, "host-%08x.stress", stress_hash(ipstr));
+
+    return UTIL_SUCCESS;
+}
@@ -0,0 +1,229 @@
+/*
+ * File: trace.c
+ * Author: Shane Sarnac
+ * Project: CSCI 3753 Programming Assignment 3
+ * Description:
+ * 	This file contains the per-hostname latency trace for
+ *      multi-lookup.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "trace.h"
+
+typedef struct trace_thread_s{
+    int tid;
+    char* name;
+    struct trace_thread_s* next;
+} trace_thread;
+
+static trace_record* ring = NULL;
+static int ring_size = 0;
+static unsigned long ring_next = 0;
+static long long trace_start = 0;
+static trace_thread* threads = NULL;
+static pthread_mutex_t threads_access = PTHREAD_MUTEX_INITIALIZER;
+
+static long long clock_ns(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int trace_init(int capacity){
+    size_t bytes, i;
+    long page;
+
+    if(capacity <= 0){
+	capacity = TRACE_CAPACITY;
+    }
+
+    ring = calloc(capacity, sizeof(trace_record));
+    if(!ring){
+	perror("Error on trace Malloc");
+	return TRACE_FAILURE;
+    }
+
+    /* a large calloc is fresh zero pages, mapped on first write: write
+     * one byte of each now so the run does not take the faults */
+    bytes = (size_t)capacity * sizeof(trace_record);
+    page = sysconf(_SC_PAGESIZE);
+    if(page <= 0){
+	page = 4096;
+    }
+    for(i = 0; i < bytes; i += page){
+	((volatile char*)ring)[i] = 0;
+    }
+
+    ring_size = capacity;
+    ring_next = 0;
+    trace_start = clock_ns();
+
+    return TRACE_SUCCESS;
+}
+
+int trace_enabled(void){
+    return ring != NULL;
+}
+
+long long trace_now(void){
+    if(!ring){
+	return 0;
+    }
+    return clock_ns();
+}
+
+void trace_thread_name(int tid, const char* name){
+    trace_thread* t;
+
+    if(!ring){
+	return;
+    }
+
+    t = malloc(sizeof(trace_thread));
+    if(!t){
+	return;
+    }
+    t->tid = tid;
+    t->name = strdup(name);
+
+    pthread_mutex_lock(&threads_access);
+    t->next = threads;
+    threads = t;
+    pthread_mutex_unlock(&threads_access);
+}
+
+void trace_commit(const char* hostname, const trace_times* times,
+		  int resolver){
+    trace_record* rec;
+    unsigned long slot;
+
+    if(!ring){
+	return;
+    }
+
+    slot = __atomic_fetch_add(&ring_next, 1, __ATOMIC_RELAXED) % ring_size;
+    rec = &ring[slot];
+    strncpy(rec->hostname, hostname, TRACE_NAME_MAX);
+    rec->hostname[TRACE_NAME_MAX-1] = '\0';
+    rec->times = *times;
+    rec->resolver = resolver;
+}
+
+/* Write s as the body of a JSON string */
+static void json_string(FILE* fp, const char* s){
+    for(; *s; s++){
+	if(*s == '"' || *s == '\\'){
+	    fprintf(fp, "\\%c", *s);
+	}
+	else if((unsigned char)*s < 0x20){
+	    fprintf(fp, "\\u%04x", (unsigned char)*s);
+	}
+	else{
+	    fputc(*s, fp);
+	}
+    }
+}
+
+/* Trace timestamps are microseconds from trace_init */
+static double trace_us(long long ns){
+    return (ns - trace_start) / 1000.0;
+}
+
+/* One complete ("X") event, the args carry the name and lane */
+static void json_event(FILE* fp, const char* name, int tid,
+		       long long start, long long end,
+		       const trace_record* rec, const char* sep){
+    fprintf(fp, "%s\n{\"name\":\"%s\",\"cat\":\"lookup\",\"ph\":\"X\","
+	    "\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+	    "\"args\":{\"host\":\"", sep, name, tid, trace_us(start),
+	    (end - start) / 1000.0);
+    json_string(fp, rec->hostname);
+    fprintf(fp, "\",\"lane\":%d}}", rec->times.lane);
+}
+
+int trace_dump(const char* path){
+    FILE* fp;
+    trace_thread* t;
+    const trace_record* rec;
+    unsigned long count;
+    unsigned long i;
+    const char* sep = "";
+
+    if(!ring){
+	return TRACE_FAILURE;
+    }
+
+    fp = fopen(path, "w");
+    if(!fp){
+	return TRACE_FAILURE;
+    }
+
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+    pthread_mutex_lock(&threads_access);
+    for(t = threads; t; t = t->next){
+	fprintf(fp, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+		"\"tid\":%d,\"args\":{\"name\":\"", sep, t->tid);
+	json_string(fp, t->name);
+	fprintf(fp, "\"}}");
+	sep = ",";
+    }
+    pthread_mutex_unlock(&threads_access);
+
+    count = ring_next;
+    if(count > (unsigned long)ring_size){
+	count = ring_size;
+    }
+
+    for(i = 0; i < count; i++){
+	rec = &ring[i];
+
+	json_event(fp, "resolve", rec->times.requester,
+		   rec->times.resolve_start, rec->times.resolve_end, rec, sep);
+	sep = ",";
+	json_event(fp, "enqueue wait", rec->times.requester,
+		   rec->times.resolve_end, rec->times.enqueue, rec, sep);
+	json_event(fp, "write", rec->resolver,
+		   rec->times.dequeue, rec->times.write, rec, sep);
+
+	/* time spent sitting in the queue crosses threads, so it
+	 * goes out as an async span keyed by the record slot */
+	fprintf(fp, ",\n{\"name\":\"queued\",\"cat\":\"queue\",\"ph\":\"b\","
+		"\"pid\":1,\"tid\":%d,\"id\":%lu,\"ts\":%.3f}",
+		rec->times.requester, i, trace_us(rec->times.enqueue));
+	fprintf(fp, ",\n{\"name\":\"queued\",\"cat\":\"queue\",\"ph\":\"e\","
+		"\"pid\":1,\"tid\":%d,\"id\":%lu,\"ts\":%.3f}",
+		rec->resolver, i, trace_us(rec->times.dequeue));
+    }
+
+    fprintf(fp, "\n]}\n");
+
+    if(fclose(fp)){
+	return TRACE_FAILURE;
+    }
+
+    return TRACE_SUCCESS;
+}
+
+void trace_cleanup(void){
+    trace_thread* t;
+
+    while(threads){
+	t = threads;
+	threads = t->next;
+	free(t->name);
+	free(t);
+    }
+
+    free(ring);
+    ring = NULL;
+    ring_size = 0;
+}
@@ -0,0 +1,72 @@
+/*
+ * File: trace.h
+ * Author: Shane Sarnac
+ * Project: CSCI 3753 Programming Assignment 3
+ * Description:
+ * 	This is the header file for the optional per-hostname latency
+ *      trace. Timings are kept in a ring allocated up front, so a
+ *      traced run does no allocation per name, and are written out
+ *      at exit in the Chrome trace event JSON format, which loads in
+ *      chrome://tracing and ui.perfetto.dev.
+ *
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#define TRACE_FAILURE -1
+#define TRACE_SUCCESS 0
+
+#define TRACE_CAPACITY 65536
+#define TRACE_NAME_MAX 128
+
+/* Timestamps (trace_now() nanoseconds) for one name on its way
+ * through the pipeline. Stays zeroed when tracing is off. */
+typedef struct trace_times_s{
+    long long resolve_start;
+    long long resolve_end;
+    long long enqueue;
+    long long dequeue;
+    long long write;
+    int requester;
+    int lane;
+} trace_times;
+
+typedef struct trace_record_s{
+    char hostname[TRACE_NAME_MAX];
+    trace_times times;
+    int resolver;
+} trace_record;
+
+/* Function to allocate the ring and turn tracing on. When more
+ * than capacity names go by, the oldest records are overwritten
+ * Returns TRACE_SUCCESS or TRACE_FAILURE
+ */
+int trace_init(int capacity);
+
+/* Function to test if tracing is on
+ * Returns 1 if trace_init succeeded, 0 otherwise
+ */
+int trace_enabled(void);
+
+/* Function to read the trace clock
+ * Returns monotonic nanoseconds, or 0 while tracing is off
+ */
+long long trace_now(void);
+
+/* Function to name a thread in the trace. tid 0 is reserved */
+void trace_thread_name(int tid, const char* name);
+
+/* Function to store one finished name in the ring. Thread safe */
+void trace_commit(const char* hostname, const trace_times* times,
+		  int resolver);
+
+/* Function to write every stored record to path as JSON
+ * Returns TRACE_SUCCESS or TRACE_FAILURE
+ */
+int trace_dump(const char* path);
+
+/* Function to free trace memory */
+void trace_cleanup(void);
+
+#endif
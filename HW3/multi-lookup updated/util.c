@@ -83,3 +83,52 @@ int dnslookup(const char* hostname, char* firstIPstr, int maxSize){
 
     return UTIL_SUCCESS;
 }
+
+int reverselookup(const char* ipstr, char* hostname, int maxSize){
+
+    /* Local vars */
+    struct sockaddr_storage addr;
+    struct sockaddr_in* ipv4sock = (struct sockaddr_in*)&addr;
+    struct sockaddr_in6* ipv6sock = (struct sockaddr_in6*)&addr;
+    socklen_t addrlen;
+    char host[NI_MAXHOST];
+    int addrError = 0;
+
+#ifdef UTIL_DEBUG
+    fprintf(stderr, "%s\n", ipstr);
+#endif
+
+    /* Parse Address, IPv4 first */
+    memset(&addr, 0, sizeof(addr));
+    if(inet_pton(AF_INET, ipstr, &(ipv4sock->sin_addr)) == 1){
+	ipv4sock->sin_family = AF_INET;
+	addrlen = sizeof(*ipv4sock);
+    }
+    else if(inet_pton(AF_INET6, ipstr, &(ipv6sock->sin6_addr)) == 1){
+	ipv6sock->sin6_family = AF_INET6;
+	addrlen = sizeof(*ipv6sock);
+    }
+    else{
+	fprintf(stderr, "Not an IP Address: %s\n", ipstr);
+	return UTIL_FAILURE;
+    }
+
+    /* Lookup Address, NI_NAMEREQD so a missing PTR is an error
+     * instead of the address echoed back */
+    addrError = getnameinfo((struct sockaddr*)&addr, addrlen,
+			    host, sizeof(host), NULL, 0, NI_NAMEREQD);
+    if(addrError){
+	fprintf(stderr, "Error looking up Name: %s\n",
+		gai_strerror(addrError));
+	return UTIL_FAILURE;
+    }
+
+#ifdef UTIL_DEBUG
+    fprintf(stdout, "%s\n", host);
+#endif
+
+    strncpy(hostname, host, maxSize);
+    hostname[maxSize-1] = '\0';
+
+    return UTIL_SUCCESS;
+}
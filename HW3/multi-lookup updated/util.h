@@ -39,4 +39,12 @@ int dnslookup(const char* hostname,
 	      char* firstIPstr,
 	      int maxSize);
 
+/* Fuction to return the host name registered (PTR record)
+ * for an IPv4 or IPv6 address given as a string. Name
+ * returned as string hostname of size maxsize
+ */
+int reverselookup(const char* ipstr,
+		  char* hostname,
+		  int maxSize);
+
 #endif
@@ -0,0 +1,308 @@
+/* aes-crypt-bench.c
+ * Throughput of do_crypt() against crypt_fd()
+ *
+ * By Shane Sarnac
+ *
+ * Fills <scratch dir>/bench.in with <MB> megabytes of random data, then
+ * encrypts and decrypts it with both functions, best of three runs each,
+ * and prints GB/s. The outputs of the two functions are compared too.
+ * par_encrypt_fd()/par_decrypt_fd() with one thread per CPU are timed
+ * last, for comparison. Each call of those runs PBKDF2 once; that is
+ * timed on its own and left out of their times.
+ *
+ * usage: aes-crypt-bench <scratch dir> [MB]
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <openssl/rand.h>
+
+#include "aes-crypt.h"
+
+#define RUNS 3
+#define KEY_PHRASE "aes-crypt-bench"
+
+static char in_path[1024];
+static char out_path[1024];
+static char back_path[1024];
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double time_do_crypt(const char* from, const char* to, int action)
+{
+    FILE* in;
+    FILE* out;
+    double start, end;
+
+    in = fopen(from, "rb");
+    out = fopen(to, "wb+");
+    if(!in || !out){
+	perror("fopen error");
+	exit(EXIT_FAILURE);
+    }
+
+    start = now();
+    if(!do_crypt(in, out, action, KEY_PHRASE) || fflush(out)){
+	fprintf(stderr, "do_crypt failed\n");
+	exit(EXIT_FAILURE);
+    }
+    end = now();
+
+    fclose(out);
+    fclose(in);
+    return end - start;
+}
+
+static double time_crypt_fd(const char* from, const char* to, int action,
+			    const crypt_key* key, unsigned char* buf)
+{
+    int in;
+    int out;
+    double start, end;
+
+    in = open(from, O_RDONLY);
+    out = open(to, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(in < 0 || out < 0){
+	perror("open error");
+	exit(EXIT_FAILURE);
+    }
+
+    start = now();
+    if(!crypt_fd(in, out, action, key, buf, STREAM_CHUNK)){
+	fprintf(stderr, "crypt_fd failed\n");
+	exit(EXIT_FAILURE);
+    }
+    end = now();
+
+    close(out);
+    close(in);
+    return end - start;
+}
+
+/* One PBKDF2 derivation, as every par_encrypt_fd()/par_decrypt_fd()
+ * call runs before its chunks */
+static double time_kdf(void)
+{
+    unsigned char salt[KDF_SALT_SIZE];
+    crypt_key key;
+    double start, end;
+
+    RAND_bytes(salt, sizeof(salt));
+    start = now();
+    if(!derive_key(&key, KEY_PHRASE, KDF_PBKDF2, salt, KDF_SALT_SIZE,
+		   KDF_PBKDF2_ITER)){
+	fprintf(stderr, "derive_key failed\n");
+	exit(EXIT_FAILURE);
+    }
+    end = now();
+
+    key_cleanup(&key);
+    return end - start;
+}
+
+static double time_par(const char* from, const char* to, int action)
+{
+    int in;
+    int out;
+    int ok;
+    double start, end;
+
+    in = open(from, O_RDONLY);
+    out = open(to, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(in < 0 || out < 0){
+	perror("open error");
+	exit(EXIT_FAILURE);
+    }
+
+    start = now();
+    if(action == 1){
+	ok = par_encrypt_fd(in, out, KEY_PHRASE, 0, STREAM_CHUNK);
+    }
+    else{
+	ok = par_decrypt_fd(in, out, KEY_PHRASE, 0);
+    }
+    if(!ok){
+	fprintf(stderr, "parallel crypt failed\n");
+	exit(EXIT_FAILURE);
+    }
+    end = now();
+
+    close(out);
+    close(in);
+    return end - start;
+}
+
+/* returns 1 if the two files have the same bytes */
+static int same_file(const char* a, const char* b)
+{
+    FILE* fa = fopen(a, "rb");
+    FILE* fb = fopen(b, "rb");
+    int ca, cb;
+    int same = (fa && fb);
+
+    while(same){
+	ca = getc(fa);
+	cb = getc(fb);
+	if(ca != cb){
+	    same = 0;
+	}
+	if(ca == EOF){
+	    break;
+	}
+    }
+
+    if(fa){
+	fclose(fa);
+    }
+    if(fb){
+	fclose(fb);
+    }
+    return same;
+}
+
+static void report(const char* name, double seconds, long long bytes)
+{
+    printf("%-24s %8.3f s %8.3f GB/s\n", name, seconds, bytes / seconds / 1e9);
+}
+
+int main(int argc, char **argv)
+{
+    long long bytes;
+    long long done;
+    size_t n;
+    unsigned char* buf;
+    crypt_key key;
+    double best[7];
+    double t;
+    FILE* fp;
+    int mb = 512;
+    int run;
+    int i;
+
+    if(argc < 2 || argc > 3){
+	fprintf(stderr, "usage: %s <scratch dir> [MB]\n", argv[0]);
+	exit(EXIT_FAILURE);
+    }
+    if(argc == 3){
+	mb = atoi(argv[2]);
+	if(mb <= 0){
+	    fprintf(stderr, "MB must be positive\n");
+	    exit(EXIT_FAILURE);
+	}
+    }
+    snprintf(in_path, sizeof(in_path), "%s/bench.in", argv[1]);
+    snprintf(out_path, sizeof(out_path), "%s/bench.out", argv[1]);
+    snprintf(back_path, sizeof(back_path), "%s/bench.back", argv[1]);
+
+    buf = crypt_buf_alloc(STREAM_CHUNK);
+    if(!buf || !derive_key(&key, KEY_PHRASE, KDF_LEGACY, NULL, 0, 0)){
+	fprintf(stderr, "setup failed\n");
+	exit(EXIT_FAILURE);
+    }
+
+    /* Random plaintext, not a multiple of the cipher block */
+    bytes = (long long)mb * 1024 * 1024 + 7;
+    fp = fopen(in_path, "wb");
+    if(!fp){
+	perror("fopen error");
+	exit(EXIT_FAILURE);
+    }
+    for(done = 0; done < bytes; done += n){
+	n = (bytes - done < STREAM_CHUNK) ? bytes - done : STREAM_CHUNK;
+	RAND_bytes(buf, n);
+	fwrite(buf, 1, n, fp);
+    }
+    fclose(fp);
+
+    for(i = 0; i < 7; i++){
+	best[i] = 1e9;
+    }
+
+    for(run = 0; run < RUNS; run++){
+	t = time_do_crypt(in_path, out_path, 1);
+	if(t < best[0]){
+	    best[0] = t;
+	}
+	t = time_do_crypt(out_path, back_path, 0);
+	if(t < best[1]){
+	    best[1] = t;
+	}
+    }
+    /* keep do_crypt's ciphertext to check crypt_fd against */
+    rename(out_path, back_path);
+
+    for(run = 0; run < RUNS; run++){
+	t = time_crypt_fd(in_path, out_path, 1, &key, buf);
+	if(t < best[2]){
+	    best[2] = t;
+	}
+    }
+    if(!same_file(out_path, back_path)){
+	fprintf(stderr, "crypt_fd and do_crypt ciphertexts differ\n");
+	exit(EXIT_FAILURE);
+    }
+    for(run = 0; run < RUNS; run++){
+	t = time_crypt_fd(out_path, back_path, 0, &key, buf);
+	if(t < best[3]){
+	    best[3] = t;
+	}
+    }
+    if(!same_file(in_path, back_path)){
+	fprintf(stderr, "crypt_fd decrypt does not round trip\n");
+	exit(EXIT_FAILURE);
+    }
+
+    /* the fastest PBKDF2 run is taken off each parallel run, which
+     * spends at least that long in its own */
+    for(run = 0; run < RUNS; run++){
+	t = time_kdf();
+	if(t < best[6]){
+	    best[6] = t;
+	}
+    }
+    for(run = 0; run < RUNS; run++){
+	t = time_par(in_path, out_path, 1) - best[6];
+	if(t < best[4]){
+	    best[4] = t;
+	}
+	t = time_par(out_path, back_path, 0) - best[6];
+	if(t < best[5]){
+	    best[5] = t;
+	}
+    }
+    if(!same_file(in_path, back_path)){
+	fprintf(stderr, "parallel decrypt does not round trip\n");
+	exit(EXIT_FAILURE);
+    }
+
+    printf("%d MB, best of %d, %ld CPUs\n", mb, RUNS,
+	   sysconf(_SC_NPROCESSORS_ONLN));
+    report("do_crypt encrypt", best[0], bytes);
+    report("do_crypt decrypt", best[1], bytes);
+    report("crypt_fd encrypt", best[2], bytes);
+    report("crypt_fd decrypt", best[3], bytes);
+    report("par_encrypt_fd", best[4], bytes);
+    report("par_decrypt_fd", best[5], bytes);
+    printf("%-24s %8.3f s per call, not counted above\n", "PBKDF2", best[6]);
+
+    unlink(in_path);
+    unlink(out_path);
+    unlink(back_path);
+    key_cleanup(&key);
+    free(buf);
+
+    return EXIT_SUCCESS;
+}
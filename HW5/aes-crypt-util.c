@@ -0,0 +1,209 @@
+/* aes-crypt-util.c
+ * AES encryption demo program using OpenSSL EVP API via local aes-crypt library
+ *
+ * See aes-crypt.h and aes-crypt.c for more details
+ *
+ * Files are streamed with crypt_fd() in STREAM_CHUNK pieces. The output
+ * is the same as the original do_crypt() based utility's. An optional
+ * leading -D opens both files with O_DIRECT. It cannot be combined with
+ * -p, whose header and chunk offsets are not aligned for O_DIRECT.
+ *
+ * -p <threads> switches -e and -d to the parallel container format (see
+ * par_encrypt_fd in aes-crypt.h): AES-256-GCM or ChaCha20-Poly1305
+ * chunks, whichever aead_select() finds faster here (it says which on
+ * stderr), spread over <threads> threads, 0 for one per CPU, at most
+ * PAR_MAX_THREADS.
+ *
+ * By Andy Sayler (www.andysayler.com)
+ * Created  04/17/12
+ * Modified 04/18/12
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "aes-crypt.h"
+
+/* Parse a -p thread count: a whole number from 0 to PAR_MAX_THREADS */
+static int parse_threads(const char* arg, int* threads){
+    char* end;
+    long n;
+
+    errno = 0;
+    n = strtol(arg, &end, 10);
+    if(end == arg || *end != '\0' || errno == ERANGE
+       || n < 0 || n > PAR_MAX_THREADS){
+	return -1;
+    }
+    *threads = (int) n;
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    
+    /* Local vars */
+    int action = 0;
+    int ifarg;
+    int ofarg;
+    int inFd = -1;
+    int outFd = -1;
+    int direct = 0;
+    int threads = -1;
+    char* key_str = NULL;
+    crypt_key key;
+    unsigned char* buf = NULL;
+    int res = EXIT_SUCCESS;
+
+    /* Leading options */
+    while(argc > 1){
+	/* Bypass the page cache? */
+	if(!strcmp(argv[1], "-D")){
+	    direct = O_DIRECT;
+	}
+	/* Parallel container format? */
+	else if(!strcmp(argv[1], "-p") && argc > 2){
+	    if(parse_threads(argv[2], &threads)){
+		fprintf(stderr, "-p wants a thread count from 0 to %d, not %s\n",
+			PAR_MAX_THREADS, argv[2]);
+		exit(EXIT_FAILURE);
+	    }
+	    argv[2] = argv[0];
+	    argv++;
+	    argc--;
+	}
+	else{
+	    break;
+	}
+	argv[1] = argv[0];
+	argv++;
+	argc--;
+    }
+
+    /* Check General Input */
+    if(argc < 3){
+	fprintf(stderr, "usage: %s %s\n", argv[0],
+		"[-D | -p threads] <type> <opt key phrase> <in path> <out path>");
+	exit(EXIT_FAILURE);
+    }
+    if(direct && threads >= 0){
+	fprintf(stderr, "-D cannot be combined with -p\n");
+	exit(EXIT_FAILURE);
+    }
+
+    /* Encrypt Case */
+    if(!strcmp(argv[1], "-e")){
+	/* Check Args */
+	if(argc != 5){
+	    fprintf(stderr, "usage: %s %s\n", argv[0],
+		    "-e <key phrase> <in path> <out path>");
+	    exit(EXIT_FAILURE);
+	}
+	/* Set Vars */
+	key_str = argv[2];
+	ifarg = 3;
+	ofarg = 4;
+	action = 1;
+    }
+    /* Decrypt Case */
+    else if(!strcmp(argv[1], "-d")){
+	/* Check Args */
+	if(argc != 5){
+	    fprintf(stderr, "usage: %s %s\n", argv[0],
+		    "-d <key phrase> <in path> <out path>");
+	    exit(EXIT_FAILURE);
+	}
+	/* Set Vars */
+	key_str = argv[2];
+	ifarg = 3;
+	ofarg = 4;
+	action = 0;
+    }
+    /* Pass-Through (Copy) Case */
+    else if(!strcmp(argv[1], "-c")){
+	/* Check Args */
+	if(argc != 4){
+	    fprintf(stderr, "usage: %s %s\n", argv[0],
+		    "-c <in path> <out path>");
+	    exit(EXIT_FAILURE);
+	}
+	/* Set Vars */
+	key_str = NULL;
+	ifarg = 2;
+	ofarg = 3;
+	action = -1;
+    }
+    /* Bad Case */
+    else {
+	fprintf(stderr, "Unkown action\n");
+	exit(EXIT_FAILURE);
+    }
+
+    /* Open Files */
+    inFd = open(argv[ifarg], O_RDONLY | direct);
+    if(inFd < 0){
+	perror("infile open error");
+	return EXIT_FAILURE;
+    }
+    outFd = open(argv[ofarg], O_RDWR | O_CREAT | direct, 0666);
+    if(outFd < 0){
+	perror("outfile open error");
+	return EXIT_FAILURE;
+    }
+
+    /* Parallel container format */
+    if(threads >= 0 && action >= 0){
+	if(action == 1){
+	    aead_select(stderr);
+	    res = par_encrypt_fd(inFd, outFd, key_str, threads, STREAM_CHUNK);
+	}
+	else{
+	    res = par_decrypt_fd(inFd, outFd, key_str, threads);
+	}
+	if(!res){
+	    fprintf(stderr, "parallel %s failed\n", action ? "encrypt" : "decrypt");
+	}
+	close(outFd);
+	close(inFd);
+	return res ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    /* Derive the key once, then stream the file through it */
+    if(action >= 0 && !derive_key(&key, key_str, KDF_LEGACY, NULL, 0, 0)){
+	fprintf(stderr, "derive_key failed\n");
+	return EXIT_FAILURE;
+    }
+    buf = crypt_buf_alloc(STREAM_CHUNK);
+    if(!buf){
+	perror("buffer alloc error");
+	return EXIT_FAILURE;
+    }
+
+    /* Perform crypt_fd action (encrypt, decrypt, copy) */
+    if(!crypt_fd(inFd, outFd, action, (action >= 0) ? &key : NULL,
+		 buf, STREAM_CHUNK)){
+	fprintf(stderr, "crypt_fd failed\n");
+	res = EXIT_FAILURE;
+    }
+
+    /* Cleanup */
+    free(buf);
+    if(action >= 0){
+	key_cleanup(&key);
+    }
+    if(close(outFd)){
+        perror("outFile close error\n");
+    }
+    if(close(inFd)){
+	perror("inFile close error\n");
+    }
+
+    return res;
+}
@@ -15,13 +15,344 @@
  *
  */
 
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#if defined(__aarch64__) && defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#include <openssl/rand.h>
+
 #include "aes-crypt.h"
 
+/* ChaCha20-Poly1305 came with OpenSSL 1.1.0 */
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L && !defined(OPENSSL_NO_CHACHA) \
+    && !defined(OPENSSL_NO_POLY1305)
+#define HAVE_CHACHA20_POLY1305
+#endif
+
+/* The GCM controls are the generic AEAD ones under older names */
+#ifndef EVP_CTRL_AEAD_SET_IVLEN
+#define EVP_CTRL_AEAD_SET_IVLEN EVP_CTRL_GCM_SET_IVLEN
+#define EVP_CTRL_AEAD_GET_TAG EVP_CTRL_GCM_GET_TAG
+#define EVP_CTRL_AEAD_SET_TAG EVP_CTRL_GCM_SET_TAG
+#endif
+
+/* The backend registry, indexed by AEAD_* id */
+typedef struct aead_backend_s{
+    const char* name;
+    const EVP_CIPHER* (*cipher)(void);	/* NULL if this OpenSSL lacks it */
+    int needs_aes;		/* only fast with AES instructions */
+} aead_backend;
+
+static const aead_backend aead_backends[AEAD_COUNT] = {
+    { "aes-256-gcm", EVP_aes_256_gcm, 1 },
+#ifdef HAVE_CHACHA20_POLY1305
+    { "chacha20-poly1305", EVP_chacha20_poly1305, 0 },
+#else
+    { "chacha20-poly1305", NULL, 0 },
+#endif
+};
+
+/* aead_select()'s results */
+static pthread_once_t aead_once = PTHREAD_ONCE_INIT;
+static int aead_chosen = -1;
+static int aead_cpu_aes;
+static double aead_speed[AEAD_COUNT];	/* MB/s, 0 if unavailable or failed */
+
 #define BLOCKSIZE 1024
 #define FAILURE 0
 #define SUCCESS 1
 
+extern int derive_key(crypt_key* key, char* key_str, int kdf,
+		      const unsigned char* salt, int salt_len, int iter){
+    unsigned char material[48];
+    int nrounds = 5;
+    int i;
+
+    key->ctr_template = NULL;
+    for(i = 0; i < AEAD_COUNT; i++){
+	key->aead_template[i] = NULL;
+    }
+    /* until key_init_aead(), so keys that never seal skip the self-tests */
+    key->aead = AEAD_AES_256_GCM;
+
+    if(!key_str){
+	/* Error */
+	fprintf(stderr, "Key_str must not be NULL\n");
+	return FAILURE;
+    }
+
+    if(kdf == KDF_LEGACY){
+	/* Build Key from String, the way do_crypt always has */
+	i = EVP_BytesToKey(EVP_aes_256_cbc(), EVP_sha1(), NULL,
+			   (unsigned char*)key_str, strlen(key_str), nrounds,
+			   key->key, key->iv);
+	if (i != 32) {
+	    /* Error */
+	    fprintf(stderr, "Key size is %d bits - should be 256 bits\n", i*8);
+	    return FAILURE;
+	}
+    }
+    else if(kdf == KDF_PBKDF2){
+	/* One run gives both key and IV */
+	if(!PKCS5_PBKDF2_HMAC(key_str, strlen(key_str), salt, salt_len, iter,
+			      EVP_sha256(), sizeof(material), material)){
+	    fprintf(stderr, "PBKDF2 failed\n");
+	    return FAILURE;
+	}
+	memcpy(key->key, material, 32);
+	memcpy(key->iv, material + 32, 16);
+	OPENSSL_cleanse(material, sizeof(material));
+    }
+    else{
+	fprintf(stderr, "Unknown KDF %d\n", kdf);
+	return FAILURE;
+    }
+
+    /* Expand the CTR key schedule once for every ctr_cipher to copy */
+    key->ctr_template = EVP_CIPHER_CTX_new();
+    if(!key->ctr_template
+       || !EVP_CipherInit_ex(key->ctr_template, EVP_aes_256_ctr(), NULL,
+			     key->key, NULL, 1)){
+	key_cleanup(key);
+	return FAILURE;
+    }
+    for(i = 0; i < AEAD_COUNT; i++){
+	if(!aead_available(i)){
+	    continue;
+	}
+	key->aead_template[i] = EVP_CIPHER_CTX_new();
+	if(!key->aead_template[i]
+	   || !EVP_CipherInit_ex(key->aead_template[i],
+				 aead_backends[i].cipher(), NULL,
+				 key->key, NULL, 1)){
+	    key_cleanup(key);
+	    return FAILURE;
+	}
+    }
+
+    return SUCCESS;
+}
+
+extern int key_init_aead(crypt_key* key){
+    int aead = aead_select(NULL);
+
+    /* if nothing passed, sealing fails at first use */
+    key->aead = aead >= 0 ? aead : AEAD_AES_256_GCM;
+    return aead >= 0 ? SUCCESS : FAILURE;
+}
+
+extern void key_check(const crypt_key* key, unsigned char* out){
+    static const char label[] = "pa5-encfs key check";
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int len;
+    EVP_MD_CTX* md;
+
+    memset(out, 0, KEY_CHECK_SIZE);
+    md = EVP_MD_CTX_create();
+    if(!md){
+	return;
+    }
+    if(EVP_DigestInit_ex(md, EVP_sha256(), NULL)
+       && EVP_DigestUpdate(md, label, sizeof(label))
+       && EVP_DigestUpdate(md, key->key, sizeof(key->key))
+       && EVP_DigestFinal_ex(md, digest, &len)){
+	memcpy(out, digest, KEY_CHECK_SIZE);
+    }
+    EVP_MD_CTX_destroy(md);
+}
+
+extern void key_cleanup(crypt_key* key){
+    int i;
+
+    if(key->ctr_template){
+	EVP_CIPHER_CTX_free(key->ctr_template);
+	key->ctr_template = NULL;
+    }
+    for(i = 0; i < AEAD_COUNT; i++){
+	if(key->aead_template[i]){
+	    EVP_CIPHER_CTX_free(key->aead_template[i]);
+	    key->aead_template[i] = NULL;
+	}
+    }
+    OPENSSL_cleanse(key->key, sizeof(key->key));
+    OPENSSL_cleanse(key->iv, sizeof(key->iv));
+}
+
+extern const char* aead_name(int aead){
+    if(aead < 0 || aead >= AEAD_COUNT){
+	return "unknown";
+    }
+    return aead_backends[aead].name;
+}
+
+extern int aead_available(int aead){
+    return aead >= 0 && aead < AEAD_COUNT && aead_backends[aead].cipher != NULL;
+}
+
+/* Whether the CPU has AES instructions OpenSSL will use */
+static int cpu_has_aes(void){
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("aes") != 0;
+#elif defined(__aarch64__) && defined(__linux__)
+    return (getauxval(AT_HWCAP) & HWCAP_AES) != 0;
+#else
+    return 0;
+#endif
+}
+
+static double seconds_now(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Self-test backend aead under a throwaway key: a sealed buffer must
+ * open to the same bytes and must not open once changed. Then time
+ * sealing AEAD_TEST_BYTES.
+ * Returns MB/s, 0 if the backend is missing or failed */
+static double aead_selftest(int aead){
+    static const int piece = 64 * 1024;
+    unsigned char key[32];
+    unsigned char iv[AEAD_IV_SIZE];
+    unsigned char tag[AEAD_TAG_SIZE];
+    unsigned char aad[8] = "selftest";
+    unsigned char* in = NULL;
+    unsigned char* out = NULL;
+    unsigned char* back = NULL;
+    ctr_cipher cipher;
+    double start;
+    double res = 0;
+    int i;
+
+    memset(&cipher, 0, sizeof(cipher));
+    if(!aead_available(aead)){
+	return 0;
+    }
+
+    in = malloc(piece);
+    out = malloc(piece);
+    back = malloc(piece);
+    cipher.aead[aead] = EVP_CIPHER_CTX_new();
+    if(!in || !out || !back || !cipher.aead[aead]
+       || RAND_bytes(key, sizeof(key)) != 1
+       || RAND_bytes(iv, sizeof(iv)) != 1
+       || RAND_bytes(in, piece) != 1
+       || !EVP_CipherInit_ex(cipher.aead[aead], aead_backends[aead].cipher(),
+			     NULL, key, NULL, 1)){
+	goto out;
+    }
+
+    if(!aead_cipher_seal(&cipher, aead, iv, aad, sizeof(aad), in, out, piece, tag)
+       || !aead_cipher_open(&cipher, aead, iv, aad, sizeof(aad), out, back,
+			    piece, tag)
+       || memcmp(in, back, piece)){
+	goto out;
+    }
+    out[piece / 2] ^= 1;
+    if(aead_cipher_open(&cipher, aead, iv, aad, sizeof(aad), out, back,
+			piece, tag)){
+	goto out;
+    }
+
+    start = seconds_now();
+    for(i = 0; i < AEAD_TEST_BYTES / piece; i++){
+	/* a nonce is never reused, even on test data */
+	iv[0] = i;
+	iv[1] = i >> 8;
+	if(!aead_cipher_seal(&cipher, aead, iv, aad, sizeof(aad), in, out,
+			     piece, tag)){
+	    goto out;
+	}
+    }
+    res = AEAD_TEST_BYTES / (seconds_now() - start) / 1e6;
+    if(res <= 0){
+	res = 1;
+    }
+
+out:
+    OPENSSL_cleanse(key, sizeof(key));
+    ctr_cipher_cleanup(&cipher);
+    free(back);
+    free(out);
+    free(in);
+    return res;
+}
+
+static void aead_run_selftests(void){
+    int i;
+
+    aead_cpu_aes = cpu_has_aes();
+    for(i = 0; i < AEAD_COUNT; i++){
+	aead_speed[i] = aead_selftest(i);
+	if(aead_speed[i] > 0
+	   && (aead_cpu_aes || !aead_backends[i].needs_aes)
+	   && (aead_chosen < 0 || aead_speed[i] > aead_speed[aead_chosen])){
+	    aead_chosen = i;
+	}
+    }
+    /* neither AES instructions nor ChaCha20: slow AES beats nothing */
+    if(aead_chosen < 0 && aead_speed[AEAD_AES_256_GCM] > 0){
+	aead_chosen = AEAD_AES_256_GCM;
+    }
+}
+
+extern int aead_select(FILE* log){
+    int i;
+
+    pthread_once(&aead_once, aead_run_selftests);
+
+    if(log){
+	fprintf(log, "crypto backend = %s (AES instructions: %s;",
+		aead_chosen >= 0 ? aead_name(aead_chosen) : "none",
+		aead_cpu_aes ? "yes" : "no");
+	for(i = 0; i < AEAD_COUNT; i++){
+	    if(!aead_available(i)){
+		fprintf(log, " %s: not in OpenSSL", aead_name(i));
+	    }
+	    else if(aead_speed[i] > 0){
+		fprintf(log, " %s: %.0f MB/s", aead_name(i), aead_speed[i]);
+	    }
+	    else{
+		fprintf(log, " %s: failed self-test", aead_name(i));
+	    }
+	    fprintf(log, i < AEAD_COUNT - 1 ? "," : ")\n");
+	}
+    }
+
+    return aead_chosen;
+}
+
 extern int do_crypt(FILE* in, FILE* out, int action, char* key_str){
+    crypt_key key;
+    int res;
+
+    /* Pass-through needs no key */
+    if(action < 0){
+	return do_crypt_key(in, out, action, NULL);
+    }
+
+    if(!derive_key(&key, key_str, KDF_LEGACY, NULL, 0, 0)){
+	return FAILURE;
+    }
+    res = do_crypt_key(in, out, action, &key);
+    key_cleanup(&key);
+
+    return res;
+}
+
+extern int do_crypt_key(FILE* in, FILE* out, int action, const crypt_key* key){
     /* Local Vars */
 
     /* Buffers */
@@ -33,32 +364,21 @@ extern int do_crypt(FILE* in, FILE* out, int action, char* key_str){
     int writelen;
 
     /* OpenSSL libcrypto vars */
-    EVP_CIPHER_CTX ctx;
-    unsigned char key[32];
-    unsigned char iv[32];
-    int nrounds = 5;
-    
-    /* tmp vars */
-    int i;
+    EVP_CIPHER_CTX* ctx = NULL;
 
-    /* Setup Encryption Key and Cipher Engine if in cipher mode */
+    /* Setup Cipher Engine if in cipher mode */
     if(action >= 0){
-	if(!key_str){
+	if(!key){
 	    /* Error */
-	    fprintf(stderr, "Key_str must not be NULL\n");
-	    return 0;
-	}
-	/* Build Key from String */
-	i = EVP_BytesToKey(EVP_aes_256_cbc(), EVP_sha1(), NULL,
-			   (unsigned char*)key_str, strlen(key_str), nrounds, key, iv);
-	if (i != 32) {
-	    /* Error */
-	    fprintf(stderr, "Key size is %d bits - should be 256 bits\n", i*8);
-	    return 0;
+	    fprintf(stderr, "Key must not be NULL\n");
+	    return FAILURE;
 	}
 	/* Init Engine */
-	EVP_CIPHER_CTX_init(&ctx);
-	EVP_CipherInit_ex(&ctx, EVP_aes_256_cbc(), NULL, key, iv, action);
+	ctx = EVP_CIPHER_CTX_new();
+	if(!ctx){
+	    return FAILURE;
+	}
+	EVP_CipherInit_ex(ctx, EVP_aes_256_cbc(), NULL, key->key, key->iv, action);
     }    
 
     /* Loop through Input File*/
@@ -72,11 +392,11 @@ extern int do_crypt(FILE* in, FILE* out, int action, char* key_str){
 	
 	/* If in cipher mode, perform cipher transform on block */
 	if(action >= 0){
-	    if(!EVP_CipherUpdate(&ctx, outbuf, &outlen, inbuf, inlen))
+	    if(!EVP_CipherUpdate(ctx, outbuf, &outlen, inbuf, inlen))
 		{
 		    /* Error */
-		    EVP_CIPHER_CTX_cleanup(&ctx);
-		    return 0;
+		    EVP_CIPHER_CTX_free(ctx);
+		    return FAILURE;
 		}
 	}
 	/* If in pass-through mode. copy block as is */
@@ -90,25 +410,642 @@ extern int do_crypt(FILE* in, FILE* out, int action, char* key_str){
 	if(writelen != outlen){
 	    /* Error */
 	    perror("fwrite error");
-	    EVP_CIPHER_CTX_cleanup(&ctx);
-	    return 0;
+	    EVP_CIPHER_CTX_free(ctx);
+	    return FAILURE;
 	}
     }
     
     /* If in cipher mode, handle necessary padding */
     if(action >= 0){
 	/* Handle remaining cipher block + padding */
-	if(!EVP_CipherFinal_ex(&ctx, outbuf, &outlen))
+	if(!EVP_CipherFinal_ex(ctx, outbuf, &outlen))
 	    {
 		/* Error */
-		EVP_CIPHER_CTX_cleanup(&ctx);
-		return 0;
+		EVP_CIPHER_CTX_free(ctx);
+		return FAILURE;
 	    }
 	/* Write remainign cipher block + padding*/
 	fwrite(outbuf, sizeof(*inbuf), outlen, out);
-	EVP_CIPHER_CTX_cleanup(&ctx);
+	EVP_CIPHER_CTX_free(ctx);
     }
     
     /* Success */
-    return 1;
+    return SUCCESS;
+}
+
+extern off_t cbc_plain_size(int fd, const crypt_key* key){
+    unsigned char tail[2 * AES_BLOCK_SIZE];
+    unsigned char plain[AES_BLOCK_SIZE + EVP_MAX_BLOCK_LENGTH];
+    const unsigned char* prev;
+    EVP_CIPHER_CTX* ctx;
+    struct stat st;
+    int outlen;
+    int pad;
+    int i;
+
+    if(fstat(fd, &st) == -1 || st.st_size == 0
+       || st.st_size % AES_BLOCK_SIZE){
+	return -1;
+    }
+
+    /* CBC: last plaintext block = D(last block) xor the block before
+     * it, or the IV when there is only one */
+    if(st.st_size == AES_BLOCK_SIZE){
+	if(pread(fd, tail + AES_BLOCK_SIZE, AES_BLOCK_SIZE, 0) != AES_BLOCK_SIZE){
+	    return -1;
+	}
+	prev = key->iv;
+    }
+    else{
+	if(pread(fd, tail, sizeof(tail), st.st_size - sizeof(tail))
+	   != sizeof(tail)){
+	    return -1;
+	}
+	prev = tail;
+    }
+
+    ctx = EVP_CIPHER_CTX_new();
+    if(!ctx){
+	return -1;
+    }
+    if(!EVP_CipherInit_ex(ctx, EVP_aes_256_cbc(), NULL, key->key, prev, 0)
+       || !EVP_CIPHER_CTX_set_padding(ctx, 0)
+       || !EVP_CipherUpdate(ctx, plain, &outlen, tail + AES_BLOCK_SIZE,
+			    AES_BLOCK_SIZE)){
+	EVP_CIPHER_CTX_free(ctx);
+	return -1;
+    }
+    EVP_CIPHER_CTX_free(ctx);
+
+    pad = plain[AES_BLOCK_SIZE - 1];
+    if(pad < 1 || pad > AES_BLOCK_SIZE){
+	return -1;
+    }
+    for(i = 1; i <= pad; i++){
+	if(plain[AES_BLOCK_SIZE - i] != pad){
+	    return -1;
+	}
+    }
+
+    return st.st_size - pad;
+}
+
+extern unsigned char* crypt_buf_alloc(size_t chunk){
+    void* buf;
+
+    /* room for the padding block added to the last chunk */
+    if(posix_memalign(&buf, STREAM_ALIGN, chunk + STREAM_ALIGN)){
+	return NULL;
+    }
+    return buf;
+}
+
+/* pread until len bytes or end of file, returns bytes read or -1 */
+static ssize_t read_full(int fd, unsigned char* buf, size_t len, off_t pos){
+    size_t done = 0;
+    ssize_t n;
+
+    while(done < len){
+	n = pread(fd, buf + done, len - done, pos + done);
+	if(n < 0){
+	    if(errno == EINTR){
+		continue;
+	    }
+	    return -1;
+	}
+	if(n == 0){
+	    break;
+	}
+	done += n;
+    }
+    return done;
+}
+
+static int write_full(int fd, const unsigned char* buf, size_t len, off_t pos){
+    ssize_t n;
+    int flags;
+
+    /* O_DIRECT only takes whole aligned blocks, the tail goes through
+     * the page cache */
+    flags = fcntl(fd, F_GETFL);
+    if(flags != -1 && (flags & O_DIRECT) && len % STREAM_ALIGN){
+	fcntl(fd, F_SETFL, flags & ~O_DIRECT);
+    }
+
+    while(len > 0){
+	n = pwrite(fd, buf, len, pos);
+	if(n < 0){
+	    if(errno == EINTR){
+		continue;
+	    }
+	    return FAILURE;
+	}
+	buf += n;
+	pos += n;
+	len -= n;
+    }
+    return SUCCESS;
+}
+
+extern int crypt_fd(int in_fd, int out_fd, int action, const crypt_key* key,
+		    unsigned char* buf, size_t chunk){
+    EVP_CIPHER_CTX* ctx = NULL;
+    struct stat st;
+    off_t pos = 0;
+    ssize_t n;
+    int outlen;
+    int pad;
+    int i;
+    int last;
+    int res = FAILURE;
+
+    if(fstat(in_fd, &st) == -1){
+	perror("fstat error");
+	return FAILURE;
+    }
+
+    if(action >= 0){
+	if(!key){
+	    fprintf(stderr, "Key must not be NULL\n");
+	    return FAILURE;
+	}
+	/* Do_crypt's PKCS padding is done by hand below: with EVP's own
+	 * padding a decrypt holds back a block and cannot run in place */
+	ctx = EVP_CIPHER_CTX_new();
+	if(!ctx
+	   || !EVP_CipherInit_ex(ctx, EVP_aes_256_cbc(), NULL, key->key,
+				 key->iv, action)){
+	    EVP_CIPHER_CTX_free(ctx);
+	    return FAILURE;
+	}
+	EVP_CIPHER_CTX_set_padding(ctx, 0);
+    }
+
+    do{
+	/* whole chunks even at the end, O_DIRECT reads must be aligned */
+	n = read_full(in_fd, buf, chunk, pos);
+	if(n < 0){
+	    perror("pread error");
+	    goto out;
+	}
+	last = (pos + n >= st.st_size) || (size_t)n < chunk;
+
+	if(action == 1 && last){
+	    pad = AES_BLOCK_SIZE - n % AES_BLOCK_SIZE;
+	    memset(buf + n, pad, pad);
+	    n += pad;
+	}
+	if(action == 0 && (n % AES_BLOCK_SIZE || (last && pos + n == 0))){
+	    fprintf(stderr, "Input is not a whole number of cipher blocks\n");
+	    goto out;
+	}
+
+	if(action >= 0 && n > 0){
+	    if(!EVP_CipherUpdate(ctx, buf, &outlen, buf, n)){
+		goto out;
+	    }
+	}
+
+	if(action == 0 && last){
+	    pad = buf[n - 1];
+	    if(pad < 1 || pad > AES_BLOCK_SIZE){
+		fprintf(stderr, "Bad padding, wrong key?\n");
+		goto out;
+	    }
+	    for(i = 1; i <= pad; i++){
+		if(buf[n - i] != pad){
+		    fprintf(stderr, "Bad padding, wrong key?\n");
+		    goto out;
+		}
+	    }
+	    n -= pad;
+	}
+
+	/* the output runs level with the input until the last chunk, so
+	 * in_fd == out_fd is safe */
+	if(n > 0 && !write_full(out_fd, buf, n, pos)){
+	    perror("pwrite error");
+	    goto out;
+	}
+	pos += n;
+    } while(!last);
+
+    if(fstat(out_fd, &st) == 0 && S_ISREG(st.st_mode)
+       && ftruncate(out_fd, pos) == -1){
+	perror("ftruncate error");
+	goto out;
+    }
+
+    res = SUCCESS;
+
+out:
+    EVP_CIPHER_CTX_free(ctx);
+    return res;
+}
+
+/* Shared state of one par_encrypt_fd/par_decrypt_fd run */
+typedef struct par_job_s{
+    int in_fd;
+    int out_fd;
+    int action;
+    unsigned char key[32];
+    unsigned char header[PAR_HEADER_SIZE];
+    unsigned char nonce[PAR_NONCE_SIZE];
+    int aead;
+    size_t chunk;
+    uint64_t plain_size;
+    uint64_t chunks;
+    pthread_mutex_t lock;
+    uint64_t next;		/* next chunk nobody has taken */
+    int failed;
+} par_job;
+
+static void put_le(unsigned char* p, uint64_t v, int bytes){
+    int i;
+
+    for(i = 0; i < bytes; i++){
+	p[i] = v >> (8 * i);
+    }
+}
+
+static uint64_t get_le(const unsigned char* p, int bytes){
+    uint64_t v = 0;
+    int i;
+
+    for(i = bytes - 1; i >= 0; i--){
+	v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+/* Encrypt or verify and decrypt chunk index of job in place in buf */
+static int par_chunk(par_job* job, EVP_CIPHER_CTX* ctx, unsigned char* buf,
+		     int len, uint64_t index){
+    unsigned char nonce[PAR_NONCE_SIZE];
+    unsigned char aad[8];
+    int outlen;
+    int i;
+
+    memcpy(nonce, job->nonce, PAR_NONCE_SIZE);
+    for(i = 0; i < 8; i++){
+	nonce[PAR_NONCE_SIZE - 1 - i] ^= index >> (8 * i);
+    }
+    put_le(aad, index, 8);
+
+    if(!EVP_CipherInit_ex(ctx, aead_backends[job->aead].cipher(), NULL, NULL,
+			  NULL, job->action)
+       || !EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_IVLEN, PAR_NONCE_SIZE, NULL)
+       || !EVP_CipherInit_ex(ctx, NULL, NULL, job->key, nonce, job->action)
+       || !EVP_CipherUpdate(ctx, NULL, &outlen, job->header, PAR_HEADER_SIZE)
+       || !EVP_CipherUpdate(ctx, NULL, &outlen, aad, sizeof(aad))){
+	return FAILURE;
+    }
+
+    if(job->action == 0
+       && !EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, PAR_TAG_SIZE,
+			       buf + len)){
+	return FAILURE;
+    }
+    if((len > 0 && !EVP_CipherUpdate(ctx, buf, &outlen, buf, len))
+       || !EVP_CipherFinal_ex(ctx, buf + len, &outlen)){
+	return FAILURE;
+    }
+    if(job->action == 1
+       && !EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, PAR_TAG_SIZE,
+			       buf + len)){
+	return FAILURE;
+    }
+
+    return SUCCESS;
+}
+
+static void* par_worker(void* arg){
+    par_job* job = arg;
+    EVP_CIPHER_CTX* ctx;
+    unsigned char* buf;
+    uint64_t index;
+    off_t plain_pos;
+    off_t cipher_pos;
+    size_t len;
+    int ok = SUCCESS;
+
+    ctx = EVP_CIPHER_CTX_new();
+    buf = malloc(job->chunk + PAR_TAG_SIZE);
+    if(!ctx || !buf){
+	ok = FAILURE;
+    }
+
+    while(ok){
+	/* take the next chunk, or stop when there are none or a
+	 * worker has failed */
+	pthread_mutex_lock(&job->lock);
+	if(job->failed || job->next >= job->chunks){
+	    pthread_mutex_unlock(&job->lock);
+	    break;
+	}
+	index = job->next++;
+	pthread_mutex_unlock(&job->lock);
+
+	plain_pos = index * job->chunk;
+	cipher_pos = PAR_HEADER_SIZE + index * (job->chunk + PAR_TAG_SIZE);
+	len = job->plain_size - plain_pos;
+	if(len > job->chunk){
+	    len = job->chunk;
+	}
+
+	if(job->action == 1){
+	    ok = read_full(job->in_fd, buf, len, plain_pos) == (ssize_t)len
+		&& par_chunk(job, ctx, buf, len, index)
+		&& write_full(job->out_fd, buf, len + PAR_TAG_SIZE, cipher_pos);
+	}
+	else{
+	    ok = read_full(job->in_fd, buf, len + PAR_TAG_SIZE, cipher_pos)
+		    == (ssize_t)(len + PAR_TAG_SIZE)
+		&& par_chunk(job, ctx, buf, len, index)
+		&& write_full(job->out_fd, buf, len, plain_pos);
+	    if(!ok){
+		fprintf(stderr, "Chunk %llu failed to decrypt or verify\n",
+			(unsigned long long)index);
+	    }
+	}
+    }
+
+    if(!ok){
+	pthread_mutex_lock(&job->lock);
+	job->failed = 1;
+	pthread_mutex_unlock(&job->lock);
+    }
+
+    free(buf);
+    EVP_CIPHER_CTX_free(ctx);
+    return NULL;
+}
+
+/* Run job over threads workers and size out_fd to out_size */
+static int par_run(par_job* job, int threads, off_t out_size){
+    pthread_t tids[PAR_MAX_THREADS];
+    int started = 0;
+    int i;
+
+    if(threads <= 0){
+	threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if(threads < 1){
+	threads = 1;
+    }
+    if(threads > PAR_MAX_THREADS){
+	threads = PAR_MAX_THREADS;
+    }
+    if((uint64_t)threads > job->chunks){
+	threads = job->chunks;
+    }
+
+    /* size the output first so workers never extend it concurrently */
+    if(ftruncate(job->out_fd, out_size) == -1){
+	perror("ftruncate error");
+	return FAILURE;
+    }
+
+    pthread_mutex_init(&job->lock, NULL);
+    job->next = 0;
+    job->failed = 0;
+
+    for(i = 0; i < threads; i++){
+	if(pthread_create(&tids[i], NULL, par_worker, job)){
+	    break;
+	}
+	started++;
+    }
+    if(started == 0){
+	/* no threads at all, do it here */
+	par_worker(job);
+    }
+    for(i = 0; i < started; i++){
+	pthread_join(tids[i], NULL);
+    }
+
+    pthread_mutex_destroy(&job->lock);
+    OPENSSL_cleanse(job->key, sizeof(job->key));
+
+    return job->failed ? FAILURE : SUCCESS;
+}
+
+extern int par_encrypt_fd(int in_fd, int out_fd, char* key_str, int threads,
+			  size_t chunk){
+    par_job job;
+    crypt_key key;
+    struct stat st;
+    unsigned char* h = job.header;
+    unsigned int iter = KDF_PBKDF2_ITER;
+
+    if(fstat(in_fd, &st) == -1){
+	perror("fstat error");
+	return FAILURE;
+    }
+    if(chunk == 0){
+	chunk = STREAM_CHUNK;
+    }
+    if(chunk > 0x7fffffff - PAR_TAG_SIZE){
+	fprintf(stderr, "Chunk size too large\n");
+	return FAILURE;
+    }
+    job.aead = aead_select(NULL);
+    if(job.aead < 0){
+	fprintf(stderr, "No cipher passed its self-test\n");
+	return FAILURE;
+    }
+
+    memset(h, 0, PAR_HEADER_SIZE);
+    memcpy(h, PAR_MAGIC, 8);
+    put_le(h + 8, PAR_VERSION, 4);
+    put_le(h + 12, chunk, 4);
+    put_le(h + 16, st.st_size, 8);
+    put_le(h + 24, iter, 4);
+    put_le(h + 28, job.aead, 4);
+    if(RAND_bytes(h + 32, KDF_SALT_SIZE) != 1
+       || RAND_bytes(h + 48, PAR_NONCE_SIZE) != 1){
+	return FAILURE;
+    }
+
+    if(!derive_key(&key, key_str, KDF_PBKDF2, h + 32, KDF_SALT_SIZE, iter)){
+	return FAILURE;
+    }
+    memcpy(job.key, key.key, sizeof(job.key));
+    key_cleanup(&key);
+
+    job.in_fd = in_fd;
+    job.out_fd = out_fd;
+    job.action = 1;
+    memcpy(job.nonce, h + 48, PAR_NONCE_SIZE);
+    job.chunk = chunk;
+    job.plain_size = st.st_size;
+    /* an empty file still gets one (empty) chunk, so it has a tag */
+    job.chunks = st.st_size ? (st.st_size + chunk - 1) / chunk : 1;
+
+    if(!write_full(out_fd, h, PAR_HEADER_SIZE, 0)){
+	perror("pwrite error");
+	return FAILURE;
+    }
+
+    return par_run(&job, threads, PAR_HEADER_SIZE + job.chunks * PAR_TAG_SIZE
+		   + st.st_size);
+}
+
+extern int par_decrypt_fd(int in_fd, int out_fd, char* key_str, int threads){
+    par_job job;
+    crypt_key key;
+    struct stat st;
+    unsigned char* h = job.header;
+    unsigned int iter;
+
+    if(fstat(in_fd, &st) == -1){
+	perror("fstat error");
+	return FAILURE;
+    }
+    if(read_full(in_fd, h, PAR_HEADER_SIZE, 0) != PAR_HEADER_SIZE
+       || memcmp(h, PAR_MAGIC, 8)
+       || get_le(h + 8, 4) < 1 || get_le(h + 8, 4) > PAR_VERSION){
+	fprintf(stderr, "Not a parallel container\n");
+	return FAILURE;
+    }
+    job.aead = get_le(h + 8, 4) == 1 ? AEAD_AES_256_GCM : (int)get_le(h + 28, 4);
+    if(!aead_available(job.aead)){
+	fprintf(stderr, "Container uses cipher %s, which this OpenSSL lacks\n",
+		aead_name(job.aead));
+	return FAILURE;
+    }
+
+    job.chunk = get_le(h + 12, 4);
+    job.plain_size = get_le(h + 16, 8);
+    iter = get_le(h + 24, 4);
+    if(job.chunk == 0 || job.chunk > 0x7fffffff - PAR_TAG_SIZE){
+	fprintf(stderr, "Bad chunk size in header\n");
+	return FAILURE;
+    }
+    job.chunks = job.plain_size
+	? (job.plain_size + job.chunk - 1) / job.chunk : 1;
+    if((uint64_t)st.st_size != PAR_HEADER_SIZE + job.chunks * PAR_TAG_SIZE
+       + job.plain_size){
+	fprintf(stderr, "Container is truncated or has trailing data\n");
+	return FAILURE;
+    }
+
+    if(!derive_key(&key, key_str, KDF_PBKDF2, h + 32, KDF_SALT_SIZE, iter)){
+	return FAILURE;
+    }
+    memcpy(job.key, key.key, sizeof(job.key));
+    key_cleanup(&key);
+
+    job.in_fd = in_fd;
+    job.out_fd = out_fd;
+    job.action = 0;
+    memcpy(job.nonce, h + 48, PAR_NONCE_SIZE);
+
+    if(!par_run(&job, threads, job.plain_size)){
+	/* never leave plaintext that failed to verify behind */
+	if(ftruncate(out_fd, 0) == -1){
+	    perror("ftruncate error");
+	}
+	return FAILURE;
+    }
+
+    return SUCCESS;
+}
+
+extern int ctr_cipher_init(ctr_cipher* cipher, const crypt_key* key){
+    /* Copies of the templates, the key schedule is not expanded again */
+    int i;
+
+    memset(cipher, 0, sizeof(*cipher));
+    cipher->ctx = EVP_CIPHER_CTX_new();
+    if(!cipher->ctx || !EVP_CIPHER_CTX_copy(cipher->ctx, key->ctr_template)){
+	ctr_cipher_cleanup(cipher);
+	return FAILURE;
+    }
+    for(i = 0; i < AEAD_COUNT; i++){
+	if(!key->aead_template[i]){
+	    continue;
+	}
+	cipher->aead[i] = EVP_CIPHER_CTX_new();
+	if(!cipher->aead[i]
+	   || !EVP_CIPHER_CTX_copy(cipher->aead[i], key->aead_template[i])){
+	    ctr_cipher_cleanup(cipher);
+	    return FAILURE;
+	}
+    }
+
+    return SUCCESS;
+}
+
+extern int ctr_cipher_apply(ctr_cipher* cipher, const unsigned char* in,
+			    unsigned char* out, int len, const unsigned char* iv){
+    int outlen;
+
+    if(!EVP_CipherInit_ex(cipher->ctx, NULL, NULL, NULL, iv, -1)
+       || !EVP_CipherUpdate(cipher->ctx, out, &outlen, in, len)){
+	return FAILURE;
+    }
+
+    return SUCCESS;
+}
+
+extern int aead_cipher_seal(ctr_cipher* cipher, int aead,
+			    const unsigned char* iv,
+			    const unsigned char* aad, int aad_len,
+			    const unsigned char* in, unsigned char* out, int len,
+			    unsigned char* tag){
+    EVP_CIPHER_CTX* ctx;
+    int outlen;
+
+    if(aead < 0 || aead >= AEAD_COUNT || !(ctx = cipher->aead[aead])){
+	return FAILURE;
+    }
+    if(!EVP_CipherInit_ex(ctx, NULL, NULL, NULL, iv, 1)
+       || !EVP_CipherUpdate(ctx, NULL, &outlen, aad, aad_len)
+       || (len > 0 && !EVP_CipherUpdate(ctx, out, &outlen, in, len))
+       || !EVP_CipherFinal_ex(ctx, out + len, &outlen)
+       || !EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, AEAD_TAG_SIZE, tag)){
+	return FAILURE;
+    }
+
+    return SUCCESS;
+}
+
+extern int aead_cipher_open(ctr_cipher* cipher, int aead,
+			    const unsigned char* iv,
+			    const unsigned char* aad, int aad_len,
+			    const unsigned char* in, unsigned char* out, int len,
+			    const unsigned char* tag){
+    EVP_CIPHER_CTX* ctx;
+    int outlen;
+
+    if(aead < 0 || aead >= AEAD_COUNT || !(ctx = cipher->aead[aead])){
+	return FAILURE;
+    }
+    /* the tag is only compared in EVP_CipherFinal_ex */
+    if(!EVP_CipherInit_ex(ctx, NULL, NULL, NULL, iv, 0)
+       || !EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, AEAD_TAG_SIZE,
+			       (void*)tag)
+       || !EVP_CipherUpdate(ctx, NULL, &outlen, aad, aad_len)
+       || (len > 0 && !EVP_CipherUpdate(ctx, out, &outlen, in, len))
+       || !EVP_CipherFinal_ex(ctx, out + len, &outlen)){
+	return FAILURE;
+    }
+
+    return SUCCESS;
+}
+
+extern void ctr_cipher_cleanup(ctr_cipher* cipher){
+    int i;
+
+    if(cipher->ctx){
+	EVP_CIPHER_CTX_free(cipher->ctx);
+	cipher->ctx = NULL;
+    }
+    for(i = 0; i < AEAD_COUNT; i++){
+	if(cipher->aead[i]){
+	    EVP_CIPHER_CTX_free(cipher->aead[i]);
+	    cipher->aead[i] = NULL;
+	}
+    }
 }
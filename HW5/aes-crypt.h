@@ -29,6 +29,101 @@
 #define FAILURE 0
 #define SUCCESS 1
 
+/* Key derivation functions for derive_key() */
+#define KDF_LEGACY 0	/* EVP_BytesToKey, SHA1, 5 rounds, no salt: what do_crypt uses */
+#define KDF_PBKDF2 1	/* PBKDF2-HMAC-SHA256 with a salt */
+#define KDF_PBKDF2_ITER 200000
+#define KDF_SALT_SIZE 16
+#define KEY_CHECK_SIZE 16
+
+/* Authenticated ciphers ("backends") for sealing blocks and chunks.
+ * The ids are stored in files, so they are never renumbered. A backend
+ * this OpenSSL lacks has no template and its files cannot be opened.
+ */
+#define AEAD_AES_256_GCM 0
+#define AEAD_CHACHA20_POLY1305 1
+#define AEAD_COUNT 2
+/* Every backend takes a 12 byte nonce and makes a 16 byte tag */
+#define AEAD_IV_SIZE 12
+#define AEAD_TAG_SIZE 16
+/* Plaintext aead_select() times each backend over */
+#define AEAD_TEST_BYTES (8 * 1024 * 1024)
+
+/* A key derived once from a passphrase. ctr_template and the
+ * aead_templates are AES-256-CTR and AEAD contexts with the key schedule
+ * already expanded, ctr_cipher_init() copies them so no I/O path ever
+ * runs the KDF or the key expansion.
+ */
+typedef struct crypt_key_s{
+    unsigned char key[32];
+    unsigned char iv[16];	/* CBC IV for do_crypt_key */
+    EVP_CIPHER_CTX* ctr_template;
+    EVP_CIPHER_CTX* aead_template[AEAD_COUNT];
+    int aead;			/* backend new data is sealed with */
+} crypt_key;
+
+/* int derive_key(crypt_key* key, char* key_str, int kdf,
+ *                const unsigned char* salt, int salt_len, int iter)
+ * Purpose: Run the KDF on key_str and set up key, with key->aead set to
+ *          AES-256-GCM until key_init_aead(). Meant to run once, at
+ *          startup, as KDF_PBKDF2 is deliberately slow
+ * Args: crypt_key* key            : Key to fill in
+ *	 char* key_str             : C-string containing passpharse from which key is derived
+ *       int kdf                   : KDF_LEGACY or KDF_PBKDF2
+ *       const unsigned char* salt : Salt for KDF_PBKDF2, ignored by KDF_LEGACY
+ *       int salt_len              : Bytes of salt
+ *       int iter                  : PBKDF2 iterations, ignored by KDF_LEGACY
+ * Return: FAILURE on error, SUCCESS on success
+ */
+extern int derive_key(crypt_key* key, char* key_str, int kdf,
+		      const unsigned char* salt, int salt_len, int iter);
+
+/* int key_init_aead(crypt_key* key)
+ * Purpose: Set key->aead to aead_select()'s choice, running the cipher
+ *          self-tests if nothing ran them yet. Only a key that seals new
+ *          data needs it (the pa5-encfs mount's); par_encrypt_fd()
+ *          selects on its own
+ * Return: FAILURE if no backend passed (key->aead stays AES-256-GCM and
+ *         sealing fails at first use), SUCCESS otherwise
+ */
+extern int key_init_aead(crypt_key* key);
+
+/* void key_check(const crypt_key* key, unsigned char* out)
+ * Purpose: Put KEY_CHECK_SIZE bytes in out that tell keys apart without
+ *          giving the key away, to spot a wrong passphrase
+ */
+extern void key_check(const crypt_key* key, unsigned char* out);
+
+/* void key_cleanup(crypt_key* key)
+ * Purpose: Free the template contexts and wipe the key
+ */
+extern void key_cleanup(crypt_key* key);
+
+/* const char* aead_name(int aead)
+ * Purpose: Name of a backend, for messages
+ * Return: The name, "unknown" for an id out of range
+ */
+extern const char* aead_name(int aead);
+
+/* int aead_available(int aead)
+ * Purpose: Whether this OpenSSL has backend aead
+ */
+extern int aead_available(int aead);
+
+/* int aead_select(FILE* log)
+ * Purpose: Pick the backend new data is sealed with. Every backend this
+ *          OpenSSL has is self-tested: a buffer is sealed, opened and
+ *          compared under a throwaway key, then AEAD_TEST_BYTES are
+ *          timed. AES-256-GCM only competes when the CPU has AES
+ *          instructions (AES-NI, VAES or the ARMv8 crypto extension),
+ *          ChaCha20-Poly1305 always; the fastest backend that passed
+ *          wins. The tests run on the first call only, later calls
+ *          return the same choice.
+ * Args: FILE* log : Where to print one line about the choice, or NULL
+ * Return: An AEAD_* id, -1 if no backend passed
+ */
+extern int aead_select(FILE* log);
+
 /* int do_crypt(FILE* in, FILE* out, int action, char* key_str)
  * Purpose: Perform cipher on in File* and place result in out File*
  * Args: FILE* in      : Input File Pointer
@@ -39,4 +134,164 @@
  */
 extern int do_crypt(FILE* in, FILE* out, int action, char* key_str);
 
+/* int do_crypt_key(FILE* in, FILE* out, int action, const crypt_key* key)
+ * Purpose: do_crypt with a key from derive_key instead of a passphrase
+ * Args: const crypt_key* key : Derived key, may be NULL for pass-through
+ * Return: FAILURE on error, SUCCESS on success
+ */
+extern int do_crypt_key(FILE* in, FILE* out, int action, const crypt_key* key);
+
+/* off_t cbc_plain_size(int fd, const crypt_key* key)
+ * Purpose: Plaintext length of a file do_crypt encrypted, found by
+ *          decrypting only its last cipher block to read the padding
+ * Return: The length, -1 if fd does not hold valid do_crypt output
+ */
+extern off_t cbc_plain_size(int fd, const crypt_key* key);
+
+/* Bytes crypt_fd moves per pread/pwrite by default */
+#define STREAM_CHUNK (1024 * 1024)
+/* Buffer and chunk alignment O_DIRECT needs */
+#define STREAM_ALIGN 4096
+
+/* unsigned char* crypt_buf_alloc(size_t chunk)
+ * Purpose: Allocate a buffer crypt_fd can use with chunk, aligned for O_DIRECT
+ * Return: The buffer (free() it), NULL on error
+ */
+extern unsigned char* crypt_buf_alloc(size_t chunk);
+
+/* int crypt_fd(int in_fd, int out_fd, int action, const crypt_key* key,
+ *              unsigned char* buf, size_t chunk)
+ * Purpose: do_crypt_key on file descriptors. Reads in_fd from offset 0 a
+ *          chunk at a time with pread, transforms it in place in buf and
+ *          pwrites it to out_fd from offset 0, then truncates out_fd to
+ *          the bytes written. The output matches do_crypt's exactly.
+ *          Either fd may be opened with O_DIRECT; only the short last
+ *          chunk is then written without it.
+ * Args: int in_fd             : Input, a regular file
+ *       int out_fd            : Output, may be in_fd for an in-place transform
+ *       int action            : Cipher action (1=encrypt, 0=decrypt, -1=pass-through (copy))
+ *       const crypt_key* key  : Derived key, may be NULL for pass-through
+ *       unsigned char* buf    : From crypt_buf_alloc(chunk)
+ *       size_t chunk          : Bytes per pread, a multiple of STREAM_ALIGN
+ * Return: FAILURE on error, SUCCESS on success
+ */
+extern int crypt_fd(int in_fd, int out_fd, int action, const crypt_key* key,
+		    unsigned char* buf, size_t chunk);
+
+/* Parallel container format written by par_encrypt_fd:
+ *
+ *   [ header | chunk 0 + tag | chunk 1 + tag | ... | chunk n + tag ]
+ *
+ * The header is PAR_HEADER_SIZE bytes: PAR_MAGIC, version, chunk size,
+ * plaintext size, PBKDF2 iterations, backend id (version 2 only; version
+ * 1 is always AES-256-GCM), salt and a random nonce. Every chunk is
+ * sealed on its own with the header's backend, with the nonce's low 8
+ * bytes xored with the chunk index and the header plus chunk index as
+ * associated data, so chunks can be encrypted and verified in any order
+ * but cannot be moved, dropped or mixed between files.
+ */
+#define PAR_MAGIC "AESCPAR1"
+#define PAR_VERSION 2
+#define PAR_HEADER_SIZE 64
+#define PAR_TAG_SIZE 16
+#define PAR_NONCE_SIZE AEAD_IV_SIZE
+#define PAR_MAX_THREADS 64	/* more threads are cut to this */
+
+/* int par_encrypt_fd(int in_fd, int out_fd, char* key_str, int threads,
+ *                    size_t chunk)
+ * Purpose: Encrypt in_fd into the container format in out_fd with
+ *          aead_select()'s backend, chunks spread over threads worker
+ *          threads. Each worker preads its
+ *          chunk and pwrites the result at the chunk's own offset, so
+ *          the output is in order whatever order chunks finish in
+ * Args: int in_fd        : Input, a regular file
+ *       int out_fd       : Output, truncated to the container's size
+ *       char* key_str    : Passphrase, run through PBKDF2 with a new salt
+ *       int threads      : Worker threads, 0 for one per online CPU
+ *       size_t chunk     : Plaintext bytes per chunk, 0 for STREAM_CHUNK
+ * Return: FAILURE on error, SUCCESS on success
+ */
+extern int par_encrypt_fd(int in_fd, int out_fd, char* key_str, int threads,
+			  size_t chunk);
+
+/* int par_decrypt_fd(int in_fd, int out_fd, char* key_str, int threads)
+ * Purpose: Verify and decrypt a container made by par_encrypt_fd, in
+ *          parallel like par_encrypt_fd
+ * Return: FAILURE on error or if any chunk fails to verify (out_fd is
+ *         then truncated to nothing), SUCCESS on success
+ */
+extern int par_decrypt_fd(int in_fd, int out_fd, char* key_str, int threads);
+
+/* AES-256-CTR and AEAD state that can be reused across many buffers,
+ * one per thread or open file. Copied from a crypt_key's templates.
+ */
+typedef struct ctr_cipher_s{
+    EVP_CIPHER_CTX* ctx;	/* CTR */
+    EVP_CIPHER_CTX* aead[AEAD_COUNT];	/* NULL where not available */
+} ctr_cipher;
+
+/* int ctr_cipher_init(ctr_cipher* cipher, const crypt_key* key)
+ * Purpose: Set up cipher as a copy of key's template context
+ * Args: ctr_cipher* cipher   : Context to fill in
+ *       const crypt_key* key : Key from derive_key
+ * Return: FAILURE on error, SUCCESS on success
+ */
+extern int ctr_cipher_init(ctr_cipher* cipher, const crypt_key* key);
+
+/* int ctr_cipher_apply(ctr_cipher* cipher, const unsigned char* in,
+ *                      unsigned char* out, int len, const unsigned char* iv)
+ * Purpose: AES-256-CTR transform len bytes of in into out (encryption and
+ *          decryption are the same operation, in may equal out)
+ * Args: ctr_cipher* cipher       : Context from ctr_cipher_init
+ *       const unsigned char* in  : Input buffer
+ *       unsigned char* out       : Output buffer, at least len bytes
+ *       int len                  : Number of bytes to transform
+ *       const unsigned char* iv  : 16 byte initial counter block
+ * Return: FAILURE on error, SUCCESS on success
+ */
+extern int ctr_cipher_apply(ctr_cipher* cipher, const unsigned char* in,
+			    unsigned char* out, int len, const unsigned char* iv);
+
+/* int aead_cipher_seal(ctr_cipher* cipher, int aead,
+ *                      const unsigned char* iv,
+ *                      const unsigned char* aad, int aad_len,
+ *                      const unsigned char* in, unsigned char* out, int len,
+ *                      unsigned char* tag)
+ * Purpose: Encrypt len bytes of in into out with backend aead,
+ *          authenticating aad along with them, and put the tag in tag
+ * Args: int aead                 : AEAD_* id
+ *       const unsigned char* iv  : AEAD_IV_SIZE byte nonce, never to be
+ *                                  used twice with the same key
+ *       const unsigned char* aad : Data bound to the ciphertext but not
+ *                                  stored in it
+ *       unsigned char* tag       : AEAD_TAG_SIZE bytes out
+ * Return: FAILURE on error or if aead is not available, SUCCESS on success
+ */
+extern int aead_cipher_seal(ctr_cipher* cipher, int aead,
+			    const unsigned char* iv,
+			    const unsigned char* aad, int aad_len,
+			    const unsigned char* in, unsigned char* out, int len,
+			    unsigned char* tag);
+
+/* int aead_cipher_open(ctr_cipher* cipher, int aead,
+ *                      const unsigned char* iv,
+ *                      const unsigned char* aad, int aad_len,
+ *                      const unsigned char* in, unsigned char* out, int len,
+ *                      const unsigned char* tag)
+ * Purpose: Verify and decrypt what aead_cipher_seal made. out holds
+ *          garbage unless this succeeds
+ * Return: FAILURE on error or if the ciphertext, aad or tag were changed,
+ *         SUCCESS on success
+ */
+extern int aead_cipher_open(ctr_cipher* cipher, int aead,
+			    const unsigned char* iv,
+			    const unsigned char* aad, int aad_len,
+			    const unsigned char* in, unsigned char* out, int len,
+			    const unsigned char* tag);
+
+/* void ctr_cipher_cleanup(ctr_cipher* cipher)
+ * Purpose: Free the contexts
+ */
+extern void ctr_cipher_cleanup(ctr_cipher* cipher);
+
 #endif
@@ -0,0 +1,268 @@
+/* encfs-block-test.c
+ * Checks of the pa5-encfs block format, without FUSE
+ *
+ * By Shane Sarnac
+ *
+ * Writes files in <scratch dir> through encfs-block.c, once with each
+ * authenticated cipher this OpenSSL has, and checks that they read back
+ * as written, and that a changed byte, swapped blocks, a file cut short,
+ * a zeroed block and appended zeros in the backing file all read as
+ * -EIO. Prints one line per cipher and exits with 1 if a check failed.
+ *
+ * usage: encfs-block-test <scratch dir>
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <openssl/rand.h>
+
+#include "aes-crypt.h"
+#include "encfs-block.h"
+
+#define KEY_PHRASE "encfs-block-test"
+#define MAX_SIZE (64 * ENCFS_BLOCK_SIZE)
+#define STRIDE (ENCFS_BLOCK_SIZE + ENCFS_AEAD_OVERHEAD)
+
+#define CHECK(cond) check((cond), #cond, __LINE__)
+
+static char path[1024];
+static char data[MAX_SIZE];
+static char back[MAX_SIZE + ENCFS_BLOCK_SIZE];
+static int failures;
+
+static void check(int ok, const char* what, int line)
+{
+	if (!ok) {
+		fprintf(stderr, "encfs-block-test.c:%d: %s\n", line, what);
+		failures++;
+	}
+}
+
+static off_t raw_offset(uint64_t block)
+{
+	return ENCFS_HEADER_SIZE + (off_t)block * STRIDE;
+}
+
+// a new, empty block format file at path
+static int new_file(struct encfs_header* hdr)
+{
+	int fd;
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1) {
+		perror("open error");
+		exit(EXIT_FAILURE);
+	}
+	if (encfs_header_init(hdr) < 0 || encfs_header_write(fd, hdr) < 0) {
+		fprintf(stderr, "header write failed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	return fd;
+}
+
+static off_t length_of(int fd, const struct encfs_header* hdr)
+{
+	struct stat st;
+
+	if (fstat(fd, &st) == -1)
+		return -1;
+	return encfs_logical_size(hdr, st.st_size);
+}
+
+// whether the file reads back as the first size bytes of data
+static int reads_as(int fd, const struct encfs_header* hdr, off_t size,
+		    ctr_cipher* cipher)
+{
+	return length_of(fd, hdr) == size &&
+	       encfs_read(fd, hdr, back, sizeof(back), 0, cipher) == size &&
+	       memcmp(back, data, size) == 0;
+}
+
+// a file of size bytes of data, written in pieces of step bytes
+static int make_file(struct encfs_header* hdr, off_t size, off_t step,
+		     ctr_cipher* cipher)
+{
+	off_t pos, n;
+	int fd;
+
+	fd = new_file(hdr);
+	for (pos = 0; pos < size; pos += n) {
+		n = (size - pos < step) ? size - pos : step;
+		CHECK(encfs_write(fd, hdr, data + pos, n, pos, cipher) == n);
+	}
+
+	return fd;
+}
+
+static void round_trips(ctr_cipher* cipher)
+{
+	static const off_t sizes[] = { 0, 1, 4095, 4096, 4097, 100000,
+				       40 * ENCFS_BLOCK_SIZE + 7 };
+	struct encfs_header hdr;
+	size_t i;
+	int fd;
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		fd = make_file(&hdr, sizes[i], MAX_SIZE, cipher);
+		CHECK(reads_as(fd, &hdr, sizes[i], cipher));
+		close(fd);
+
+		fd = make_file(&hdr, sizes[i], 3000, cipher);
+		CHECK(reads_as(fd, &hdr, sizes[i], cipher));
+		close(fd);
+
+		fd = make_file(&hdr, sizes[i], ENCFS_BLOCK_SIZE, cipher);
+		CHECK(reads_as(fd, &hdr, sizes[i], cipher));
+		close(fd);
+	}
+
+	// an overwrite across block edges
+	fd = make_file(&hdr, 100000, MAX_SIZE, cipher);
+	RAND_bytes((unsigned char*)data + 3000, 9000);
+	CHECK(encfs_write(fd, &hdr, data + 3000, 9000, 3000, cipher) == 9000);
+	CHECK(reads_as(fd, &hdr, 100000, cipher));
+
+	// shrinking to a block edge and growing again
+	CHECK(encfs_truncate(fd, &hdr, 8 * ENCFS_BLOCK_SIZE, cipher) == 0);
+	CHECK(reads_as(fd, &hdr, 8 * ENCFS_BLOCK_SIZE, cipher));
+	CHECK(encfs_truncate(fd, &hdr, 5000, cipher) == 0);
+	CHECK(reads_as(fd, &hdr, 5000, cipher));
+	close(fd);
+}
+
+static void sparse(ctr_cipher* cipher)
+{
+	struct encfs_header hdr;
+	off_t size = 20 * ENCFS_BLOCK_SIZE + 5;
+	int fd;
+
+	fd = make_file(&hdr, 5, MAX_SIZE, cipher);
+	CHECK(encfs_truncate(fd, &hdr, size, cipher) == 0);
+	memset(data + 5, 0, size - 5);
+	CHECK(reads_as(fd, &hdr, size, cipher));
+
+	CHECK(encfs_write(fd, &hdr, "abc", 3, 30 * ENCFS_BLOCK_SIZE, cipher) == 3);
+	memset(data + size, 0, 30 * ENCFS_BLOCK_SIZE - size);
+	memcpy(data + 30 * ENCFS_BLOCK_SIZE, "abc", 3);
+	CHECK(reads_as(fd, &hdr, 30 * ENCFS_BLOCK_SIZE + 3, cipher));
+	close(fd);
+
+	RAND_bytes((unsigned char*)data, sizeof(data));
+}
+
+static void tampering(ctr_cipher* cipher)
+{
+	static unsigned char a[STRIDE], b[STRIDE];
+	struct encfs_header hdr;
+	off_t size = 10 * ENCFS_BLOCK_SIZE + 100;
+	int fd;
+
+	// a changed byte fails its own block only
+	fd = make_file(&hdr, size, MAX_SIZE, cipher);
+	CHECK(pread(fd, a, 1, raw_offset(2) + 100) == 1);
+	a[0] ^= 1;
+	CHECK(pwrite(fd, a, 1, raw_offset(2) + 100) == 1);
+	CHECK(encfs_read(fd, &hdr, back, 100, 2 * ENCFS_BLOCK_SIZE, cipher) == -EIO);
+	CHECK(encfs_read(fd, &hdr, back, 100, ENCFS_BLOCK_SIZE, cipher) == 100);
+	close(fd);
+
+	// swapped blocks
+	fd = make_file(&hdr, size, MAX_SIZE, cipher);
+	CHECK(pread(fd, a, STRIDE, raw_offset(1)) == STRIDE);
+	CHECK(pread(fd, b, STRIDE, raw_offset(3)) == STRIDE);
+	CHECK(pwrite(fd, b, STRIDE, raw_offset(1)) == STRIDE);
+	CHECK(pwrite(fd, a, STRIDE, raw_offset(3)) == STRIDE);
+	CHECK(encfs_read(fd, &hdr, back, size, 0, cipher) == -EIO);
+	close(fd);
+
+	// a zeroed block
+	fd = make_file(&hdr, size, MAX_SIZE, cipher);
+	memset(a, 0, STRIDE);
+	CHECK(pwrite(fd, a, STRIDE, raw_offset(4)) == STRIDE);
+	CHECK(encfs_read(fd, &hdr, back, size, 0, cipher) == -EIO);
+	close(fd);
+
+	// the tail dropped at a block edge, from files written at once and
+	// block by block, and mid-block
+	fd = make_file(&hdr, size, MAX_SIZE, cipher);
+	CHECK(ftruncate(fd, raw_offset(6)) == 0);
+	CHECK(length_of(fd, &hdr) == 6 * ENCFS_BLOCK_SIZE);
+	CHECK(encfs_read(fd, &hdr, back, size, 0, cipher) == -EIO);
+	close(fd);
+
+	fd = make_file(&hdr, size, ENCFS_BLOCK_SIZE, cipher);
+	CHECK(ftruncate(fd, raw_offset(6)) == 0);
+	CHECK(encfs_read(fd, &hdr, back, size, 0, cipher) == -EIO);
+	close(fd);
+
+	fd = make_file(&hdr, size, MAX_SIZE, cipher);
+	CHECK(ftruncate(fd, raw_offset(6) + AEAD_IV_SIZE + 50) == 0);
+	CHECK(encfs_read(fd, &hdr, back, size, 0, cipher) == -EIO);
+	close(fd);
+
+	// zeros appended, written or as a hole
+	fd = make_file(&hdr, 8 * ENCFS_BLOCK_SIZE, MAX_SIZE, cipher);
+	CHECK(pwrite(fd, a, STRIDE, raw_offset(8)) == STRIDE);
+	CHECK(encfs_read(fd, &hdr, back, sizeof(back), 0, cipher) == -EIO);
+	close(fd);
+
+	fd = make_file(&hdr, 8 * ENCFS_BLOCK_SIZE, MAX_SIZE, cipher);
+	CHECK(ftruncate(fd, raw_offset(12)) == 0);
+	CHECK(encfs_read(fd, &hdr, back, sizeof(back), 0, cipher) == -EIO);
+	close(fd);
+}
+
+int main(int argc, char* argv[])
+{
+	crypt_key key;
+	ctr_cipher cipher;
+	int aead, before;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s <scratch dir>\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	snprintf(path, sizeof(path), "%s/encfs-block-test.bin", argv[1]);
+
+	if (!derive_key(&key, KEY_PHRASE, KDF_LEGACY, NULL, 0, 0)) {
+		fprintf(stderr, "key setup failed\n");
+		return EXIT_FAILURE;
+	}
+	encfs_block_setup(&key);
+	RAND_bytes((unsigned char*)data, sizeof(data));
+
+	for (aead = 0; aead < AEAD_COUNT; aead++) {
+		if (!aead_available(aead)) {
+			printf("%s: not in this OpenSSL, skipped\n", aead_name(aead));
+			continue;
+		}
+		// new files are sealed with key.aead
+		key.aead = aead;
+		if (!ctr_cipher_init(&cipher, &key)) {
+			fprintf(stderr, "cipher setup failed\n");
+			return EXIT_FAILURE;
+		}
+
+		before = failures;
+		round_trips(&cipher);
+		sparse(&cipher);
+		tampering(&cipher);
+		printf("%s: %s\n", aead_name(aead),
+		       (failures == before) ? "ok" : "FAILED");
+
+		ctr_cipher_cleanup(&cipher);
+	}
+
+	unlink(path);
+	key_cleanup(&key);
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,1240 @@
+/* encfs-block.c
+ * Random-access on-disk format for encrypted pa5-encfs files
+ *
+ * By Shane Sarnac
+ *
+ * See encfs-block.h for the layout. The worker pool takes whole blocks
+ * of a job one at a time from a shared index, like par_encrypt_fd()'s
+ * chunks; the thread that posted the job takes blocks too and waits for
+ * the rest.
+ */
+
+/* For fallocate() */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#include <openssl/rand.h>
+
+#include "aes-crypt.h"
+#include "encfs-block.h"
+
+static void put_le32(unsigned char* p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static uint32_t get_le32(const unsigned char* p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// associated data of a sealed block: the file's id, the block index and
+// whether it is the last block
+#define AAD_SIZE (ENCFS_NONCE_SIZE + 9)
+
+// Blocks of one read or write, sealed from plain into raw or opened
+// from raw into plain
+struct block_job {
+	const struct encfs_header* hdr;
+	int seal;
+	int fd;			// backing file and its size, to look for holes
+	off_t size;
+	uint64_t final;		// index of the file's last block
+	int holes;		// whether any block opened was a hole
+	uint64_t first;		// block index of raw[0] and plain[0]
+	unsigned char* raw;	// block_stride() apart
+	char* plain;		// ENCFS_BLOCK_SIZE apart
+	size_t len;		// plaintext bytes to seal, raw bytes to open
+	size_t blocks;
+	size_t next;		// first block nobody has taken
+	size_t done;
+	int err;
+	struct block_job* link;	// next job in the queue
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t work;	// a job was queued
+	pthread_cond_t done;	// the last block of a job finished
+	struct block_job* queue;	// jobs with blocks left to take
+	const crypt_key* key;
+	int workers;
+} pool = {
+	PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_COND_INITIALIZER,
+	PTHREAD_COND_INITIALIZER,
+	NULL, NULL, 0
+};
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+// whether blocks carry a nonce and tag, or are plain CTR
+static int block_sealed(const struct encfs_header* hdr)
+{
+	return hdr->version != ENCFS_VERSION_CTR;
+}
+
+static int block_aead(const struct encfs_header* hdr)
+{
+	if (hdr->version == ENCFS_VERSION_CHACHA)
+		return AEAD_CHACHA20_POLY1305;
+	return AEAD_AES_256_GCM;
+}
+
+// bytes from the start of one block to the next on disk
+static size_t block_stride(const struct encfs_header* hdr)
+{
+	if (block_sealed(hdr))
+		return ENCFS_BLOCK_SIZE + ENCFS_AEAD_OVERHEAD;
+	return ENCFS_BLOCK_SIZE;
+}
+
+static off_t block_offset(const struct encfs_header* hdr, uint64_t block)
+{
+	return ENCFS_HEADER_SIZE + (off_t)block * block_stride(hdr);
+}
+
+static void block_aad(const struct encfs_header* hdr, uint64_t block,
+		      int last, unsigned char* aad)
+{
+	int i;
+
+	memcpy(aad, hdr->nonce, ENCFS_NONCE_SIZE);
+	for (i = 0; i < 8; i++)
+		aad[ENCFS_NONCE_SIZE + i] = block >> (8 * i);
+	aad[ENCFS_NONCE_SIZE + 8] = last ? 1 : 0;
+}
+
+// Encrypt len bytes of block into raw as [ nonce | ciphertext | tag ]
+static int seal_block(const struct encfs_header* hdr, uint64_t block,
+		      int last, const char* plain, size_t len,
+		      unsigned char* raw, ctr_cipher* cipher)
+{
+	unsigned char aad[AAD_SIZE];
+
+	if (RAND_bytes(raw, AEAD_IV_SIZE) != 1)
+		return -EIO;
+	block_aad(hdr, block, last, aad);
+	if (!aead_cipher_seal(cipher, block_aead(hdr), raw, aad, AAD_SIZE,
+			      (const unsigned char*)plain, raw + AEAD_IV_SIZE,
+			      len, raw + AEAD_IV_SIZE + len))
+		return -EIO;
+
+	return 0;
+}
+
+// Verify and decrypt the raw_len stored bytes of block into plain
+static int open_block(const struct encfs_header* hdr, uint64_t block,
+		      int last, const unsigned char* raw, size_t raw_len,
+		      char* plain, ctr_cipher* cipher)
+{
+	unsigned char aad[AAD_SIZE];
+	size_t len;
+
+	if (raw_len <= ENCFS_AEAD_OVERHEAD)
+		goto bad;
+	len = raw_len - ENCFS_AEAD_OVERHEAD;
+
+	block_aad(hdr, block, last, aad);
+	if (!aead_cipher_open(cipher, block_aead(hdr), raw, aad, AAD_SIZE,
+			      raw + AEAD_IV_SIZE, (unsigned char*)plain, len,
+			      raw + AEAD_IV_SIZE + len))
+		goto bad;
+
+	return 0;
+
+bad:
+	if (!aead_available(block_aead(hdr)))
+		fprintf(stderr, "Block %llu needs %s, which this OpenSSL lacks\n",
+			(unsigned long long)block, aead_name(block_aead(hdr)));
+	else
+		fprintf(stderr, "Block %llu failed to verify\n",
+			(unsigned long long)block);
+	return -EIO;
+}
+
+// Whether the stored bytes of block reach into a hole of the backing
+// file, size bytes long. The hole every file ends in does not count
+static int block_in_hole(int fd, const struct encfs_header* hdr,
+			 uint64_t block, off_t size)
+{
+	off_t from = block_offset(hdr, block);
+	off_t to = from + block_stride(hdr);
+	off_t hole;
+
+	if (to > size)
+		to = size;
+	if (from >= to)
+		return 0;
+	hole = lseek(fd, from, SEEK_HOLE);
+	return hole != -1 && hole < to;
+}
+
+// A hole is a block that was never written: all zeros, not the last
+// block, and at least partly unallocated in the backing file. A block
+// zeroed on disk is allocated, so it still has to verify
+static int job_hole(const struct block_job* job, uint64_t block,
+		    const unsigned char* raw, size_t raw_len)
+{
+	if (block == job->final || raw_len <= ENCFS_AEAD_OVERHEAD ||
+	    raw[0] != 0 || memcmp(raw, raw + 1, raw_len - 1) != 0)
+		return 0;
+	return block_in_hole(job->fd, job->hdr, block, job->size);
+}
+
+static int job_block(struct block_job* job, size_t i, ctr_cipher* cipher)
+{
+	size_t stride = block_stride(job->hdr);
+	size_t len;
+
+	if (job->seal) {
+		len = job->len - i * ENCFS_BLOCK_SIZE;
+		if (len > ENCFS_BLOCK_SIZE)
+			len = ENCFS_BLOCK_SIZE;
+		return seal_block(job->hdr, job->first + i,
+				  job->first + i == job->final,
+				  job->plain + i * ENCFS_BLOCK_SIZE, len,
+				  job->raw + i * stride, cipher);
+	}
+
+	len = job->len - i * stride;
+	if (len > stride)
+		len = stride;
+	if (job_hole(job, job->first + i, job->raw + i * stride, len)) {
+		memset(job->plain + i * ENCFS_BLOCK_SIZE, 0,
+		       len - ENCFS_AEAD_OVERHEAD);
+		__atomic_store_n(&job->holes, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+	return open_block(job->hdr, job->first + i, job->first + i == job->final,
+			  job->raw + i * stride, len,
+			  job->plain + i * ENCFS_BLOCK_SIZE, cipher);
+}
+
+// Next block of job to work on, or -1 once all are taken. The job
+// leaves the queue with its last block. Caller holds pool.lock
+static long take_block(struct block_job* job)
+{
+	struct block_job** link;
+
+	if (job->next == job->blocks)
+		return -1;
+	if (++job->next == job->blocks) {
+		for (link = &pool.queue; *link != job; link = &(*link)->link)
+			;
+		*link = job->link;
+	}
+	return job->next - 1;
+}
+
+// caller holds pool.lock
+static void finish_block(struct block_job* job, int res)
+{
+	if (res < 0 && job->err == 0)
+		job->err = res;
+	if (++job->done == job->blocks)
+		pthread_cond_broadcast(&pool.done);
+}
+
+static void* pool_worker(void* arg)
+{
+	struct block_job* job;
+	ctr_cipher cipher;
+	long i;
+	int res;
+
+	(void) arg;
+
+	// without a cipher this thread just never helps
+	if (!ctr_cipher_init(&cipher, pool.key))
+		return NULL;
+
+	pthread_mutex_lock(&pool.lock);
+	for (;;) {
+		while (pool.queue == NULL)
+			pthread_cond_wait(&pool.work, &pool.lock);
+		job = pool.queue;
+		i = take_block(job);
+		pthread_mutex_unlock(&pool.lock);
+
+		res = job_block(job, i, &cipher);
+
+		pthread_mutex_lock(&pool.lock);
+		finish_block(job, res);
+	}
+
+	return NULL;
+}
+
+static void pool_start(void)
+{
+	pthread_t tid;
+	long n = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+
+	if (n > ENCFS_POOL_MAX)
+		n = ENCFS_POOL_MAX;
+	for (pool.workers = 0; pool.workers < n; pool.workers++) {
+		if (pthread_create(&tid, NULL, pool_worker, NULL) != 0)
+			break;
+		pthread_detach(tid);
+	}
+}
+
+// Seal or open every block of job, spread over the pool if it is big
+// enough to be worth waking it
+static int run_job(struct block_job* job, ctr_cipher* cipher)
+{
+	struct block_job** link;
+	long i;
+	int res;
+
+	if (job->blocks >= ENCFS_POOL_MIN_BLOCKS && pool.key)
+		pthread_once(&pool_once, pool_start);
+	if (job->blocks < ENCFS_POOL_MIN_BLOCKS || !pool.key || pool.workers == 0) {
+		for (i = 0; i < (long)job->blocks; i++) {
+			res = job_block(job, i, cipher);
+			if (res < 0)
+				return res;
+		}
+		return 0;
+	}
+
+	job->next = 0;
+	job->done = 0;
+	job->err = 0;
+	job->link = NULL;
+
+	pthread_mutex_lock(&pool.lock);
+	for (link = &pool.queue; *link; link = &(*link)->link)
+		;
+	*link = job;
+	pthread_cond_broadcast(&pool.work);
+
+	while ((i = take_block(job)) >= 0) {
+		pthread_mutex_unlock(&pool.lock);
+		res = job_block(job, i, cipher);
+		pthread_mutex_lock(&pool.lock);
+		finish_block(job, res);
+	}
+	while (job->done < job->blocks)
+		pthread_cond_wait(&pool.done, &pool.lock);
+	res = job->err;
+	pthread_mutex_unlock(&pool.lock);
+
+	return res;
+}
+
+void encfs_block_setup(const crypt_key* key)
+{
+	pool.key = key;
+}
+
+// counter block for the first byte of block: nonce + block * (BS / 16),
+// as a 128 bit big-endian add so the keystream runs on across blocks
+static void block_iv(const struct encfs_header* hdr, uint64_t block,
+		     unsigned char* iv)
+{
+	uint64_t add = block * (ENCFS_BLOCK_SIZE / 16);
+	unsigned int carry = 0;
+	int i;
+
+	for (i = ENCFS_NONCE_SIZE - 1; i >= 0; i--) {
+		unsigned int sum = hdr->nonce[i] + (add & 0xff) + carry;
+		iv[i] = sum & 0xff;
+		carry = sum >> 8;
+		add >>= 8;
+	}
+}
+
+int encfs_header_init(struct encfs_header* hdr)
+{
+	if (pool.key && pool.key->aead == AEAD_CHACHA20_POLY1305)
+		hdr->version = ENCFS_VERSION_CHACHA;
+	else
+		hdr->version = ENCFS_VERSION_GCM;
+	hdr->block_size = ENCFS_BLOCK_SIZE;
+	if (RAND_bytes(hdr->nonce, ENCFS_NONCE_SIZE) != 1)
+		return -EIO;
+
+	return 0;
+}
+
+int encfs_header_write(int fd, const struct encfs_header* hdr)
+{
+	unsigned char raw[ENCFS_HEADER_SIZE];
+
+	memset(raw, 0, sizeof(raw));
+	memcpy(raw, ENCFS_MAGIC, ENCFS_MAGIC_SIZE);
+	put_le32(raw + 8, hdr->version);
+	put_le32(raw + 12, hdr->block_size);
+	memcpy(raw + 16, hdr->nonce, ENCFS_NONCE_SIZE);
+
+	if (pwrite(fd, raw, sizeof(raw), 0) != sizeof(raw))
+		return -errno;
+
+	return 0;
+}
+
+int encfs_header_read(int fd, struct encfs_header* hdr)
+{
+	unsigned char raw[ENCFS_HEADER_SIZE];
+	ssize_t res;
+
+	res = pread(fd, raw, sizeof(raw), 0);
+	if (res == -1)
+		return -errno;
+
+	if (res != sizeof(raw) || memcmp(raw, ENCFS_MAGIC, ENCFS_MAGIC_SIZE) != 0)
+		return -EINVAL;
+
+	hdr->version = get_le32(raw + 8);
+	hdr->block_size = get_le32(raw + 12);
+	memcpy(hdr->nonce, raw + 16, ENCFS_NONCE_SIZE);
+
+	if (hdr->version < ENCFS_VERSION_CTR || hdr->version > ENCFS_VERSION_CHACHA
+	    || hdr->block_size != ENCFS_BLOCK_SIZE)
+		return -EINVAL;
+
+	return 0;
+}
+
+off_t encfs_logical_size(const struct encfs_header* hdr, off_t backing_size)
+{
+	size_t stride = block_stride(hdr);
+	size_t extra = stride - ENCFS_BLOCK_SIZE;
+	off_t data, rem;
+
+	if (backing_size <= ENCFS_HEADER_SIZE)
+		return 0;
+
+	data = backing_size - ENCFS_HEADER_SIZE;
+	rem = data % stride;
+	return data / stride * ENCFS_BLOCK_SIZE
+	       + ((size_t)rem > extra ? rem - (off_t)extra : 0);
+}
+
+off_t encfs_backing_size(const struct encfs_header* hdr, off_t length)
+{
+	size_t stride = block_stride(hdr);
+	off_t rem = length % ENCFS_BLOCK_SIZE;
+	off_t size;
+
+	size = ENCFS_HEADER_SIZE + length / ENCFS_BLOCK_SIZE * stride;
+	if (rem)
+		size += rem + (stride - ENCFS_BLOCK_SIZE);
+	return size;
+}
+
+// encfs_read() of a sealed file of length plaintext and backing bytes,
+// size already cut to the end of the file
+static ssize_t sealed_read(int fd, const struct encfs_header* hdr, char* buf,
+			size_t size, off_t offset, off_t length, off_t backing,
+			ctr_cipher* cipher)
+{
+	size_t stride = block_stride(hdr);
+	uint64_t block = offset / ENCFS_BLOCK_SIZE;
+	uint64_t last = (offset + size - 1) / ENCFS_BLOCK_SIZE;
+	size_t skip = offset % ENCFS_BLOCK_SIZE;
+	uint64_t final = (length - 1) / ENCFS_BLOCK_SIZE;
+	struct block_job job;
+	unsigned char* raw;
+	char* plain;
+	size_t done = 0, n, avail, copy, raw_len;
+	int holes = 0, final_read = 0;
+	ssize_t res;
+
+	raw = malloc(ENCFS_CHUNK_BLOCKS * stride);
+	plain = malloc(ENCFS_CHUNK_BLOCKS * ENCFS_BLOCK_SIZE);
+	if (raw == NULL || plain == NULL) {
+		res = -ENOMEM;
+		goto out;
+	}
+
+	while (block <= last) {
+		n = last - block + 1;
+		if (n > ENCFS_CHUNK_BLOCKS)
+			n = ENCFS_CHUNK_BLOCKS;
+
+		res = pread(fd, raw, n * stride, block_offset(hdr, block));
+		if (res == -1) {
+			res = -errno;
+			goto out;
+		}
+		if (res == 0)
+			break;
+
+		memset(&job, 0, sizeof(job));
+		job.hdr = hdr;
+		job.fd = fd;
+		job.size = backing;
+		job.final = final;
+		job.first = block;
+		job.raw = raw;
+		job.plain = plain;
+		job.len = res;
+		job.blocks = (res + stride - 1) / stride;
+		res = run_job(&job, cipher);
+		if (res < 0)
+			goto out;
+		holes |= job.holes;
+		final_read |= (block + job.blocks > final);
+
+		avail = encfs_logical_size(hdr, ENCFS_HEADER_SIZE + job.len);
+		if (avail <= skip)
+			break;
+		copy = avail - skip;
+		if (copy > size - done)
+			copy = size - done;
+		memcpy(buf + done, plain + skip, copy);
+		done += copy;
+		skip = 0;
+		block += job.blocks;
+		if (job.len < n * stride)
+			break;
+	}
+	res = done;
+
+	// zeros from a hole are only as good as the length: the file has
+	// to end in a block that verifies, not in a hole cut or grown on disk
+	if (holes && !final_read) {
+		raw_len = backing - block_offset(hdr, final);
+		if (raw_len > stride || pread(fd, raw, raw_len,
+					      block_offset(hdr, final)) != (ssize_t)raw_len)
+			res = -EIO;
+		else if (open_block(hdr, final, 1, raw, raw_len, plain, cipher) < 0)
+			res = -EIO;
+	}
+
+out:
+	free(plain);
+	free(raw);
+	return res;
+}
+
+ssize_t encfs_read(int fd, const struct encfs_header* hdr, char* buf,
+		   size_t size, off_t offset, ctr_cipher* cipher)
+{
+	unsigned char* chunk;
+	unsigned char iv[ENCFS_NONCE_SIZE];
+	struct stat st;
+	off_t length, pos, end, stop;
+	size_t done = 0;
+
+	if (fstat(fd, &st) == -1)
+		return -errno;
+
+	length = encfs_logical_size(hdr, st.st_size);
+	if (offset >= length || size == 0)
+		return 0;
+	if ((off_t)size > length - offset)
+		size = length - offset;
+
+	if (block_sealed(hdr))
+		return sealed_read(fd, hdr, buf, size, offset, length,
+				   st.st_size, cipher);
+
+	chunk = malloc(ENCFS_CHUNK_BLOCKS * ENCFS_BLOCK_SIZE);
+	if (chunk == NULL)
+		return -ENOMEM;
+
+	// walk whole blocks from the one holding offset to the one holding
+	// the last byte wanted, a chunk of blocks per pread
+	pos = offset - (offset % ENCFS_BLOCK_SIZE);
+	end = offset + size;
+	stop = end + (ENCFS_BLOCK_SIZE - 1) - ((end + ENCFS_BLOCK_SIZE - 1) % ENCFS_BLOCK_SIZE);
+	if (stop > length)
+		stop = length;
+	while (pos < end) {
+		size_t want = ENCFS_CHUNK_BLOCKS * ENCFS_BLOCK_SIZE;
+		size_t skip = (pos < offset) ? offset - pos : 0;
+		size_t copy;
+		ssize_t res;
+
+		if ((off_t)want > stop - pos)
+			want = stop - pos;
+
+		res = pread(fd, chunk, want, ENCFS_HEADER_SIZE + pos);
+		if (res == -1) {
+			free(chunk);
+			return -errno;
+		}
+		if (res == 0)
+			break;
+
+		block_iv(hdr, pos / ENCFS_BLOCK_SIZE, iv);
+		if (!ctr_cipher_apply(cipher, chunk, chunk, res, iv)) {
+			free(chunk);
+			return -EIO;
+		}
+
+		if ((size_t)res <= skip)
+			break;
+		copy = res - skip;
+		if (copy > size - done)
+			copy = size - done;
+		memcpy(buf + done, chunk + skip, copy);
+		done += copy;
+		pos += res;
+	}
+
+	free(chunk);
+	return done;
+}
+
+static const char zero_block[ENCFS_BLOCK_SIZE];
+
+static ssize_t seal_run(int fd, const struct encfs_header* hdr,
+			const char* lead, const char* buf, size_t len,
+			uint64_t first_block, uint64_t final, ctr_cipher* cipher);
+
+// Store zeros in block, a hole the writes next to it may have left
+// without any unallocated part in the backing file
+static int keep_hole(int fd, const struct encfs_header* hdr, uint64_t block,
+		     uint64_t final, ctr_cipher* cipher)
+{
+	struct stat st;
+	ssize_t res;
+
+	if (fstat(fd, &st) == -1)
+		return -errno;
+	if (block_in_hole(fd, hdr, block, st.st_size))
+		return 0;
+	res = seal_run(fd, hdr, NULL, zero_block, ENCFS_BLOCK_SIZE, block, final,
+		       cipher);
+	return (res < 0) ? res : 0;
+}
+
+// Seal len bytes from buf as the blocks from first_block on and store
+// them, in a file whose last block is final. lead, if not NULL, is the
+// whole block before them, sealed again and stored with the first chunk
+static ssize_t seal_run(int fd, const struct encfs_header* hdr,
+			const char* lead, const char* buf, size_t len,
+			uint64_t first_block, uint64_t final, ctr_cipher* cipher)
+{
+	size_t stride = block_stride(hdr);
+	uint64_t before = first_block - (lead ? 1 : 0);
+	uint64_t after = first_block + (len + ENCFS_BLOCK_SIZE - 1) / ENCFS_BLOCK_SIZE;
+	struct block_job job;
+	struct stat st;
+	unsigned char* raw;
+	size_t done = 0, n, raw_len, lead_len = 0;
+	int hole_before, hole_after;
+	ssize_t res;
+
+	// the blocks on either side share backing file blocks with these,
+	// which the write allocates
+	if (fstat(fd, &st) == -1)
+		return -errno;
+	hole_before = before > 0 && block_in_hole(fd, hdr, before - 1, st.st_size);
+	hole_after = block_in_hole(fd, hdr, after, st.st_size);
+
+	raw = malloc((ENCFS_CHUNK_BLOCKS + 1) * stride);
+	if (raw == NULL)
+		return -ENOMEM;
+
+	if (lead) {
+		res = seal_block(hdr, first_block - 1, first_block - 1 == final,
+				 lead, ENCFS_BLOCK_SIZE, raw, cipher);
+		if (res < 0)
+			goto out;
+		lead_len = stride;
+	}
+
+	while (done < len) {
+		n = ENCFS_CHUNK_BLOCKS * ENCFS_BLOCK_SIZE;
+		if (n > len - done)
+			n = len - done;
+
+		memset(&job, 0, sizeof(job));
+		job.hdr = hdr;
+		job.seal = 1;
+		job.final = final;
+		job.first = first_block + done / ENCFS_BLOCK_SIZE;
+		job.raw = raw + lead_len;
+		job.plain = (char*)buf + done;	// only read when sealing
+		job.len = n;
+		job.blocks = (n + ENCFS_BLOCK_SIZE - 1) / ENCFS_BLOCK_SIZE;
+		res = run_job(&job, cipher);
+		if (res < 0)
+			goto out;
+
+		raw_len = lead_len + encfs_backing_size(hdr, n) - ENCFS_HEADER_SIZE;
+		res = pwrite(fd, raw, raw_len, block_offset(hdr, job.first) - lead_len);
+		if (res != (ssize_t)raw_len) {
+			res = (res == -1) ? -errno : -EIO;
+			goto out;
+		}
+		lead_len = 0;
+		done += n;
+	}
+	res = len;
+
+	if (hole_before)
+		res = keep_hole(fd, hdr, before - 1, final, cipher);
+	if (res >= 0 && hole_after)
+		res = keep_hole(fd, hdr, after, final, cipher);
+	if (res >= 0)
+		res = len;
+
+out:
+	free(raw);
+	return res;
+}
+
+// Store len bytes from buf as the blocks from first_block on, no further
+// than length, the file's length, which is new_length afterwards. If
+// they start right after the old last block, that one is sealed again
+// as an inner block: a file cut back to it on disk would otherwise
+// still verify
+static ssize_t write_run(int fd, const struct encfs_header* hdr,
+			 const char* buf, size_t len, uint64_t first_block,
+			 off_t length, off_t new_length, ctr_cipher* cipher)
+{
+	char* lead = NULL;
+	ssize_t res;
+
+	if (length > 0 && (off_t)first_block * ENCFS_BLOCK_SIZE == length &&
+	    new_length > length) {
+		lead = malloc(ENCFS_BLOCK_SIZE);
+		if (lead == NULL)
+			return -ENOMEM;
+		res = encfs_read(fd, hdr, lead, ENCFS_BLOCK_SIZE,
+				 length - ENCFS_BLOCK_SIZE, cipher);
+		if (res != ENCFS_BLOCK_SIZE) {
+			free(lead);
+			return (res < 0) ? res : -EIO;
+		}
+	}
+
+	res = seal_run(fd, hdr, lead, buf, len, first_block,
+		       (new_length - 1) / ENCFS_BLOCK_SIZE, cipher);
+	free(lead);
+	return res;
+}
+
+static int sealed_grow(int fd, const struct encfs_header* hdr, off_t length,
+		       off_t size, ctr_cipher* cipher);
+
+ssize_t encfs_write_blocks(int fd, const struct encfs_header* hdr,
+			   const char* buf, size_t len,
+			   uint64_t first_block, ctr_cipher* cipher)
+{
+	struct stat st;
+	off_t length, start = (off_t)first_block * ENCFS_BLOCK_SIZE;
+	int res;
+
+	// a CTR block written again would reuse its keystream
+	if (!block_sealed(hdr))
+		return -EROFS;
+	if (len == 0)
+		return 0;
+	if (fstat(fd, &st) == -1)
+		return -errno;
+	length = encfs_logical_size(hdr, st.st_size);
+
+	if (start > length) {
+		res = sealed_grow(fd, hdr, length, start, cipher);
+		if (res < 0)
+			return res;
+		length = start;
+	}
+
+	return write_run(fd, hdr, buf, len, first_block, length,
+			 (start + (off_t)len > length) ? start + (off_t)len : length,
+			 cipher);
+}
+
+// Make sure every block in [first, last), meant to be holes, reads as
+// one: a block left without an unallocated part, because the file
+// system has no holes or the blocks around it took them, gets zeros
+// stored in it. final is the file's last block
+static int fill_gap(int fd, const struct encfs_header* hdr, uint64_t first,
+		    uint64_t last, uint64_t final, ctr_cipher* cipher)
+{
+	size_t stride = block_stride(hdr);
+	uint64_t block = first, next;
+	struct stat st;
+	off_t from, hole, data;
+	ssize_t res;
+
+	while (block < last) {
+		if (fstat(fd, &st) == -1)
+			return -errno;
+		from = block_offset(hdr, block);
+		hole = lseek(fd, from, SEEK_HOLE);
+		if (hole != -1 && hole < from + (off_t)stride && hole < st.st_size) {
+			// every block that reaches into [hole, data) is fine,
+			// go on with the first one past it
+			data = lseek(fd, hole, SEEK_DATA);
+			if (data == -1)
+				data = st.st_size;
+			next = (data - ENCFS_HEADER_SIZE) / stride;
+			if (block_offset(hdr, next) < data)
+				next++;
+			block = (next > block) ? next : block + 1;
+			continue;
+		}
+
+		res = seal_run(fd, hdr, NULL, zero_block, ENCFS_BLOCK_SIZE,
+			       block, final, cipher);
+		if (res < 0)
+			return res;
+		block++;
+	}
+
+	return 0;
+}
+
+// Grow a sealed file from length to size. The old last block is sealed
+// again with the zeros it gains, as an inner block unless it stays the
+// last, and the new last block is stored; the ones between them are
+// left holes
+static int sealed_grow(int fd, const struct encfs_header* hdr, off_t length,
+		       off_t size, ctr_cipher* cipher)
+{
+	uint64_t final = (size - 1) / ENCFS_BLOCK_SIZE;
+	uint64_t old, gap = 0;
+	off_t start, fill;
+	char* plain;
+	ssize_t res = 0;
+
+	plain = calloc(1, ENCFS_BLOCK_SIZE);
+	if (plain == NULL)
+		return -ENOMEM;
+
+	if (length > 0) {
+		old = (length - 1) / ENCFS_BLOCK_SIZE;
+		start = (off_t)old * ENCFS_BLOCK_SIZE;
+		gap = old + 1;
+		fill = size - start;
+		if (fill > ENCFS_BLOCK_SIZE)
+			fill = ENCFS_BLOCK_SIZE;
+		if (fill > length - start || old < final) {
+			res = encfs_read(fd, hdr, plain, length - start, start,
+					 cipher);
+			if (res == length - start)
+				res = seal_run(fd, hdr, NULL, plain, fill,
+					       old, final, cipher);
+			else if (res >= 0)
+				res = -EIO;
+		}
+	}
+
+	// the last block is never a hole, a hole there would hide a file
+	// cut or grown on disk
+	if (res >= 0 && final >= gap) {
+		memset(plain, 0, ENCFS_BLOCK_SIZE);
+		res = seal_run(fd, hdr, NULL, plain,
+			       size - (off_t)final * ENCFS_BLOCK_SIZE,
+			       final, final, cipher);
+	}
+	// space preallocated past the old end could later be reported as
+	// data, the gap is made real holes first
+	if (res >= 0 && final > gap &&
+	    fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		      block_offset(hdr, gap),
+		      block_offset(hdr, final) - block_offset(hdr, gap)) == -1 &&
+	    errno != EOPNOTSUPP)
+		res = -errno;
+	if (res >= 0)
+		res = fill_gap(fd, hdr, gap, final, final, cipher);
+
+	free(plain);
+	return (res < 0) ? res : 0;
+}
+
+ssize_t encfs_write(int fd, const struct encfs_header* hdr,
+		    const char* buf, size_t size, off_t offset, ctr_cipher* cipher)
+{
+	char* plain;
+	struct stat st;
+	off_t length, start, end, new_length, pos;
+	ssize_t res;
+
+	if (fstat(fd, &st) == -1)
+		return -errno;
+	length = encfs_logical_size(hdr, st.st_size);
+
+	if (!block_sealed(hdr))
+		return -EROFS;
+
+	// a sealed file gets a hole up to a write past its end
+	if (offset > length && size > 0) {
+		res = sealed_grow(fd, hdr, length, offset, cipher);
+		if (res < 0)
+			return res;
+		length = offset;
+	}
+
+	// a write past the end also has to encrypt the zeros before it
+	start = (offset > length) ? length : offset;
+	end = offset + size;
+	if (end <= start)
+		return 0;
+	new_length = (end > length) ? end : length;
+
+	plain = malloc(ENCFS_CHUNK_BLOCKS * ENCFS_BLOCK_SIZE);
+	if (plain == NULL)
+		return -ENOMEM;
+
+	pos = start - (start % ENCFS_BLOCK_SIZE);
+	while (pos < end) {
+		off_t chunk_end = pos + ENCFS_CHUNK_BLOCKS * ENCFS_BLOCK_SIZE;
+		off_t from, to;
+
+		// stop at the last block touched, which may run past end
+		if (chunk_end > end)
+			chunk_end = end + (ENCFS_BLOCK_SIZE - 1)
+				    - ((end + ENCFS_BLOCK_SIZE - 1) % ENCFS_BLOCK_SIZE);
+		if (chunk_end > new_length)
+			chunk_end = new_length;
+
+		memset(plain, 0, chunk_end - pos);
+
+		// head block: keep the old bytes in front of start
+		if (pos < start && pos < length) {
+			res = encfs_read(fd, hdr, plain, start - pos, pos, cipher);
+			if (res < 0)
+				goto out;
+		}
+
+		// tail block: keep the old bytes behind end
+		if (end < chunk_end && end < length) {
+			res = encfs_read(fd, hdr, plain + (end - pos),
+					 chunk_end - end, end, cipher);
+			if (res < 0)
+				goto out;
+		}
+
+		from = (offset > pos) ? offset : pos;
+		to = (end < chunk_end) ? end : chunk_end;
+		if (to > from)
+			memcpy(plain + (from - pos), buf + (from - offset), to - from);
+
+		res = write_run(fd, hdr, plain, chunk_end - pos,
+				pos / ENCFS_BLOCK_SIZE, length, new_length, cipher);
+		if (res < 0)
+			goto out;
+
+		pos = chunk_end;
+	}
+
+	res = size;
+
+out:
+	free(plain);
+	return res;
+}
+
+int encfs_truncate(int fd, const struct encfs_header* hdr, off_t size,
+		   ctr_cipher* cipher)
+{
+	struct stat st;
+	off_t length, start, tail;
+	uint64_t block;
+	char* plain;
+	ssize_t res;
+
+	if (!block_sealed(hdr))
+		return -EROFS;
+	if (fstat(fd, &st) == -1)
+		return -errno;
+	length = encfs_logical_size(hdr, st.st_size);
+
+	if (size <= length) {
+		if (size == 0 || size == length) {
+			if (ftruncate(fd, encfs_backing_size(hdr, size)) == -1)
+				return -errno;
+			return 0;
+		}
+
+		// the new last block is sealed again as the last one, which
+		// also stores it if it was a hole
+		block = (size - 1) / ENCFS_BLOCK_SIZE;
+		start = (off_t)block * ENCFS_BLOCK_SIZE;
+		tail = size - start;
+		plain = malloc(ENCFS_BLOCK_SIZE);
+		if (plain == NULL)
+			return -ENOMEM;
+		res = encfs_read(fd, hdr, plain, tail, start, cipher);
+		if (res == tail) {
+			if (ftruncate(fd, encfs_backing_size(hdr, size)) == -1)
+				res = -errno;
+			else
+				res = seal_run(fd, hdr, NULL, plain, tail,
+					       block, block, cipher);
+		}
+		else if (res >= 0) {
+			res = -EIO;
+		}
+		free(plain);
+		return (res < 0) ? res : 0;
+	}
+
+	return sealed_grow(fd, hdr, length, size, cipher);
+}
+
+// seal len zeros over plaintext from offset, within the file
+static int write_zeros(int fd, const struct encfs_header* hdr, off_t offset,
+		       off_t len, ctr_cipher* cipher)
+{
+	char* zeros;
+	ssize_t res;
+
+	if (len <= 0)
+		return 0;
+	zeros = calloc(1, len);
+	if (zeros == NULL)
+		return -ENOMEM;
+	res = encfs_write(fd, hdr, zeros, len, offset, cipher);
+	free(zeros);
+	return (res < 0) ? res : 0;
+}
+
+// Reserve backing space for [from, to). Past the end of the file that
+// is fallocate(), holes inside it get sealed zeros stored: space a file
+// system preallocates there may later be reported as data, which a hole
+// must never be
+static int reserve(int fd, const struct encfs_header* hdr, off_t from,
+		   off_t to, ctr_cipher* cipher)
+{
+	size_t stride = block_stride(hdr);
+	uint64_t block, last, final;
+	struct stat st;
+	off_t hole, data, past;
+	ssize_t res;
+
+	if (fstat(fd, &st) == -1)
+		return -errno;
+	final = (encfs_logical_size(hdr, st.st_size) - 1) / ENCFS_BLOCK_SIZE;
+	if (to > st.st_size) {
+		past = (from > st.st_size) ? from : st.st_size;
+		if (fallocate(fd, FALLOC_FL_KEEP_SIZE, past, to - past) == -1)
+			return -errno;
+		to = st.st_size;
+	}
+
+	while (from < to) {
+		hole = lseek(fd, from, SEEK_HOLE);
+		if (hole == -1 || hole >= to)
+			break;
+		data = lseek(fd, hole, SEEK_DATA);
+		if (data == -1 || data > to)
+			data = to;
+
+		// every block reaching into [hole, data) is a hole
+		last = (data - 1 - ENCFS_HEADER_SIZE) / stride + 1;
+		for (block = (hole - ENCFS_HEADER_SIZE) / stride; block < last;
+		     block++) {
+			res = seal_run(fd, hdr, NULL, zero_block,
+				       ENCFS_BLOCK_SIZE, block, final, cipher);
+			if (res < 0)
+				return res;
+		}
+		from = block_offset(hdr, last);
+	}
+
+	return 0;
+}
+
+int encfs_fallocate(int fd, const struct encfs_header* hdr, int mode,
+		    off_t offset, off_t len, ctr_cipher* cipher)
+{
+	struct stat st;
+	off_t length, end, first, last, from, to;
+	int res;
+
+	if (offset < 0 || len <= 0)
+		return -EINVAL;
+	if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE))
+		return -EOPNOTSUPP;
+	if (!block_sealed(hdr))
+		return -EROFS;
+	if (fstat(fd, &st) == -1)
+		return -errno;
+	length = encfs_logical_size(hdr, st.st_size);
+	end = offset + len;
+
+	if (mode & FALLOC_FL_PUNCH_HOLE) {
+		if (!(mode & FALLOC_FL_KEEP_SIZE))
+			return -EINVAL;
+		if (end > length)
+			end = length;
+		if (offset >= end)
+			return 0;
+
+		// whole blocks in the range, but not the file's last block,
+		// which is never a hole
+		first = (offset + ENCFS_BLOCK_SIZE - 1) / ENCFS_BLOCK_SIZE;
+		last = end / ENCFS_BLOCK_SIZE;
+		if (last > (length - 1) / ENCFS_BLOCK_SIZE)
+			last = (length - 1) / ENCFS_BLOCK_SIZE;
+		if (first >= last)
+			return write_zeros(fd, hdr, offset, end - offset, cipher);
+
+		res = write_zeros(fd, hdr, offset,
+				  first * ENCFS_BLOCK_SIZE - offset, cipher);
+		if (res == 0)
+			res = write_zeros(fd, hdr, last * ENCFS_BLOCK_SIZE,
+					  end - last * ENCFS_BLOCK_SIZE, cipher);
+		if (res < 0)
+			return res;
+
+		// only backing file blocks wholly inside are freed, the
+		// blocks left without any freed part get zeros stored
+		from = block_offset(hdr, first);
+		to = block_offset(hdr, last);
+		if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			      from, to - from) == -1)
+			return -errno;
+		return fill_gap(fd, hdr, first, last,
+				(length - 1) / ENCFS_BLOCK_SIZE, cipher);
+	}
+
+	if (!(mode & FALLOC_FL_KEEP_SIZE) && end > length) {
+		res = encfs_truncate(fd, hdr, end, cipher);
+		if (res < 0)
+			return res;
+	}
+
+	// the file already has its size, only reserve the space
+	return reserve(fd, hdr, block_offset(hdr, offset / ENCFS_BLOCK_SIZE),
+		       encfs_backing_size(hdr, end), cipher);
+}
+
+// Copy len bytes of from at src to to at dst, front to back
+static int copy_range(int from, off_t src, int to, off_t dst, off_t len)
+{
+	char* chunk;
+	off_t pos;
+	ssize_t res = 0, done, n;
+
+	chunk = malloc(ENCFS_CHUNK_BLOCKS * ENCFS_BLOCK_SIZE);
+	if (chunk == NULL)
+		return -ENOMEM;
+
+	for (pos = 0; pos < len; pos += res) {
+		res = ENCFS_CHUNK_BLOCKS * ENCFS_BLOCK_SIZE;
+		if (res > len - pos)
+			res = len - pos;
+		res = pread(from, chunk, res, src + pos);
+		if (res <= 0) {
+			res = (res == -1) ? -errno : -EIO;
+			break;
+		}
+		// a short write is retried for the error that stopped it
+		for (done = 0; done < res; done += n) {
+			n = pwrite(to, chunk + done, res - done, dst + pos + done);
+			if (n <= 0)
+				break;
+		}
+		if (done < res) {
+			res = (n == -1) ? -errno : -EIO;
+			break;
+		}
+	}
+
+	free(chunk);
+	return (res < 0) ? res : 0;
+}
+
+int encfs_convert_begin(int fd, int sealed_fd)
+{
+	struct stat st, sealed;
+	char value[64];
+	off_t at;
+	int res;
+
+	if (fstat(fd, &st) == -1 || fstat(sealed_fd, &sealed) == -1)
+		return -errno;
+
+	// past both the old data and where the new ends up, so moving it
+	// to the front never overwrites what is still to be moved
+	at = (st.st_size > sealed.st_size) ? st.st_size : sealed.st_size;
+	at += ENCFS_BLOCK_SIZE - 1 - (at + ENCFS_BLOCK_SIZE - 1) % ENCFS_BLOCK_SIZE;
+
+	// the move then can not run out of space halfway
+	if (sealed.st_size > 0 &&
+	    fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, sealed.st_size) == -1 &&
+	    errno != EOPNOTSUPP)
+		return -errno;
+
+	res = copy_range(sealed_fd, 0, fd, at, sealed.st_size);
+	if (res == 0 && fsync(fd) == -1)
+		res = -errno;
+	if (res == 0) {
+		snprintf(value, sizeof(value), "%lld %lld", (long long)at,
+			 (long long)sealed.st_size);
+		if (fsetxattr(fd, ENCFS_CONVERT_ATTR, value, strlen(value), 0) == -1)
+			res = -errno;
+	}
+	if (res == 0 && fsync(fd) == -1)
+		res = -errno;
+
+	if (res < 0 && ftruncate(fd, st.st_size) == -1)
+		fprintf(stderr, "Could not drop a partial conversion\n");
+	return res;
+}
+
+int encfs_convert_finish(int fd)
+{
+	static pthread_mutex_t convert_lock = PTHREAD_MUTEX_INITIALIZER;
+	struct stat st;
+	char value[64];
+	long long at, length;
+	ssize_t len;
+	int res;
+
+	// a handle and a look at the same file may both find the attribute
+	pthread_mutex_lock(&convert_lock);
+	len = fgetxattr(fd, ENCFS_CONVERT_ATTR, value, sizeof(value) - 1);
+	if (len == -1) {
+		res = (errno == ENODATA) ? 0 : -errno;
+		goto out;
+	}
+	value[len] = '\0';
+	if (sscanf(value, "%lld %lld", &at, &length) != 2 || at < length) {
+		res = -EIO;
+		goto out;
+	}
+	if (fstat(fd, &st) == -1) {
+		res = -errno;
+		goto out;
+	}
+
+	// already cut to the new contents if the crash came after that
+	if (st.st_size >= at + length) {
+		res = copy_range(fd, at, fd, 0, length);
+		if (res == 0 && fsync(fd) == -1)
+			res = -errno;
+		if (res < 0)
+			goto out;
+		if (ftruncate(fd, length) == -1) {
+			res = -errno;
+			goto out;
+		}
+	}
+	else if (st.st_size != length) {
+		res = -EIO;
+		goto out;
+	}
+
+	res = 1;
+	if (fsync(fd) == -1 || fremovexattr(fd, ENCFS_CONVERT_ATTR) == -1)
+		res = -errno;
+
+out:
+	pthread_mutex_unlock(&convert_lock);
+	return res;
+}
@@ -0,0 +1,210 @@
+/* encfs-block.h
+ * Random-access on-disk format for encrypted pa5-encfs files
+ *
+ * By Shane Sarnac
+ *
+ * An encrypted backing file is a fixed-size header followed by the
+ * plaintext cut into ENCFS_BLOCK_SIZE blocks, each encrypted on its own:
+ *
+ *   [ header | block 0 | block 1 | ... | block n (may be short) ]
+ *
+ * The header's version says how:
+ *
+ * ENCFS_VERSION_GCM and ENCFS_VERSION_CHACHA (new files, depending on
+ * the key's backend, see aead_select()): each block is stored as
+ *   [ random nonce | AES-256-GCM or ChaCha20-Poly1305 ciphertext | tag ]
+ * with the header nonce (the file's id), the block index and whether it
+ * is the file's last block as associated data. A changed, swapped or
+ * moved block fails to verify and reads as -EIO, and so does the new
+ * last block of a file cut short on disk (a write that extends a file
+ * seals its old last block again as an inner one). Every write of a
+ * block draws a fresh nonce.
+ * Reads and writes of many blocks are spread over a small pool of
+ * worker threads.
+ *
+ * Growing a file by truncate or a write past its end stores the new
+ * last block and leaves the blocks before it as holes in the backing
+ * file instead of sealing zeros into them. A hole reads as zeros
+ * without being decrypted, but only if it is all zero bytes, is not the
+ * file's last block and is at least partly unallocated (lseek()
+ * SEEK_HOLE); a read that found one also verifies the last block. So a
+ * block zeroed on disk, or zeros appended to the file, fail to verify.
+ * A block between holes that the backing file system leaves no
+ * unallocated part of (it has no holes, or the blocks on either side
+ * share its file system blocks) gets sealed zeros stored instead.
+ *
+ * ENCFS_VERSION_CTR (files written before): blocks are AES-256-CTR with
+ * the counter for block i starting at the header nonce plus
+ * i * (ENCFS_BLOCK_SIZE / 16), and are exactly as long as the plaintext.
+ * There is no integrity check. These files are only read: writing a
+ * block again would reuse its keystream, so the functions that change a
+ * file return -EROFS for them and the caller converts the file first
+ * (encfs-handle.h).
+ *
+ * An old file is converted to sealed blocks without giving it another
+ * inode, which open handles and the inode based front end are tied to.
+ * The sealed copy is first stored behind the old data and synced, and
+ * ENCFS_CONVERT_ATTR records where it is; only then is it moved to the
+ * front. Whoever next finds the attribute, after a crash, moves it
+ * again, so the file is always either the old one or the new one.
+ *
+ * Functions taking a file descriptor return a non-negative value on
+ * success and -errno on failure, like the FUSE callbacks they serve.
+ * They take a ctr_cipher set up with ctr_cipher_init() so the key is not
+ * derived again for every block.
+ */
+
+#ifndef ENCFS_BLOCK_H
+#define ENCFS_BLOCK_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "aes-crypt.h"
+
+#define ENCFS_MAGIC "PA5ENCFS"
+#define ENCFS_MAGIC_SIZE 8
+#define ENCFS_VERSION_CTR 1
+#define ENCFS_VERSION_GCM 2
+#define ENCFS_VERSION_CHACHA 3
+#define ENCFS_BLOCK_SIZE 4096
+#define ENCFS_NONCE_SIZE 16
+#define ENCFS_HEADER_SIZE 32
+
+/* Attribute of a file whose conversion has not finished: "offset length"
+ * of its new contents */
+#define ENCFS_CONVERT_ATTR "user.encfs.convert"
+
+/* Bytes a sealed block takes on disk beyond its plaintext */
+#define ENCFS_AEAD_OVERHEAD (AEAD_IV_SIZE + AEAD_TAG_SIZE)
+
+/* Blocks moved through memory per pread/pwrite */
+#define ENCFS_CHUNK_BLOCKS 32
+
+/* Sealed reads and writes of at least this many blocks use the worker pool */
+#define ENCFS_POOL_MIN_BLOCKS 8
+/* Most worker threads, besides the caller */
+#define ENCFS_POOL_MAX 3
+
+struct encfs_header {
+	uint32_t version;
+	uint32_t block_size;
+	unsigned char nonce[ENCFS_NONCE_SIZE];
+};
+
+/* void encfs_block_setup(const crypt_key* key)
+ * Purpose: Set the key the worker pool encrypts with, and whose backend
+ *          new files are sealed with. The workers are started on first
+ *          use, so the process may still fork after this. Without it
+ *          every block is done by the calling thread and new files use
+ *          AES-256-GCM
+ */
+extern void encfs_block_setup(const crypt_key* key);
+
+/* int encfs_header_init(struct encfs_header* hdr)
+ * Purpose: Fill in a header for a new file with a fresh random nonce,
+ *          sealed with encfs_block_setup()'s key's backend
+ * Return: 0 on success, -EIO if no random bytes were available
+ */
+extern int encfs_header_init(struct encfs_header* hdr);
+
+/* int encfs_header_write(int fd, const struct encfs_header* hdr)
+ * Purpose: Store hdr at the start of fd
+ */
+extern int encfs_header_write(int fd, const struct encfs_header* hdr);
+
+/* int encfs_header_read(int fd, struct encfs_header* hdr)
+ * Purpose: Load the header at the start of fd
+ * Return: 0 on success, -EINVAL if fd does not start with a valid
+ *         header (e.g. a file encrypted with the old whole-file do_crypt)
+ */
+extern int encfs_header_read(int fd, struct encfs_header* hdr);
+
+/* off_t encfs_logical_size(const struct encfs_header* hdr,
+ *                           off_t backing_size)
+ * Purpose: Plaintext length of a block format file of backing_size bytes
+ */
+extern off_t encfs_logical_size(const struct encfs_header* hdr,
+				off_t backing_size);
+
+/* off_t encfs_backing_size(const struct encfs_header* hdr, off_t length)
+ * Purpose: Backing file size of a block format file of length plaintext
+ *          bytes
+ */
+extern off_t encfs_backing_size(const struct encfs_header* hdr, off_t length);
+
+/* ssize_t encfs_read(...)
+ * Purpose: Decrypt up to size plaintext bytes at offset into buf,
+ *          touching only the blocks that cover [offset, offset+size)
+ * Return: bytes read (0 past end of file) or -errno, -EIO if a block
+ *         fails to verify
+ */
+extern ssize_t encfs_read(int fd, const struct encfs_header* hdr, char* buf,
+			  size_t size, off_t offset, ctr_cipher* cipher);
+
+/* ssize_t encfs_write_blocks(...)
+ * Purpose: Encrypt len plaintext bytes and store them starting at the
+ *          beginning of block first_block. Only the last block written
+ *          may be short, and only when it becomes the end of the file.
+ *          The file grows to reach first_block first, and the old last
+ *          block is sealed again if the blocks extend the file
+ * Return: len or -errno
+ */
+extern ssize_t encfs_write_blocks(int fd, const struct encfs_header* hdr,
+				  const char* buf, size_t len,
+				  uint64_t first_block, ctr_cipher* cipher);
+
+/* ssize_t encfs_write(...)
+ * Purpose: Store size plaintext bytes from buf at offset. Only the
+ *          blocks under [offset, offset+size) are re-encrypted, and only
+ *          a partially covered first or last block is decrypted first.
+ *          Writing past the end of the file fills the gap with zeros
+ * Return: size or -errno
+ */
+extern ssize_t encfs_write(int fd, const struct encfs_header* hdr,
+			   const char* buf, size_t size, off_t offset,
+			   ctr_cipher* cipher);
+
+/* int encfs_truncate(int fd, const struct encfs_header* hdr, off_t size,
+ *                    ctr_cipher* cipher)
+ * Purpose: Set the plaintext length to size, growing with zeros. Only
+ *          the blocks the old and new end fall in are sealed again, the
+ *          ones between them are holes
+ */
+extern int encfs_truncate(int fd, const struct encfs_header* hdr, off_t size,
+			  ctr_cipher* cipher);
+
+/* int encfs_fallocate(int fd, const struct encfs_header* hdr, int mode,
+ *                     off_t offset, off_t len, ctr_cipher* cipher)
+ * Purpose: fallocate() on plaintext offsets. Mode 0 grows the file to
+ *          offset + len like encfs_truncate() and stores sealed zeros
+ *          in the holes under the range; FALLOC_FL_KEEP_SIZE only does
+ *          the latter, and preallocates what lies past the end.
+ *          FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE turns the whole
+ *          blocks in the range but the file's last into holes and seals
+ *          zeros over the partial ones at its ends
+ * Return: 0 or -errno, -EOPNOTSUPP for other modes
+ */
+extern int encfs_fallocate(int fd, const struct encfs_header* hdr, int mode,
+			   off_t offset, off_t len, ctr_cipher* cipher);
+
+/* int encfs_convert_begin(int fd, int sealed_fd)
+ * Purpose: Start replacing the old format file fd, open for writing,
+ *          with the block format file sealed_fd: reserve its space at
+ *          the front of fd, copy it behind fd's data, sync and set
+ *          ENCFS_CONVERT_ATTR. Until it is set, fd's contents are left
+ *          as they were
+ * Return: 0 or -errno (-ENOSPC before anything is overwritten)
+ */
+extern int encfs_convert_begin(int fd, int sealed_fd);
+
+/* int encfs_convert_finish(int fd)
+ * Purpose: Finish a conversion of fd, open for writing, that
+ *          encfs_convert_begin() started here or before a crash: move
+ *          the new contents to the front, cut the file to them, sync
+ *          and remove ENCFS_CONVERT_ATTR
+ * Return: 1 if there was one to finish, 0 if not, or -errno
+ */
+extern int encfs_convert_finish(int fd);
+
+#endif
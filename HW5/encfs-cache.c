@@ -0,0 +1,566 @@
+/* encfs-cache.c
+ * Per-open cache of decrypted blocks for pa5-encfs
+ *
+ * By Shane Sarnac
+ *
+ * See encfs-cache.h. Every cached block holds
+ * min(ENCFS_BLOCK_SIZE, length - start) valid bytes, so only the block
+ * at the end of the file is ever short, as encfs_write_blocks() wants.
+ *
+ * cache->lock only guards the block list against parallel
+ * encfs_cache_read_shared() calls; it is never held across I/O.
+ *
+ * The memory budget is reserved whole at encfs_cache_init() and given
+ * back at encfs_cache_cleanup(), so the block paths never wait on it.
+ */
+
+#define _XOPEN_SOURCE 500
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "encfs-cache.h"
+
+static struct {
+	pthread_mutex_t lock;
+	long free;		// blocks no cache has reserved
+} budget = { PTHREAD_MUTEX_INITIALIZER, ENCFS_CACHE_MEMORY / ENCFS_BLOCK_SIZE };
+
+// valid bytes of block when the file is length bytes long
+static size_t block_len(off_t length, uint64_t block)
+{
+	off_t start = (off_t)block * ENCFS_BLOCK_SIZE;
+
+	if (length <= start)
+		return 0;
+	if (length - start > ENCFS_BLOCK_SIZE)
+		return ENCFS_BLOCK_SIZE;
+	return length - start;
+}
+
+static void unlink_block(struct encfs_cache* cache, struct encfs_cached_block* b)
+{
+	if (b->prev)
+		b->prev->next = b->next;
+	else
+		cache->head = b->next;
+	if (b->next)
+		b->next->prev = b->prev;
+	else
+		cache->tail = b->prev;
+	b->prev = b->next = NULL;
+}
+
+static void push_front(struct encfs_cache* cache, struct encfs_cached_block* b)
+{
+	b->prev = NULL;
+	b->next = cache->head;
+	if (cache->head)
+		cache->head->prev = b;
+	else
+		cache->tail = b;
+	cache->head = b;
+}
+
+static struct encfs_cached_block* lookup(struct encfs_cache* cache,
+					 uint64_t block)
+{
+	struct encfs_cached_block* b;
+
+	for (b = cache->head; b; b = b->next) {
+		if (b->block == block) {
+			if (b != cache->head) {
+				unlink_block(cache, b);
+				push_front(cache, b);
+			}
+			return b;
+		}
+	}
+
+	return NULL;
+}
+
+// a free block for block, reusing the least recently used one when full
+static struct encfs_cached_block* take_block(struct encfs_cache* cache,
+					     uint64_t block, ctr_cipher* cipher,
+					     int* err)
+{
+	struct encfs_cached_block* b;
+
+	if (cache->count < cache->capacity) {
+		b = malloc(sizeof(*b));
+		if (b == NULL) {
+			*err = -ENOMEM;
+			return NULL;
+		}
+		cache->count++;
+	}
+	else {
+		// write back all dirty blocks at once rather than one per eviction
+		if (cache->tail->dirty) {
+			*err = encfs_cache_flush(cache, cipher);
+			if (*err < 0)
+				return NULL;
+		}
+		b = cache->tail;
+		unlink_block(cache, b);
+	}
+
+	b->block = block;
+	b->len = 0;
+	b->dirty = 0;
+	push_front(cache, b);
+	return b;
+}
+
+static int flush_dirty(struct encfs_cache* cache, ctr_cipher* cipher, int whole);
+
+// Cache block and up to run - 1 uncached blocks after it with one
+// decrypting read. Blocks past the end of the backing file read as zeros.
+static struct encfs_cached_block* load(struct encfs_cache* cache,
+				       uint64_t block, int run, ctr_cipher* cipher,
+				       int* err)
+{
+	struct encfs_cached_block* b = NULL;
+	off_t from = (off_t)block * ENCFS_BLOCK_SIZE;
+	size_t want;
+	ssize_t res;
+	int i, n;
+
+	for (n = 1; n < run && n < ENCFS_CHUNK_BLOCKS; n++) {
+		if (block_len(cache->length, block + n) == 0)
+			break;
+		for (b = cache->head; b; b = b->next)
+			if (b->block == block + n)
+				break;
+		if (b)
+			break;
+	}
+
+	// make room first, evicting dirty blocks flushes through chunk
+	if (cache->count + n > cache->capacity) {
+		*err = encfs_cache_flush(cache, cipher);
+		if (*err < 0)
+			return NULL;
+	}
+
+	want = 0;
+	for (i = 0; i < n; i++)
+		want += block_len(cache->length, block + i);
+
+	res = encfs_read(cache->fd, &cache->hdr, cache->chunk, want, from, cipher);
+	if (res < 0) {
+		*err = res;
+		return NULL;
+	}
+	memset(cache->chunk + res, 0, n * ENCFS_BLOCK_SIZE - res);
+
+	// insert back to front so block ends up most recently used
+	for (i = n - 1; i >= 0; i--) {
+		b = take_block(cache, block + i, cipher, err);
+		if (b == NULL)
+			return NULL;
+		b->len = block_len(cache->length, block + i);
+		memcpy(b->data, cache->chunk + (size_t)i * ENCFS_BLOCK_SIZE,
+		       ENCFS_BLOCK_SIZE);
+	}
+
+	return b;
+}
+
+void encfs_cache_set_memory(size_t bytes)
+{
+	pthread_mutex_lock(&budget.lock);
+	budget.free = bytes / ENCFS_BLOCK_SIZE;
+	pthread_mutex_unlock(&budget.lock);
+}
+
+int encfs_cache_init(struct encfs_cache* cache, int fd,
+		     const struct encfs_header* hdr, int capacity)
+{
+	struct stat st;
+
+	if (fstat(fd, &st) == -1)
+		return -errno;
+
+	cache->chunk = malloc(ENCFS_CHUNK_BLOCKS * ENCFS_BLOCK_SIZE);
+	if (cache->chunk == NULL)
+		return -ENOMEM;
+
+	// below ENCFS_CHUNK_BLOCKS load() and flushes have no room to work
+	pthread_mutex_lock(&budget.lock);
+	if (capacity > budget.free)
+		capacity = budget.free;
+	if (capacity < ENCFS_CHUNK_BLOCKS)
+		capacity = ENCFS_CHUNK_BLOCKS;
+	budget.free -= capacity;
+	pthread_mutex_unlock(&budget.lock);
+
+	cache->fd = fd;
+	cache->hdr = *hdr;
+	cache->length = encfs_logical_size(hdr, st.st_size);
+	cache->count = 0;
+	cache->capacity = capacity;
+	cache->dirty = 0;
+	cache->head = cache->tail = NULL;
+	pthread_mutex_init(&cache->lock, NULL);
+
+	return 0;
+}
+
+ssize_t encfs_cache_read(struct encfs_cache* cache, char* buf,
+			 size_t size, off_t offset, ctr_cipher* cipher)
+{
+	struct encfs_cached_block* b;
+	off_t end;
+	size_t done = 0;
+	int err = 0;
+
+	if (offset >= cache->length)
+		return 0;
+	if ((off_t)size > cache->length - offset)
+		size = cache->length - offset;
+	end = offset + size;
+
+	while (done < size) {
+		off_t pos = offset + done;
+		uint64_t block = pos / ENCFS_BLOCK_SIZE;
+		size_t skip = pos % ENCFS_BLOCK_SIZE;
+		size_t copy;
+
+		b = lookup(cache, block);
+		if (b == NULL) {
+			int run = (end - pos + skip + ENCFS_BLOCK_SIZE - 1)
+				  / ENCFS_BLOCK_SIZE;
+			b = load(cache, block, run, cipher, &err);
+			if (b == NULL)
+				return err;
+		}
+
+		copy = b->len - skip;
+		if (copy > size - done)
+			copy = size - done;
+		memcpy(buf + done, b->data + skip, copy);
+		done += copy;
+	}
+
+	return done;
+}
+
+// Keep the blocks a shared read decrypted into buf, those it covered
+// whole. Only clean blocks are ever dropped to make room, so nothing is
+// written. Caller holds cache->lock.
+static void keep_blocks(struct encfs_cache* cache, const char* buf,
+			size_t size, off_t offset)
+{
+	struct encfs_cached_block* b;
+	uint64_t block = (offset + ENCFS_BLOCK_SIZE - 1) / ENCFS_BLOCK_SIZE;
+	off_t end = offset + size;
+
+	for (;; block++) {
+		off_t start = (off_t)block * ENCFS_BLOCK_SIZE;
+		size_t len = block_len(cache->length, block);
+
+		if (len == 0 || start + (off_t)len > end)
+			break;
+		for (b = cache->head; b; b = b->next)
+			if (b->block == block)
+				break;
+		if (b)
+			continue;
+
+		if (cache->count < cache->capacity) {
+			b = malloc(sizeof(*b));
+			if (b == NULL)
+				break;
+			cache->count++;
+		}
+		else if (!cache->tail->dirty) {
+			b = cache->tail;
+			unlink_block(cache, b);
+		}
+		else {
+			break;
+		}
+
+		b->block = block;
+		b->len = len;
+		b->dirty = 0;
+		memcpy(b->data, buf + (start - offset), len);
+		memset(b->data + len, 0, ENCFS_BLOCK_SIZE - len);
+		push_front(cache, b);
+	}
+}
+
+ssize_t encfs_cache_read_shared(struct encfs_cache* cache, char* buf,
+				size_t size, off_t offset, ctr_cipher* cipher)
+{
+	struct encfs_cached_block* b;
+	uint64_t first, last, block;
+	int cached = 0;
+	ssize_t res;
+
+	if (offset >= cache->length)
+		return 0;
+	if ((off_t)size > cache->length - offset)
+		size = cache->length - offset;
+	first = offset / ENCFS_BLOCK_SIZE;
+	last = (offset + size - 1) / ENCFS_BLOCK_SIZE;
+
+	pthread_mutex_lock(&cache->lock);
+	for (b = cache->head; b; b = b->next) {
+		if (b->block < first || b->block > last)
+			continue;
+		// only the file has the rest of the range, and it is stale
+		if (b->dirty) {
+			pthread_mutex_unlock(&cache->lock);
+			return -EAGAIN;
+		}
+		cached++;
+	}
+	if (cached == (int)(last - first + 1)) {
+		// all there, copy out and mark the blocks used
+		for (block = first; block <= last; block++) {
+			off_t start = (off_t)block * ENCFS_BLOCK_SIZE;
+			off_t from = start > offset ? start : offset;
+			size_t copy;
+
+			b = lookup(cache, block);
+			copy = b->len - (from - start);
+			if ((off_t)copy > offset + (off_t)size - from)
+				copy = offset + size - from;
+			memcpy(buf + (from - offset), b->data + (from - start), copy);
+		}
+		pthread_mutex_unlock(&cache->lock);
+		return size;
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	// the file is up to date for this range, decrypt it without the lock
+	res = encfs_read(cache->fd, &cache->hdr, buf, size, offset, cipher);
+	if (res < 0)
+		return res;
+	// a hole before a block that was flushed further on reads as zeros
+	memset(buf + res, 0, size - res);
+
+	pthread_mutex_lock(&cache->lock);
+	keep_blocks(cache, buf, size, offset);
+	pthread_mutex_unlock(&cache->lock);
+
+	return size;
+}
+
+ssize_t encfs_cache_write(struct encfs_cache* cache, const char* buf,
+			  size_t size, off_t offset, ctr_cipher* cipher)
+{
+	struct encfs_cached_block* b;
+	off_t end = offset + size;
+	off_t old_length = cache->length;
+	size_t done = 0;
+	int err = 0;
+
+	if (size == 0)
+		return 0;
+
+	// the old last block grows with zeros up to the new length
+	if (end > old_length) {
+		cache->length = end;
+		b = lookup(cache, old_length / ENCFS_BLOCK_SIZE);
+		if (b)
+			b->len = block_len(end, b->block);
+	}
+
+	while (done < size) {
+		off_t pos = offset + done;
+		uint64_t block = pos / ENCFS_BLOCK_SIZE;
+		off_t start = (off_t)block * ENCFS_BLOCK_SIZE;
+		size_t skip = pos - start;
+		size_t copy = ENCFS_BLOCK_SIZE - skip;
+		size_t old = block_len(old_length, block);
+
+		if (copy > size - done)
+			copy = size - done;
+
+		b = lookup(cache, block);
+		if (b == NULL) {
+			// old bytes survive unless the write covers all of them
+			if (old > 0 && (skip > 0 || copy < old))
+				b = load(cache, block, 1, cipher, &err);
+			else if ((b = take_block(cache, block, cipher, &err)) != NULL)
+				memset(b->data, 0, ENCFS_BLOCK_SIZE);
+			if (b == NULL)
+				return err;
+			b->len = block_len(cache->length, block);
+		}
+
+		memcpy(b->data + skip, buf + done, copy);
+		if (!b->dirty) {
+			b->dirty = 1;
+			cache->dirty++;
+		}
+		done += copy;
+	}
+
+	// a streaming writer's full blocks go out a chunk at a time, the
+	// partial last block stays to take the next write. A failure is
+	// left for flush, the data is safe in the cache until then
+	if (cache->dirty >= ENCFS_WRITEBACK_BLOCKS)
+		flush_dirty(cache, cipher, 1);
+
+	return size;
+}
+
+static int compare_blocks(const void* a, const void* b)
+{
+	uint64_t x = (*(struct encfs_cached_block* const*)a)->block;
+	uint64_t y = (*(struct encfs_cached_block* const*)b)->block;
+
+	return (x > y) - (x < y);
+}
+
+// whether a flush takes b: any dirty block, or only whole ones
+static int write_back(const struct encfs_cached_block* b, int whole)
+{
+	return b->dirty && (!whole || b->len == ENCFS_BLOCK_SIZE);
+}
+
+// Encrypt and store dirty blocks, only the whole ones if whole is set
+static int flush_dirty(struct encfs_cache* cache, ctr_cipher* cipher, int whole)
+{
+	struct encfs_cached_block** dirty;
+	struct encfs_cached_block* b;
+	struct stat st;
+	off_t disk_length;
+	int count = 0;
+	int i, j, res = 0;
+
+	for (b = cache->head; b; b = b->next)
+		if (write_back(b, whole))
+			count++;
+	if (count == 0)
+		return 0;
+
+	dirty = malloc(count * sizeof(*dirty));
+	if (dirty == NULL)
+		return -ENOMEM;
+	count = 0;
+	for (b = cache->head; b; b = b->next)
+		if (write_back(b, whole))
+			dirty[count++] = b;
+	qsort(dirty, count, sizeof(*dirty), compare_blocks);
+
+	if (fstat(cache->fd, &st) == -1) {
+		res = -errno;
+		goto out;
+	}
+	disk_length = encfs_logical_size(&cache->hdr, st.st_size);
+
+	for (i = 0; i < count; i = j) {
+		off_t start = (off_t)dirty[i]->block * ENCFS_BLOCK_SIZE;
+		size_t len = 0;
+
+		// the file has to reach the run first, what it grows by is a hole
+		if (start > disk_length) {
+			res = encfs_truncate(cache->fd, &cache->hdr, start, cipher);
+			if (res < 0)
+				goto out;
+		}
+
+		for (j = i; j < count && j - i < ENCFS_CHUNK_BLOCKS
+			    && dirty[j]->block == dirty[i]->block + (j - i); j++) {
+			memcpy(cache->chunk + len, dirty[j]->data, dirty[j]->len);
+			len += dirty[j]->len;
+		}
+
+		res = encfs_write_blocks(cache->fd, &cache->hdr, cache->chunk,
+					 len, dirty[i]->block, cipher);
+		if (res < 0)
+			goto out;
+
+		for (; i < j; i++) {
+			dirty[i]->dirty = 0;
+			cache->dirty--;
+		}
+		if (start + (off_t)len > disk_length)
+			disk_length = start + len;
+	}
+	res = 0;
+
+out:
+	free(dirty);
+	return res;
+}
+
+int encfs_cache_flush(struct encfs_cache* cache, ctr_cipher* cipher)
+{
+	return flush_dirty(cache, cipher, 0);
+}
+
+// drop every block, all of them clean
+static void empty_cache(struct encfs_cache* cache)
+{
+	struct encfs_cached_block* b;
+
+	while ((b = cache->head) != NULL) {
+		unlink_block(cache, b);
+		free(b);
+	}
+	cache->count = 0;
+	cache->dirty = 0;
+}
+
+int encfs_cache_truncate(struct encfs_cache* cache, off_t size,
+			 ctr_cipher* cipher)
+{
+	int res;
+
+	res = encfs_cache_flush(cache, cipher);
+	if (res < 0)
+		return res;
+
+	res = encfs_truncate(cache->fd, &cache->hdr, size, cipher);
+	if (res < 0)
+		return res;
+
+	empty_cache(cache);
+	cache->length = size;
+
+	return 0;
+}
+
+int encfs_cache_fallocate(struct encfs_cache* cache, int mode, off_t offset,
+			  off_t len, ctr_cipher* cipher)
+{
+	struct stat st;
+	int res;
+
+	res = encfs_cache_flush(cache, cipher);
+	if (res < 0)
+		return res;
+
+	// cached blocks may have just become holes
+	res = encfs_fallocate(cache->fd, &cache->hdr, mode, offset, len, cipher);
+	empty_cache(cache);
+	if (fstat(cache->fd, &st) == -1)
+		return -errno;
+	cache->length = encfs_logical_size(&cache->hdr, st.st_size);
+
+	return res;
+}
+
+void encfs_cache_cleanup(struct encfs_cache* cache)
+{
+	empty_cache(cache);
+
+	pthread_mutex_lock(&budget.lock);
+	budget.free += cache->capacity;
+	pthread_mutex_unlock(&budget.lock);
+
+	free(cache->chunk);
+	cache->chunk = NULL;
+	pthread_mutex_destroy(&cache->lock);
+}
@@ -0,0 +1,134 @@
+/* encfs-cache.h
+ * Per-open cache of decrypted blocks for pa5-encfs
+ *
+ * By Shane Sarnac
+ *
+ * Keeps up to capacity plaintext blocks of one block format file (see
+ * encfs-block.h), dropping the least recently used block when full.
+ * Writes only patch cached blocks and mark them dirty, so small writes
+ * coalesce into whole blocks that are encrypted once. Dirty blocks
+ * reach the backing file, re-encrypted, when ENCFS_WRITEBACK_BLOCKS of
+ * them have filled up, when one of them would be evicted or on
+ * encfs_cache_flush(), which pa5-encfs calls from its flush, fsync and
+ * release callbacks.
+ *
+ * All caches together reserve at most encfs_cache_set_memory() bytes
+ * of blocks, except that every cache gets at least ENCFS_CHUNK_BLOCKS.
+ *
+ * The cipher context is passed on every call, so each thread can use its
+ * own. encfs_cache_read_shared() calls may run in parallel with each
+ * other; every other call needs the caller to exclude all other calls
+ * on the cache (pa5-encfs uses a read-write lock per handle).
+ */
+
+#ifndef ENCFS_CACHE_H
+#define ENCFS_CACHE_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "aes-crypt.h"
+#include "encfs-block.h"
+
+/* Blocks kept per open file */
+#define ENCFS_CACHE_BLOCKS 64
+/* Default memory for all caches' blocks together */
+#define ENCFS_CACHE_MEMORY (64 * 1024 * 1024)
+/* Whole dirty blocks written back while writes go on, one pwrite */
+#define ENCFS_WRITEBACK_BLOCKS ENCFS_CHUNK_BLOCKS
+
+struct encfs_cached_block {
+	uint64_t block;
+	size_t len;				// valid bytes, data is zero after them
+	int dirty;
+	struct encfs_cached_block* prev;	// LRU list, most recent first
+	struct encfs_cached_block* next;
+	char data[ENCFS_BLOCK_SIZE];
+};
+
+struct encfs_cache {
+	int fd;
+	struct encfs_header hdr;
+	off_t length;				// plaintext length, dirty blocks included
+	int count;
+	int capacity;				// reserved from the memory budget
+	int dirty;				// dirty blocks
+	struct encfs_cached_block* head;
+	struct encfs_cached_block* tail;
+	char* chunk;				// staging for multi-block reads and writes
+	pthread_mutex_t lock;			// the list, for shared readers
+};
+
+/* void encfs_cache_set_memory(size_t bytes)
+ * Purpose: Set the memory budget for all caches' blocks, before any
+ *          cache is set up (default ENCFS_CACHE_MEMORY)
+ */
+extern void encfs_cache_set_memory(size_t bytes);
+
+/* int encfs_cache_init(...)
+ * Purpose: Set up an empty cache over the open block format file fd
+ * Args: capacity : blocks to keep, cut to what is left of the memory
+ *                  budget but at least ENCFS_CHUNK_BLOCKS
+ * Return: 0 or -errno
+ */
+extern int encfs_cache_init(struct encfs_cache* cache, int fd,
+			    const struct encfs_header* hdr, int capacity);
+
+/* ssize_t encfs_cache_read(...)
+ * Purpose: Like encfs_read(), but served from cached blocks where it can.
+ *          Missing blocks are decrypted a run at a time and kept
+ * Return: bytes read (0 past end of file) or -errno
+ */
+extern ssize_t encfs_cache_read(struct encfs_cache* cache, char* buf,
+				size_t size, off_t offset, ctr_cipher* cipher);
+
+/* ssize_t encfs_cache_read_shared(...)
+ * Purpose: encfs_cache_read() that only reads the file, for callers
+ *          holding a shared lock. Uncached blocks are decrypted straight
+ *          into buf and the whole ones kept
+ * Return: bytes read (0 past end of file), -EAGAIN if the range has
+ *         unflushed writes (use encfs_cache_read() exclusively), or -errno
+ */
+extern ssize_t encfs_cache_read_shared(struct encfs_cache* cache, char* buf,
+				       size_t size, off_t offset,
+				       ctr_cipher* cipher);
+
+/* ssize_t encfs_cache_write(...)
+ * Purpose: Like encfs_write(), but into the cache. Only a partially
+ *          covered block that is not cached yet is read from the file.
+ *          Once ENCFS_WRITEBACK_BLOCKS blocks are dirty the whole ones
+ *          are written back; if that fails they stay dirty and the
+ *          next flush reports it
+ * Return: size or -errno
+ */
+extern ssize_t encfs_cache_write(struct encfs_cache* cache, const char* buf,
+				 size_t size, off_t offset, ctr_cipher* cipher);
+
+/* int encfs_cache_truncate(struct encfs_cache* cache, off_t size,
+ *                          ctr_cipher* cipher)
+ * Purpose: Flush, set the file's plaintext length to size and empty the cache
+ */
+extern int encfs_cache_truncate(struct encfs_cache* cache, off_t size,
+				ctr_cipher* cipher);
+
+/* int encfs_cache_fallocate(struct encfs_cache* cache, int mode,
+ *                           off_t offset, off_t len, ctr_cipher* cipher)
+ * Purpose: Flush, encfs_fallocate() the file and empty the cache
+ */
+extern int encfs_cache_fallocate(struct encfs_cache* cache, int mode,
+				 off_t offset, off_t len, ctr_cipher* cipher);
+
+/* int encfs_cache_flush(struct encfs_cache* cache, ctr_cipher* cipher)
+ * Purpose: Encrypt and store every dirty block, runs of neighbouring
+ *          blocks with one pwrite each. Blocks stay cached, clean
+ */
+extern int encfs_cache_flush(struct encfs_cache* cache, ctr_cipher* cipher);
+
+/* void encfs_cache_cleanup(struct encfs_cache* cache)
+ * Purpose: Free the cache and its share of the memory budget without
+ *          writing anything, flush first
+ */
+extern void encfs_cache_cleanup(struct encfs_cache* cache);
+
+#endif
@@ -0,0 +1,820 @@
+/* encfs-handle.c
+ * Open file state shared by the pa5-encfs front ends
+ *
+ * By Shane Sarnac
+ *
+ * See encfs-handle.h. Reads take a handle's lock shared, so several
+ * threads can decrypt from one file at once; anything that changes the
+ * file takes it alone. Every thread encrypts with its own cipher context.
+ */
+
+/* For fallocate() */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/xattr.h>
+
+#include "encfs-handle.h"
+
+#define DECRYPT 0
+
+static const crypt_key* handle_key;	// set once, before the mount starts
+
+static pthread_key_t cipher_key;
+static pthread_once_t cipher_key_once = PTHREAD_ONCE_INIT;
+
+void encfs_handle_setup(const crypt_key* key)
+{
+	handle_key = key;
+	encfs_block_setup(key);
+}
+
+static void free_thread_cipher(void* cipher)
+{
+	ctr_cipher_cleanup(cipher);
+	free(cipher);
+}
+
+static void make_cipher_key(void)
+{
+	pthread_key_create(&cipher_key, free_thread_cipher);
+}
+
+ctr_cipher* encfs_thread_cipher(void)
+{
+	ctr_cipher* cipher;
+
+	pthread_once(&cipher_key_once, make_cipher_key);
+	cipher = pthread_getspecific(cipher_key);
+	if (cipher != NULL)
+		return cipher;
+
+	cipher = malloc(sizeof(*cipher));
+	if (cipher == NULL)
+		return NULL;
+	if (!ctr_cipher_init(cipher, handle_key)) {
+		free(cipher);
+		return NULL;
+	}
+	if (pthread_setspecific(cipher_key, cipher) != 0) {
+		free_thread_cipher(cipher);
+		return NULL;
+	}
+	return cipher;
+}
+
+// Block files take their size from the metadata cache or the backing
+// size, legacy files from their last cipher block
+void encfs_plain_size(int dirfd, const char* path, struct stat* st)
+{
+	struct encfs_meta meta;
+	off_t length;
+	int fd;
+
+	if (encfs_meta_get(dirfd, path, -1, st, &meta, 0) < 0)
+		return;
+
+	if (meta.format == ENCFS_FORMAT_BLOCK) {
+		// the cached length includes writes still in open handles' caches
+		if (meta.length >= 0)
+			st->st_size = meta.length;
+		else
+			st->st_size = encfs_logical_size(&meta.hdr, st->st_size);
+	}
+	else if (meta.format == ENCFS_FORMAT_LEGACY) {
+		if (meta.length >= 0) {
+			st->st_size = meta.length;
+			return;
+		}
+		fd = openat(dirfd, path, O_RDONLY);
+		if (fd == -1)
+			return;
+		length = cbc_plain_size(fd, handle_key);
+		close(fd);
+		if (length >= 0) {
+			st->st_size = length;
+			encfs_meta_set_length(meta.dev, meta.ino, length, 0);
+		}
+	}
+}
+
+static int legacy_convert(int fd, const struct encfs_header* old,
+			  struct encfs_header* hdr, ctr_cipher* cipher);
+
+// CBC files and CTR block files are never changed in place
+static int needs_convert(const struct encfs_meta* meta)
+{
+	return meta->format == ENCFS_FORMAT_LEGACY
+	       || (meta->format == ENCFS_FORMAT_BLOCK
+		   && meta->hdr.version == ENCFS_VERSION_CTR);
+}
+
+int encfs_truncate_at(int dirfd, const char* path, off_t size)
+{
+	int res, fd;
+	struct stat st;
+	struct encfs_meta meta;
+	struct encfs_header old;
+	ctr_cipher* cipher;
+
+	if (fstatat(dirfd, path, &st, 0) == -1)
+		return -errno;
+	// held, so a background migration does not replace the file meanwhile
+	res = encfs_meta_get(dirfd, path, -1, &st, &meta, 1);
+	if (res < 0)
+		return res;
+
+	if (meta.format == ENCFS_FORMAT_BLOCK || meta.format == ENCFS_FORMAT_LEGACY) {
+		fd = openat(dirfd, path, O_RDWR);
+		if (fd == -1) {
+			res = -errno;
+			goto out;
+		}
+		cipher = encfs_thread_cipher();
+		res = cipher ? 0 : -EIO;
+		// cutting CBC ciphertext would lose its padding and growing CTR
+		// would reuse keystream, convert first
+		if (res == 0 && needs_convert(&meta)) {
+			old = meta.hdr;
+			res = legacy_convert(fd, meta.format == ENCFS_FORMAT_BLOCK
+					     ? &old : NULL, &meta.hdr, cipher);
+			if (res == 0)
+				encfs_meta_set_format(meta.dev, meta.ino,
+						      ENCFS_FORMAT_BLOCK, &meta.hdr);
+		}
+		if (res == 0)
+			res = encfs_truncate(fd, &meta.hdr, size, cipher);
+		close(fd);
+		// open handles' caches are flushed and dropped on their next call
+		if (res == 0)
+			encfs_meta_truncated(meta.dev, meta.ino, size);
+		goto out;
+	}
+
+	// there is no truncateat()
+	fd = openat(dirfd, path, O_WRONLY);
+	if (fd == -1) {
+		res = -errno;
+		goto out;
+	}
+	res = ftruncate(fd, size);
+	if (res == -1)
+		res = -errno;
+	close(fd);
+
+out:
+	encfs_meta_release(meta.dev, meta.ino);
+	return res;
+}
+
+// Start the block cache for a block format file
+static int handle_start_cache(struct encfs_handle* h, const struct encfs_header* hdr)
+{
+	int res;
+
+	res = encfs_cache_init(&h->cache, h->fd, hdr, ENCFS_CACHE_BLOCKS);
+	if (res < 0)
+		return res;
+
+	h->cached = 1;
+	return 0;
+}
+
+// Take the format, and for the block format a fresh cache, from meta
+static int handle_set_format(struct encfs_handle* h, const struct encfs_meta* meta)
+{
+	int res;
+
+	h->plain = h->legacy = 0;
+	if (meta->format == ENCFS_FORMAT_BLOCK) {
+		// the header comes from the metadata cache, not another pread
+		res = handle_start_cache(h, &meta->hdr);
+		if (res < 0)
+			return res;
+		// read through the cache, converted before the first change
+		h->legacy = needs_convert(meta);
+	}
+	else if (meta->format == ENCFS_FORMAT_LEGACY) {
+		h->legacy = 1;
+	}
+	else {
+		h->plain = 1;
+	}
+	h->gen = meta->gen;
+
+	return 0;
+}
+
+static void handle_free(struct encfs_handle* h)
+{
+	encfs_meta_release(h->dev, h->ino);
+	if (h->cached)
+		encfs_cache_cleanup(&h->cache);
+	pthread_rwlock_destroy(&h->lock);
+	free(h);
+}
+
+// Wrap an open backing fd in a handle. The handle takes over the hold
+// on meta's entry, even on failure.
+static int handle_new(int fd, const struct encfs_meta* meta,
+		      struct encfs_handle** hp)
+{
+	struct encfs_handle* h;
+	int res;
+
+	h = calloc(1, sizeof(*h));
+	if (h == NULL) {
+		encfs_meta_release(meta->dev, meta->ino);
+		return -ENOMEM;
+	}
+	h->fd = fd;
+	h->dev = meta->dev;
+	h->ino = meta->ino;
+	pthread_rwlock_init(&h->lock, NULL);
+
+	res = handle_set_format(h, meta);
+	if (res < 0) {
+		handle_free(h);
+		return res;
+	}
+	// changes since meta was copied are caught on the first call
+	h->seen = 0;
+
+	*hp = h;
+	return 0;
+}
+
+int encfs_handle_open(int dirfd, const char* path, int flags,
+		      struct encfs_handle** hp)
+{
+	int fd, res, open_flags, tries;
+	struct stat st, opened;
+	struct encfs_meta meta;
+
+	for (tries = 0; ; tries++) {
+		if (fstatat(dirfd, path, &st, 0) == -1)
+			return -errno;
+		res = encfs_meta_get(dirfd, path, -1, &st, &meta, 1);
+		if (res == -ESTALE && tries == 0)
+			continue;
+		if (res < 0)
+			return res;
+
+		open_flags = flags;
+		if (meta.format != ENCFS_FORMAT_PLAIN) {
+			// writing a block means decrypting its old bytes first, and
+			// offsets are plaintext offsets, never the backing file's end
+			open_flags &= ~(O_APPEND | O_TRUNC);
+			if ((open_flags & O_ACCMODE) == O_WRONLY)
+				open_flags = (open_flags & ~O_ACCMODE) | O_RDWR;
+		}
+
+		fd = openat(dirfd, path, open_flags);
+		if (fd == -1) {
+			res = -errno;
+			encfs_meta_release(meta.dev, meta.ino);
+			return res;
+		}
+		if (fstat(fd, &opened) == -1) {
+			res = -errno;
+			close(fd);
+			encfs_meta_release(meta.dev, meta.ino);
+			return res;
+		}
+		if (opened.st_dev == st.st_dev && opened.st_ino == st.st_ino
+		    && opened.st_nlink > 0)
+			break;
+
+		// the name was given another inode (encfs-migrate.h, or a
+		// rename over it) after we looked, look again. A low-level
+		// node still reaches the old one, the kernel has to look the
+		// name up again
+		close(fd);
+		encfs_meta_release(meta.dev, meta.ino);
+		encfs_meta_invalidate(st.st_dev, st.st_ino);
+		if (tries > 0)
+			return -ESTALE;
+	}
+
+	res = handle_new(fd, &meta, hp);
+	if (res < 0)
+		close(fd);
+	return res;
+}
+
+int encfs_handle_create(int fd, struct encfs_handle** hp)
+{
+	int res;
+	struct stat st;
+	struct encfs_header hdr;
+	struct encfs_meta meta;
+
+	// An empty encrypted file is just the block format header
+	if (encfs_header_init(&hdr) == 0 && encfs_header_write(fd, &hdr) == 0) {
+		if (fsetxattr(fd, "user.encfs", "true", 5*sizeof(char), 0) == -1) {
+			fprintf(stderr, "Failed to set encryption attribute\n");
+		}
+	}
+	else {
+		fprintf(stderr, "Failed to encrypt file\n");
+	}
+
+	// an existing file may have been truncated and given a new header
+	if (fstat(fd, &st) == -1) {
+		res = -errno;
+		close(fd);
+		return res;
+	}
+	encfs_meta_invalidate(st.st_dev, st.st_ino);
+	res = encfs_meta_get(AT_FDCWD, NULL, fd, &st, &meta, 1);
+	// a migration may have replaced the file we truncated while we
+	// waited for the hold, the kernel retries on ESTALE
+	if (res == 0 && (fstat(fd, &st) == -1 || st.st_nlink == 0)) {
+		encfs_meta_release(meta.dev, meta.ino);
+		res = -ESTALE;
+	}
+	if (res == 0)
+		res = handle_new(fd, &meta, hp);
+	if (res < 0)
+		close(fd);
+
+	return res;
+}
+
+// Decrypt all of an old whole-file CBC format file into a temp file
+static FILE* legacy_decrypt(int fd, int* err)
+{
+	struct stat st;
+	FILE* temp_file;
+	unsigned char* buf;
+
+	temp_file = tmpfile();
+	buf = crypt_buf_alloc(STREAM_CHUNK);
+	if (temp_file == NULL || buf == NULL) {
+		*err = -ENOMEM;
+		goto fail;
+	}
+
+	// an empty old-format file has nothing to decrypt
+	if (fstat(fd, &st) == 0 && st.st_size > 0
+	    && !crypt_fd(fd, fileno(temp_file), DECRYPT, handle_key, buf, STREAM_CHUNK)) {
+		fprintf(stderr, "Could not decrypt file\n");
+		*err = -EIO;
+		goto fail;
+	}
+
+	free(buf);
+	return temp_file;
+
+fail:
+	free(buf);
+	if (temp_file)
+		fclose(temp_file);
+	return NULL;
+}
+
+// Decrypt all of a CTR block format file into a temp file
+static FILE* ctr_decrypt(int fd, const struct encfs_header* hdr,
+			 ctr_cipher* cipher, int* err)
+{
+	FILE* temp_file;
+	char* chunk;
+	off_t pos = 0;
+	ssize_t res;
+
+	temp_file = tmpfile();
+	chunk = malloc(ENCFS_CHUNK_BLOCKS * ENCFS_BLOCK_SIZE);
+	if (temp_file == NULL || chunk == NULL) {
+		*err = -ENOMEM;
+		goto fail;
+	}
+
+	while ((res = encfs_read(fd, hdr, chunk, ENCFS_CHUNK_BLOCKS * ENCFS_BLOCK_SIZE,
+				 pos, cipher)) > 0) {
+		if (pwrite(fileno(temp_file), chunk, res, pos) != res) {
+			*err = -EIO;
+			goto fail;
+		}
+		pos += res;
+	}
+	if (res < 0) {
+		*err = res;
+		goto fail;
+	}
+
+	free(chunk);
+	return temp_file;
+
+fail:
+	free(chunk);
+	if (temp_file)
+		fclose(temp_file);
+	return NULL;
+}
+
+// Read from a file still in the old whole-file CBC format
+static int legacy_read(int fd, char *buf, size_t size, off_t offset)
+{
+	FILE* temp_file;
+	int res = 0;
+
+	temp_file = legacy_decrypt(fd, &res);
+	if (temp_file == NULL)
+		return res;
+
+	res = pread(fileno(temp_file), buf, size, offset);
+	if (res == -1)
+		res = -errno;
+
+	fclose(temp_file);
+	return res;
+}
+
+// Rewrite an old format file, CBC or the CTR blocks under old, as a
+// sealed block file with the fresh header hdr. The sealed file is built
+// aside and only then moved in (see encfs_convert_begin()), so a crash
+// or a full disk leaves the old file whole
+static int legacy_convert(int fd, const struct encfs_header* old,
+			  struct encfs_header* hdr, ctr_cipher* cipher)
+{
+	struct stat st;
+	FILE* temp_file;
+	FILE* sealed_file;
+	char* chunk;
+	off_t pos, length;
+	int temp_fd, sealed_fd, res = 0;
+
+	// one that got as far as the move before is finished, not redone
+	res = encfs_convert_finish(fd);
+	if (res != 0)
+		return (res < 0) ? res : encfs_header_read(fd, hdr);
+
+	chunk = malloc(ENCFS_CHUNK_BLOCKS * ENCFS_BLOCK_SIZE);
+	sealed_file = tmpfile();
+	if (chunk == NULL || sealed_file == NULL) {
+		free(chunk);
+		if (sealed_file)
+			fclose(sealed_file);
+		return -ENOMEM;
+	}
+	sealed_fd = fileno(sealed_file);
+	if (old)
+		temp_file = ctr_decrypt(fd, old, cipher, &res);
+	else
+		temp_file = legacy_decrypt(fd, &res);
+	if (temp_file == NULL)
+		goto out;
+	temp_fd = fileno(temp_file);
+
+	if (fstat(temp_fd, &st) == -1) {
+		res = -errno;
+		goto out;
+	}
+	length = st.st_size;
+
+	res = encfs_header_init(hdr);
+	if (res < 0)
+		goto out;
+
+	res = encfs_header_write(sealed_fd, hdr);
+	if (res < 0)
+		goto out;
+
+	for (pos = 0; pos < length; pos += res) {
+		res = pread(temp_fd, chunk, ENCFS_CHUNK_BLOCKS * ENCFS_BLOCK_SIZE, pos);
+		if (res <= 0) {
+			res = -EIO;
+			goto out;
+		}
+		res = encfs_write_blocks(sealed_fd, hdr, chunk, res,
+					 pos / ENCFS_BLOCK_SIZE, cipher);
+		if (res < 0)
+			goto out;
+	}
+
+	res = encfs_convert_begin(fd, sealed_fd);
+	if (res == 0)
+		res = encfs_convert_finish(fd);
+	if (res > 0)
+		res = 0;
+
+out:
+	free(chunk);
+	if (temp_file)
+		fclose(temp_file);
+	fclose(sealed_file);
+	return res;
+}
+
+// Whether any file changed in a way open handles have to catch up with
+// since h last checked
+static int handle_stale(struct encfs_handle* h)
+{
+	return !h->plain && __atomic_load_n(&h->seen, __ATOMIC_ACQUIRE)
+			    != encfs_meta_changes();
+}
+
+// Catch up with a conversion, truncate or new attribute that another
+// handle or a truncate by path gave h's file: write back what h has
+// cached, then take the format and a new cache from the metadata cache
+// again. Caller holds the lock exclusively
+static int handle_refresh(struct encfs_handle* h, ctr_cipher* cipher)
+{
+	unsigned long changes = encfs_meta_changes();
+	struct encfs_meta meta;
+	struct stat st;
+	int res;
+
+	if (!handle_stale(h))
+		return 0;
+	if (fstat(h->fd, &st) == -1)
+		return -errno;
+	res = encfs_meta_get(AT_FDCWD, NULL, h->fd, &st, &meta, 0);
+	if (res < 0)
+		return res;
+
+	if (meta.gen != h->gen) {
+		// flush only writes at offsets, what it writes is still ours
+		if (h->cached) {
+			res = encfs_cache_flush(&h->cache, cipher);
+			if (res < 0)
+				return res;
+			encfs_cache_cleanup(&h->cache);
+			h->cached = 0;
+		}
+		res = handle_set_format(h, &meta);
+		if (res < 0)
+			return res;
+	}
+	__atomic_store_n(&h->seen, changes, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+// handle_refresh() before a call that takes the lock shared
+static int handle_catch_up(struct encfs_handle* h)
+{
+	ctr_cipher* cipher;
+	int res;
+
+	if (!handle_stale(h))
+		return 0;
+	cipher = encfs_thread_cipher();
+	if (cipher == NULL)
+		return -EIO;
+
+	pthread_rwlock_wrlock(&h->lock);
+	res = handle_refresh(h, cipher);
+	pthread_rwlock_unlock(&h->lock);
+
+	return res;
+}
+
+// Adopt the generation h's own change gave the entry, unless another
+// change came in between, which h still has to catch up with
+static void handle_changed(struct encfs_handle* h, unsigned long gen)
+{
+	if (gen == h->gen + 1)
+		h->gen = gen;
+}
+
+// Convert a handle's old format file before its first change, caller
+// holds the lock exclusively. A CTR file's cache was only ever read, so
+// there is nothing in it to flush
+static int handle_convert(struct encfs_handle* h, ctr_cipher* cipher)
+{
+	struct encfs_header hdr;
+	int res;
+
+	res = legacy_convert(h->fd, h->cached ? &h->cache.hdr : NULL, &hdr, cipher);
+	if (res == 0) {
+		handle_changed(h, encfs_meta_set_format(h->dev, h->ino,
+							ENCFS_FORMAT_BLOCK, &hdr));
+		if (h->cached) {
+			encfs_cache_cleanup(&h->cache);
+			h->cached = 0;
+		}
+		res = handle_start_cache(h, &hdr);
+	}
+	if (res == 0)
+		h->legacy = 0;
+
+	return res;
+}
+
+int encfs_handle_read(struct encfs_handle* h, char* buf, size_t size,
+		      off_t offset)
+{
+	ctr_cipher* cipher = encfs_thread_cipher();
+	int res;
+
+	if (cipher == NULL)
+		return -EIO;
+
+retry:
+	res = handle_catch_up(h);
+	if (res < 0)
+		return res;
+
+	pthread_rwlock_rdlock(&h->lock);
+	if (h->cached) {
+		// Block format: repeated and sequential reads are served from
+		// blocks this handle already decrypted, others decrypt in
+		// parallel
+		res = encfs_cache_read_shared(&h->cache, buf, size, offset, cipher);
+	}
+	else if (h->legacy) {
+		res = legacy_read(h->fd, buf, size, offset);
+	}
+	else {
+		res = pread(h->fd, buf, size, offset);
+		if (res == -1)
+			res = -errno;
+	}
+	pthread_rwlock_unlock(&h->lock);
+
+	if (res == -EAGAIN) {
+		// unflushed writes in range, only a writer may load them
+		pthread_rwlock_wrlock(&h->lock);
+		if (h->cached)
+			res = encfs_cache_read(&h->cache, buf, size, offset, cipher);
+		pthread_rwlock_unlock(&h->lock);
+		// a refresh took the cache meanwhile, read again
+		if (res == -EAGAIN)
+			goto retry;
+	}
+
+	return res;
+}
+
+int encfs_handle_write(struct encfs_handle* h, const char* buf, size_t size,
+		       off_t offset)
+{
+	ctr_cipher* cipher = encfs_thread_cipher();
+	int res = 0;
+
+	if (cipher == NULL)
+		return -EIO;
+
+	pthread_rwlock_wrlock(&h->lock);
+	res = handle_refresh(h, cipher);
+	if (res == 0 && h->legacy)
+		res = handle_convert(h, cipher);
+
+	if (res < 0) {
+		// catching up or conversion failed, nothing written
+	}
+	else if (h->cached) {
+		// only lands in the cache, dirty blocks go out on flush
+		res = encfs_cache_write(&h->cache, buf, size, offset, cipher);
+		if (res > 0)
+			encfs_meta_set_length(h->dev, h->ino, h->cache.length, 1);
+	}
+	else {
+		res = pwrite(h->fd, buf, size, offset);
+		if (res == -1)
+			res = -errno;
+	}
+	pthread_rwlock_unlock(&h->lock);
+
+	return res;
+}
+
+int encfs_handle_flush(struct encfs_handle* h)
+{
+	ctr_cipher* cipher = encfs_thread_cipher();
+	int res = 0;
+
+	if (cipher == NULL)
+		return -EIO;
+
+	pthread_rwlock_wrlock(&h->lock);
+	if (h->cached)
+		res = encfs_cache_flush(&h->cache, cipher);
+	pthread_rwlock_unlock(&h->lock);
+
+	return res;
+}
+
+int encfs_handle_fsync(struct encfs_handle* h, int datasync)
+{
+	int res;
+
+	res = encfs_handle_flush(h);
+	if (res < 0)
+		return res;
+
+	// h->fd never changes, and syncing needs no lock against writers
+	res = datasync ? fdatasync(h->fd) : fsync(h->fd);
+	if (res == -1)
+		return -errno;
+
+	return 0;
+}
+
+int encfs_handle_truncate(struct encfs_handle* h, off_t size)
+{
+	ctr_cipher* cipher = encfs_thread_cipher();
+	int res = 0;
+
+	if (cipher == NULL)
+		return -EIO;
+
+	pthread_rwlock_wrlock(&h->lock);
+	res = handle_refresh(h, cipher);
+	if (res == 0 && h->legacy)
+		res = handle_convert(h, cipher);
+
+	if (res < 0) {
+		// catching up or conversion failed, nothing cut
+	}
+	else if (h->cached) {
+		res = encfs_cache_truncate(&h->cache, size, cipher);
+		if (res == 0)
+			handle_changed(h, encfs_meta_truncated(h->dev, h->ino, size));
+	}
+	else {
+		res = ftruncate(h->fd, size);
+		if (res == -1)
+			res = -errno;
+	}
+	pthread_rwlock_unlock(&h->lock);
+
+	return res;
+}
+
+int encfs_handle_fallocate(struct encfs_handle* h, int mode, off_t offset,
+			   off_t len)
+{
+	ctr_cipher* cipher = encfs_thread_cipher();
+	int res = 0;
+
+	if (cipher == NULL)
+		return -EIO;
+
+	pthread_rwlock_wrlock(&h->lock);
+	res = handle_refresh(h, cipher);
+	if (res == 0 && h->legacy)
+		res = handle_convert(h, cipher);
+
+	if (res < 0) {
+		// catching up or conversion failed, nothing allocated
+	}
+	else if (h->cached) {
+		res = encfs_cache_fallocate(&h->cache, mode, offset, len, cipher);
+		handle_changed(h, encfs_meta_truncated(h->dev, h->ino,
+						       h->cache.length));
+	}
+	else {
+		res = fallocate(h->fd, mode, offset, len);
+		if (res == -1)
+			res = -errno;
+	}
+	pthread_rwlock_unlock(&h->lock);
+
+	return res;
+}
+
+int encfs_handle_getattr(struct encfs_handle* h, struct stat* st)
+{
+	int res;
+
+	res = handle_catch_up(h);
+	if (res < 0)
+		return res;
+
+	pthread_rwlock_rdlock(&h->lock);
+	if (fstat(h->fd, st) == -1) {
+		res = -errno;
+	}
+	else if (h->cached) {
+		st->st_size = h->cache.length;
+	}
+	else if (h->legacy) {
+		st->st_size = cbc_plain_size(h->fd, handle_key);
+		if (st->st_size < 0)
+			res = -EIO;
+	}
+	pthread_rwlock_unlock(&h->lock);
+
+	return res;
+}
+
+void encfs_handle_release(struct encfs_handle* h)
+{
+	ctr_cipher* cipher = encfs_thread_cipher();
+	int res = 0;
+
+	if (h->cached)
+		res = cipher ? encfs_cache_flush(&h->cache, cipher) : -EIO;
+	if (res < 0)
+		fprintf(stderr, "Lost cached writes on release: %s\n", strerror(-res));
+
+	close(h->fd);
+	handle_free(h);
+}
@@ -0,0 +1,144 @@
+/* encfs-handle.h
+ * Open file state shared by the pa5-encfs front ends
+ *
+ * By Shane Sarnac
+ *
+ * An encfs_handle is one open backing file: the fd, its format and, for
+ * block format files, the cache of decrypted blocks (encfs-cache.h).
+ * Files still in the old whole-file CBC format or in CTR blocks are
+ * converted to the sealed block format on their first change. Both the path based front end
+ * (pa5-encfs.c) and the inode based one (encfs-ll.c) open files through
+ * here, and hand the handle back on every later call.
+ *
+ * Functions that look a file up take it as dirfd and path, as for the
+ * *at() calls; path may also be absolute or /proc/self/fd/N, with
+ * dirfd AT_FDCWD.
+ *
+ * A handle may be used from several threads at once. Several handles
+ * may be open on one file; when one of them, or a truncate by path,
+ * converts or truncates it, the others flush their writes and drop
+ * their cache and format on their next call (see encfs-meta.h).
+ */
+
+#ifndef ENCFS_HANDLE_H
+#define ENCFS_HANDLE_H
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "aes-crypt.h"
+#include "encfs-cache.h"
+#include "encfs-meta.h"
+
+struct encfs_handle {
+	int fd;
+	dev_t dev;		// backing inode, holds its encfs-meta entry
+	ino_t ino;
+	int plain;		// not encrypted, never changes for an open file
+	int legacy;		// CBC or CTR, converted before the first change
+	int cached;		// block format, reads and writes go through cache
+	unsigned long gen;	// encfs-meta generation the state above is from
+	unsigned long seen;	// encfs_meta_changes() when it was last checked
+	struct encfs_cache cache;
+	pthread_rwlock_t lock;	// shared for reads, exclusive for changes
+};
+
+/* void encfs_handle_setup(const crypt_key* key)
+ * Purpose: Set the key every handle encrypts with, before any other call
+ */
+extern void encfs_handle_setup(const crypt_key* key);
+
+/* ctr_cipher* encfs_thread_cipher(void)
+ * Purpose: The calling thread's copy of the key's cipher context, made
+ *          on its first use and freed when the thread exits
+ * Return: The context, NULL on failure
+ */
+extern ctr_cipher* encfs_thread_cipher(void);
+
+/* void encfs_plain_size(int dirfd, const char* path, struct stat* st)
+ * Purpose: Replace st_size of the regular file st describes with its
+ *          plaintext length, without decrypting it. Leaves the backing
+ *          size if the file can not be read
+ */
+extern void encfs_plain_size(int dirfd, const char* path, struct stat* st);
+
+/* int encfs_truncate_at(int dirfd, const char* path, off_t size)
+ * Purpose: Set the plaintext length of a file that may not be open
+ * Return: 0 or -errno
+ */
+extern int encfs_truncate_at(int dirfd, const char* path, off_t size);
+
+/* int encfs_handle_open(int dirfd, const char* path, int flags,
+ *                       struct encfs_handle** hp)
+ * Purpose: Open an existing file with open(2) flags, adjusted as its
+ *          format needs, and return a handle for it in *hp
+ * Return: 0 or -errno
+ */
+extern int encfs_handle_open(int dirfd, const char* path, int flags,
+			     struct encfs_handle** hp);
+
+/* int encfs_handle_create(int fd, struct encfs_handle** hp)
+ * Purpose: Make the file just opened as fd with O_CREAT | O_TRUNC |
+ *          O_RDWR an empty encrypted file, and return a handle for it.
+ *          fd belongs to the handle, or is closed on failure
+ * Return: 0 or -errno
+ */
+extern int encfs_handle_create(int fd, struct encfs_handle** hp);
+
+/* int encfs_handle_read(struct encfs_handle* h, char* buf, size_t size,
+ *                       off_t offset)
+ * Return: bytes read or -errno
+ */
+extern int encfs_handle_read(struct encfs_handle* h, char* buf, size_t size,
+			     off_t offset);
+
+/* int encfs_handle_write(struct encfs_handle* h, const char* buf,
+ *                        size_t size, off_t offset)
+ * Purpose: Write at a plaintext offset. Encrypted data only reaches the
+ *          backing file on encfs_handle_flush()
+ * Return: bytes written or -errno
+ */
+extern int encfs_handle_write(struct encfs_handle* h, const char* buf,
+			      size_t size, off_t offset);
+
+/* int encfs_handle_flush(struct encfs_handle* h)
+ * Purpose: Write back cached changes
+ * Return: 0 or -errno
+ */
+extern int encfs_handle_flush(struct encfs_handle* h);
+
+/* int encfs_handle_fsync(struct encfs_handle* h, int datasync)
+ * Purpose: Write back cached changes, then fsync() the backing file, or
+ *          fdatasync() it if datasync is set
+ * Return: 0 or -errno
+ */
+extern int encfs_handle_fsync(struct encfs_handle* h, int datasync);
+
+/* int encfs_handle_truncate(struct encfs_handle* h, off_t size)
+ * Return: 0 or -errno
+ */
+extern int encfs_handle_truncate(struct encfs_handle* h, off_t size);
+
+/* int encfs_handle_fallocate(struct encfs_handle* h, int mode,
+ *                            off_t offset, off_t len)
+ * Purpose: fallocate() on the file, at plaintext offsets for encrypted
+ *          files (see encfs_fallocate())
+ * Return: 0 or -errno
+ */
+extern int encfs_handle_fallocate(struct encfs_handle* h, int mode,
+				  off_t offset, off_t len);
+
+/* int encfs_handle_getattr(struct encfs_handle* h, struct stat* st)
+ * Purpose: fstat() the file, with its plaintext size
+ * Return: 0 or -errno
+ */
+extern int encfs_handle_getattr(struct encfs_handle* h, struct stat* st);
+
+/* void encfs_handle_release(struct encfs_handle* h)
+ * Purpose: Flush, close and free the handle. Lost writes are reported
+ *          on stderr, there is nobody left to return them to
+ */
+extern void encfs_handle_release(struct encfs_handle* h);
+
+#endif
@@ -0,0 +1,1234 @@
+/* encfs-ll.c
+ * Inode based front end for pa5-encfs, on the FUSE low-level API
+ *
+ * By Shane Sarnac
+ *
+ * See encfs-ll.h. The inode table maps the (dev, ino) of every backing
+ * file the kernel has looked up to one struct ll_inode, whose address is
+ * the fuse_ino_t handed to the kernel; the mirror directory itself is
+ * FUSE_ROOT_ID. A node lives until the kernel forgets every lookup of
+ * it, and a directory until no node is reached through it either. Calls
+ * with no *at() or fd form (open, xattrs, link) reach the backing file
+ * through /proc/self/fd/N of the node's O_PATH fd.
+ */
+
+#define _GNU_SOURCE
+#define FUSE_USE_VERSION 28
+
+#include <fuse_lowlevel.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/statvfs.h>
+#include <sys/xattr.h>
+
+#include "encfs-handle.h"
+#include "encfs-ll.h"
+#include "encfs-meta.h"
+#include "encfs-migrate.h"
+
+#define LL_BUCKETS 4096
+#define PROC_PATH_MAX 64
+
+// same one second the path based mount gets from attr_timeout and
+// entry_timeout, which the low-level API does not take as options
+#define LL_TIMEOUT 1.0
+
+// Directories keep their fd for the node's life, they are the parents of
+// every *at() call. Other files keep theirs while among the fd_budget most
+// recently used; past that it is closed, and opened again from the name
+// the file was last looked up by when a call needs it.
+struct ll_inode {
+	int fd;			// O_PATH, never read or written through; -1
+				// while closed
+	dev_t dev;
+	ino_t ino;
+	mode_t type;		// S_IFMT bits, fixed for the inode's life
+	uint64_t nlookup;	// lookups the kernel has not forgotten
+	struct timespec mtime;	// at the last open, for keep_cache
+	off_t size;
+	struct ll_inode* next;
+	// not for directories
+	struct ll_inode* parent;	// holds one of parent's kids
+	char* name;
+	unsigned int users;	// calls using fd now, between node_get/put
+	unsigned int opens;	// open handles, which pin the fd too
+	struct ll_inode* lru_prev;	// in fd_lru while fd is open
+	struct ll_inode* lru_next;
+	// directories
+	unsigned int kids;	// nodes whose parent this is
+};
+
+// an open directory; entry is read but did not fit the last reply
+struct ll_dir {
+	DIR* dp;
+	struct dirent* entry;
+	off_t offset;
+};
+
+static struct ll_inode root;
+static struct ll_inode* buckets[LL_BUCKETS];
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+static int mirror_fd = -1;
+
+// open fds of files other than directories, most recently used first;
+// set from the open file limit in encfs_ll_main()
+static struct ll_inode fd_lru = { .lru_prev = &fd_lru, .lru_next = &fd_lru };
+static unsigned int fds_open;
+static unsigned int fd_budget = 512;
+
+static unsigned int bucket(dev_t dev, ino_t ino)
+{
+	return (unsigned int)((ino * 31 + dev) % LL_BUCKETS);
+}
+
+static struct ll_inode* get_inode(fuse_ino_t ino)
+{
+	if (ino == FUSE_ROOT_ID)
+		return &root;
+	return (struct ll_inode*)(uintptr_t)ino;
+}
+
+static fuse_ino_t node_id(struct ll_inode* node)
+{
+	if (node == &root)
+		return FUSE_ROOT_ID;
+	return (fuse_ino_t)(uintptr_t)node;
+}
+
+static struct encfs_handle* get_handle(struct fuse_file_info* fi)
+{
+	return (struct encfs_handle*)(uintptr_t)fi->fh;
+}
+
+static void proc_path(int fd, char* buf)
+{
+	snprintf(buf, PROC_PATH_MAX, "/proc/self/fd/%d", fd);
+}
+
+// The fd_lru helpers, under table_lock
+static void lru_unlink(struct ll_inode* node)
+{
+	node->lru_prev->lru_next = node->lru_next;
+	node->lru_next->lru_prev = node->lru_prev;
+}
+
+static void lru_push(struct ll_inode* node)
+{
+	node->lru_next = fd_lru.lru_next;
+	node->lru_prev = &fd_lru;
+	fd_lru.lru_next->lru_prev = node;
+	fd_lru.lru_next = node;
+}
+
+// Close the least recently used fds no call or open handle needs, down
+// to fd_budget
+static void lru_trim(void)
+{
+	struct ll_inode* node = fd_lru.lru_prev;
+	struct ll_inode* prev;
+
+	while (fds_open > fd_budget && node != &fd_lru) {
+		prev = node->lru_prev;
+		if (node->users == 0 && node->opens == 0) {
+			lru_unlink(node);
+			close(node->fd);
+			node->fd = -1;
+			fds_open--;
+		}
+		node = prev;
+	}
+}
+
+// Give node its open fd, under table_lock
+static void lru_add(struct ll_inode* node, int fd)
+{
+	node->fd = fd;
+	lru_push(node);
+	fds_open++;
+	lru_trim();
+}
+
+static void drop_node(struct ll_inode* node, int* fd);
+
+// Remember name in parent as the way back to a file that is not a
+// directory, under table_lock. The last lookup wins for hard links
+static int set_name(struct ll_inode* node, struct ll_inode* parent,
+		    const char* name)
+{
+	struct ll_inode* old = node->parent;
+	char* copy;
+	int fd = -1;
+
+	if (node->type == S_IFDIR)
+		return 0;
+	if (old == parent && strcmp(node->name, name) == 0)
+		return 0;
+	copy = strdup(name);
+	if (copy == NULL)
+		return -ENOMEM;
+	free(node->name);
+	node->name = copy;
+	node->parent = parent;
+	parent->kids++;
+	if (old != NULL) {
+		old->kids--;
+		// a directory, its fd is closed right there
+		drop_node(old, &fd);
+	}
+	return 0;
+}
+
+// Free node once the kernel has forgotten it and no file names it as its
+// parent, then its parent the same way, under table_lock. An fd of a
+// file that is not a directory is closed by the caller, returned in fd
+static void drop_node(struct ll_inode* node, int* fd)
+{
+	struct ll_inode** link;
+	struct ll_inode* parent;
+
+	while (node != &root && node->nlookup == 0 && node->kids == 0) {
+		for (link = &buckets[bucket(node->dev, node->ino)];
+		     *link != node; link = &(*link)->next)
+			;
+		*link = node->next;
+
+		parent = node->parent;
+		if (node->type == S_IFDIR) {
+			close(node->fd);
+		}
+		else if (node->fd != -1) {
+			lru_unlink(node);
+			fds_open--;
+			*fd = node->fd;
+		}
+		free(node->name);
+		free(node);
+
+		if (parent == NULL)
+			break;
+		parent->kids--;
+		node = parent;
+	}
+}
+
+// The node's O_PATH fd, opened again by name if it was closed. Must be
+// given back with node_put(). A name that now leads to another inode is
+// -ESTALE
+static int node_get(struct ll_inode* node)
+{
+	struct stat st;
+	int fd;
+
+	if (node->type == S_IFDIR)
+		return node->fd;
+
+	pthread_mutex_lock(&table_lock);
+	if (node->fd == -1) {
+		fd = openat(node->parent->fd, node->name, O_PATH | O_NOFOLLOW);
+		if (fd == -1) {
+			fd = -errno;
+			pthread_mutex_unlock(&table_lock);
+			return fd;
+		}
+		if (fstat(fd, &st) == -1 || st.st_dev != node->dev ||
+		    st.st_ino != node->ino) {
+			close(fd);
+			pthread_mutex_unlock(&table_lock);
+			return -ESTALE;
+		}
+		node->users++;
+		lru_add(node, fd);
+	}
+	else {
+		node->users++;
+		lru_unlink(node);
+		lru_push(node);
+	}
+	fd = node->fd;
+	pthread_mutex_unlock(&table_lock);
+
+	return fd;
+}
+
+static void node_put(struct ll_inode* node)
+{
+	if (node->type == S_IFDIR)
+		return;
+
+	pthread_mutex_lock(&table_lock);
+	node->users--;
+	pthread_mutex_unlock(&table_lock);
+}
+
+// stat a node, with the plaintext size of regular files
+static int node_stat(struct ll_inode* node, struct stat* st)
+{
+	char path[PROC_PATH_MAX];
+	int fd, res = 0;
+
+	fd = node_get(node);
+	if (fd < 0)
+		return fd;
+	if (fstatat(fd, "", st, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) == -1) {
+		res = -errno;
+	}
+	else if (S_ISREG(st->st_mode)) {
+		proc_path(fd, path);
+		encfs_plain_size(AT_FDCWD, path, st);
+	}
+	node_put(node);
+
+	return res;
+}
+
+// Find or add the node for name in parent, counting one more lookup,
+// and fill e for the reply
+static int do_lookup(struct ll_inode* parent, const char* name,
+		     struct fuse_entry_param* e)
+{
+	struct ll_inode* node;
+	int fd, res;
+
+	memset(e, 0, sizeof(*e));
+	e->attr_timeout = LL_TIMEOUT;
+	e->entry_timeout = LL_TIMEOUT;
+
+	fd = openat(parent->fd, name, O_PATH | O_NOFOLLOW);
+	if (fd == -1)
+		return -errno;
+	if (fstatat(fd, "", &e->attr, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) == -1) {
+		res = -errno;
+		close(fd);
+		return res;
+	}
+
+	pthread_mutex_lock(&table_lock);
+	for (node = buckets[bucket(e->attr.st_dev, e->attr.st_ino)]; node;
+	     node = node->next)
+		if (node->dev == e->attr.st_dev && node->ino == e->attr.st_ino)
+			break;
+	if (node) {
+		node->nlookup++;
+		set_name(node, parent, name);
+		if (node->fd == -1) {
+			lru_add(node, fd);
+			fd = -1;
+		}
+	}
+	else {
+		node = calloc(1, sizeof(*node));
+		if (node == NULL) {
+			pthread_mutex_unlock(&table_lock);
+			close(fd);
+			return -ENOMEM;
+		}
+		node->dev = e->attr.st_dev;
+		node->ino = e->attr.st_ino;
+		node->type = e->attr.st_mode & S_IFMT;
+		if (set_name(node, parent, name) < 0) {
+			pthread_mutex_unlock(&table_lock);
+			free(node);
+			close(fd);
+			return -ENOMEM;
+		}
+		node->nlookup = 1;
+		node->next = buckets[bucket(node->dev, node->ino)];
+		buckets[bucket(node->dev, node->ino)] = node;
+		if (node->type == S_IFDIR)
+			node->fd = fd;
+		else
+			lru_add(node, fd);
+		fd = -1;
+	}
+	pthread_mutex_unlock(&table_lock);
+	if (fd != -1)
+		close(fd);
+
+	e->ino = node_id(node);
+	res = node_stat(node, &e->attr);
+	if (res < 0)
+		memset(&e->attr, 0, sizeof(e->attr));
+	return 0;
+}
+
+static void forget_one(fuse_ino_t ino, uint64_t nlookup)
+{
+	struct ll_inode* node = get_inode(ino);
+	int fd = -1;
+
+	if (node == &root)
+		return;
+
+	pthread_mutex_lock(&table_lock);
+	node->nlookup -= (node->nlookup > nlookup) ? nlookup : node->nlookup;
+	drop_node(node, &fd);
+	pthread_mutex_unlock(&table_lock);
+
+	if (fd != -1)
+		close(fd);
+}
+
+static void reply_entry(fuse_req_t req, struct ll_inode* parent,
+			const char* name, int res)
+{
+	struct fuse_entry_param e;
+
+	if (res == 0)
+		res = do_lookup(parent, name, &e);
+	if (res < 0)
+		fuse_reply_err(req, -res);
+	else
+		fuse_reply_entry(req, &e);
+}
+
+static void ll_init(void* userdata, struct fuse_conn_info* conn)
+{
+	(void) userdata;
+
+	conn->want |= FUSE_CAP_BIG_WRITES | FUSE_CAP_ASYNC_READ;
+	// read replies and write requests move between the device and
+	// pass-through files as pipe pages
+	conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE |
+				       FUSE_CAP_SPLICE_MOVE |
+				       FUSE_CAP_SPLICE_READ);
+	// after fuse_daemonize(), the threads have to live in the daemon
+	encfs_migrate_start();
+}
+
+static void ll_lookup(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+	reply_entry(req, get_inode(parent), name, 0);
+}
+
+static void ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+	forget_one(ino, nlookup);
+	fuse_reply_none(req);
+}
+
+static void ll_forget_multi(fuse_req_t req, size_t count,
+			    struct fuse_forget_data* forgets)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		forget_one((fuse_ino_t)forgets[i].ino, forgets[i].nlookup);
+	fuse_reply_none(req);
+}
+
+static void ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+	struct stat st;
+	int res;
+
+	(void) fi;
+
+	res = node_stat(get_inode(ino), &st);
+	if (res < 0)
+		fuse_reply_err(req, -res);
+	else
+		fuse_reply_attr(req, &st, LL_TIMEOUT);
+}
+
+static void ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat* attr,
+		       int valid, struct fuse_file_info* fi)
+{
+	struct ll_inode* node = get_inode(ino);
+	struct encfs_handle* h = fi ? get_handle(fi) : NULL;
+	char path[PROC_PATH_MAX];
+	struct timespec ts[2];
+	struct stat st;
+	uid_t uid;
+	gid_t gid;
+	int fd, res = 0;
+
+	fd = node_get(node);
+	if (fd < 0) {
+		fuse_reply_err(req, -fd);
+		return;
+	}
+	proc_path(fd, path);
+
+	if (valid & FUSE_SET_ATTR_MODE) {
+		res = h ? fchmod(h->fd, attr->st_mode) : chmod(path, attr->st_mode);
+		if (res == -1)
+			goto error;
+	}
+	if (valid & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) {
+		uid = (valid & FUSE_SET_ATTR_UID) ? attr->st_uid : (uid_t)-1;
+		gid = (valid & FUSE_SET_ATTR_GID) ? attr->st_gid : (gid_t)-1;
+		res = fchownat(fd, "", uid, gid,
+			       AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW);
+		if (res == -1)
+			goto error;
+	}
+	if (valid & FUSE_SET_ATTR_SIZE) {
+		if (h)
+			res = encfs_handle_truncate(h, attr->st_size);
+		else
+			res = encfs_truncate_at(AT_FDCWD, path, attr->st_size);
+		if (res < 0) {
+			node_put(node);
+			fuse_reply_err(req, -res);
+			return;
+		}
+	}
+	if (valid & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)) {
+		ts[0].tv_nsec = UTIME_OMIT;
+		ts[1].tv_nsec = UTIME_OMIT;
+		if (valid & FUSE_SET_ATTR_ATIME_NOW)
+			ts[0].tv_nsec = UTIME_NOW;
+		else if (valid & FUSE_SET_ATTR_ATIME)
+			ts[0] = attr->st_atim;
+		if (valid & FUSE_SET_ATTR_MTIME_NOW)
+			ts[1].tv_nsec = UTIME_NOW;
+		else if (valid & FUSE_SET_ATTR_MTIME)
+			ts[1] = attr->st_mtim;
+		res = h ? futimens(h->fd, ts) : utimensat(AT_FDCWD, path, ts, 0);
+		if (res == -1)
+			goto error;
+	}
+	node_put(node);
+
+	res = h ? encfs_handle_getattr(h, &st) : node_stat(node, &st);
+	if (res < 0)
+		fuse_reply_err(req, -res);
+	else
+		fuse_reply_attr(req, &st, LL_TIMEOUT);
+	return;
+
+error:
+	res = errno;
+	node_put(node);
+	fuse_reply_err(req, res);
+}
+
+static void ll_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+	struct ll_inode* node = get_inode(ino);
+	char buf[PATH_MAX + 1];
+	ssize_t res;
+	int fd;
+
+	fd = node_get(node);
+	if (fd < 0) {
+		fuse_reply_err(req, -fd);
+		return;
+	}
+	res = readlinkat(fd, "", buf, sizeof(buf));
+	if (res == -1)
+		res = -errno;
+	node_put(node);
+	if (res < 0) {
+		fuse_reply_err(req, -res);
+		return;
+	}
+	if (res == sizeof(buf)) {
+		fuse_reply_err(req, ENAMETOOLONG);
+		return;
+	}
+	buf[res] = '\0';
+	fuse_reply_readlink(req, buf);
+}
+
+static void ll_mknod(fuse_req_t req, fuse_ino_t parent, const char* name,
+		     mode_t mode, dev_t rdev)
+{
+	struct ll_inode* dir = get_inode(parent);
+	int res;
+
+	if (S_ISREG(mode)) {
+		res = openat(dir->fd, name, O_CREAT | O_EXCL | O_WRONLY, mode);
+		if (res >= 0)
+			res = close(res);
+	}
+	else if (S_ISFIFO(mode)) {
+		res = mkfifoat(dir->fd, name, mode);
+	}
+	else {
+		res = mknodat(dir->fd, name, mode, rdev);
+	}
+	reply_entry(req, dir, name, res == -1 ? -errno : 0);
+}
+
+static void ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char* name,
+		     mode_t mode)
+{
+	struct ll_inode* dir = get_inode(parent);
+	int res;
+
+	res = mkdirat(dir->fd, name, mode);
+	reply_entry(req, dir, name, res == -1 ? -errno : 0);
+}
+
+static void ll_symlink(fuse_req_t req, const char* link, fuse_ino_t parent,
+		       const char* name)
+{
+	struct ll_inode* dir = get_inode(parent);
+	int res;
+
+	res = symlinkat(link, dir->fd, name);
+	reply_entry(req, dir, name, res == -1 ? -errno : 0);
+}
+
+static void ll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
+		    const char* newname)
+{
+	struct ll_inode* node = get_inode(ino);
+	struct ll_inode* dir = get_inode(newparent);
+	char path[PROC_PATH_MAX];
+	int fd, res;
+
+	fd = node_get(node);
+	if (fd < 0) {
+		fuse_reply_err(req, -fd);
+		return;
+	}
+	// linkat() with AT_EMPTY_PATH needs CAP_DAC_READ_SEARCH, the /proc
+	// link does not
+	proc_path(fd, path);
+	res = linkat(AT_FDCWD, path, dir->fd, newname, AT_SYMLINK_FOLLOW);
+	res = (res == -1) ? -errno : 0;
+	node_put(node);
+	reply_entry(req, dir, newname, res);
+}
+
+static void ll_unlink(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+	struct ll_inode* dir = get_inode(parent);
+	int res;
+
+	// the inode number may come back on an unrelated file
+	encfs_meta_invalidate_at(dir->fd, name);
+	res = unlinkat(dir->fd, name, 0);
+	fuse_reply_err(req, res == -1 ? errno : 0);
+}
+
+static void ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+	int res;
+
+	res = unlinkat(get_inode(parent)->fd, name, AT_REMOVEDIR);
+	fuse_reply_err(req, res == -1 ? errno : 0);
+}
+
+// A node that was known by the renamed name is known by the new one
+static void rename_node(const struct stat* st, struct ll_inode* from,
+			const char* name, struct ll_inode* to,
+			const char* newname)
+{
+	struct ll_inode* node;
+
+	pthread_mutex_lock(&table_lock);
+	for (node = buckets[bucket(st->st_dev, st->st_ino)]; node;
+	     node = node->next)
+		if (node->dev == st->st_dev && node->ino == st->st_ino)
+			break;
+	if (node && node->parent == from && strcmp(node->name, name) == 0)
+		set_name(node, to, newname);
+	pthread_mutex_unlock(&table_lock);
+}
+
+static void ll_rename(fuse_req_t req, fuse_ino_t parent, const char* name,
+		      fuse_ino_t newparent, const char* newname)
+{
+	struct ll_inode* from = get_inode(parent);
+	struct ll_inode* to = get_inode(newparent);
+	struct stat st;
+	int res, known;
+
+	known = fstatat(from->fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0;
+	encfs_meta_invalidate_at(to->fd, newname);
+	res = renameat(from->fd, name, to->fd, newname);
+	if (res == 0 && known)
+		rename_node(&st, from, name, to, newname);
+	fuse_reply_err(req, res == -1 ? errno : 0);
+}
+
+// Count an open handle of node (1) or its release (-1). The fd of an
+// open file stays, so the file can be reached if it is renamed or
+// unlinked meanwhile
+static void pin_node(struct ll_inode* node, int n)
+{
+	pthread_mutex_lock(&table_lock);
+	node->opens += n;
+	pthread_mutex_unlock(&table_lock);
+}
+
+// Let the kernel keep its pages of the file if it has not changed since
+// the last open, as auto_cache does for the path based mount
+static void keep_cache(struct ll_inode* node, struct encfs_handle* h,
+		       struct fuse_file_info* fi)
+{
+	struct stat st;
+
+	if (encfs_handle_getattr(h, &st) < 0)
+		return;
+
+	pthread_mutex_lock(&table_lock);
+	if (node->mtime.tv_sec == st.st_mtim.tv_sec &&
+	    node->mtime.tv_nsec == st.st_mtim.tv_nsec &&
+	    node->size == st.st_size)
+		fi->keep_cache = 1;
+	node->mtime = st.st_mtim;
+	node->size = st.st_size;
+	pthread_mutex_unlock(&table_lock);
+}
+
+static void ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+	struct ll_inode* node = get_inode(ino);
+	struct encfs_handle* h;
+	char path[PROC_PATH_MAX];
+	int fd, res;
+
+	fd = node_get(node);
+	if (fd < 0) {
+		fuse_reply_err(req, -fd);
+		return;
+	}
+	proc_path(fd, path);
+	res = encfs_handle_open(AT_FDCWD, path, fi->flags, &h);
+	if (res == 0)
+		pin_node(node, 1);
+	node_put(node);
+	if (res < 0) {
+		fuse_reply_err(req, -res);
+		return;
+	}
+	keep_cache(node, h, fi);
+
+	fi->fh = (uint64_t)(uintptr_t)h;
+	if (fuse_reply_open(req, fi) == -ENOENT) {
+		encfs_handle_release(h);
+		pin_node(node, -1);
+	}
+}
+
+static void ll_create(fuse_req_t req, fuse_ino_t parent, const char* name,
+		      mode_t mode, struct fuse_file_info* fi)
+{
+	struct ll_inode* dir = get_inode(parent);
+	struct fuse_entry_param e;
+	struct encfs_handle* h;
+	int fd, res;
+
+	fd = openat(dir->fd, name, O_CREAT | O_TRUNC | O_RDWR, mode);
+	if (fd == -1) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+	res = encfs_handle_create(fd, &h);
+	if (res < 0) {
+		fuse_reply_err(req, -res);
+		return;
+	}
+	res = do_lookup(dir, name, &e);
+	if (res < 0) {
+		encfs_handle_release(h);
+		fuse_reply_err(req, -res);
+		return;
+	}
+	keep_cache(get_inode(e.ino), h, fi);
+	pin_node(get_inode(e.ino), 1);
+
+	fi->fh = (uint64_t)(uintptr_t)h;
+	if (fuse_reply_create(req, &e, fi) == -ENOENT) {
+		encfs_handle_release(h);
+		pin_node(get_inode(e.ino), -1);
+	}
+}
+
+static void ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+		    struct fuse_file_info* fi)
+{
+	struct encfs_handle* h = get_handle(fi);
+	struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(size);
+	char* buf;
+	int res;
+
+	(void) ino;
+
+	// pass-through files go from the backing fd to the device without
+	// passing through our memory, spliced when the kernel allows it
+	if (h->plain) {
+		bufv.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		bufv.buf[0].fd = h->fd;
+		bufv.buf[0].pos = offset;
+		fuse_reply_data(req, &bufv, FUSE_BUF_SPLICE_MOVE);
+		return;
+	}
+
+	buf = malloc(size);
+	if (buf == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	res = encfs_handle_read(h, buf, size, offset);
+	if (res < 0)
+		fuse_reply_err(req, -res);
+	else
+		fuse_reply_buf(req, buf, res);
+	free(buf);
+}
+
+static void ll_write_buf(fuse_req_t req, fuse_ino_t ino,
+			 struct fuse_bufvec* in_buf, off_t offset,
+			 struct fuse_file_info* fi)
+{
+	struct encfs_handle* h = get_handle(fi);
+	size_t size = fuse_buf_size(in_buf);
+	struct fuse_bufvec out = FUSE_BUFVEC_INIT(size);
+	ssize_t res;
+	char* buf;
+
+	(void) ino;
+
+	if (h->plain) {
+		out.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		out.buf[0].fd = h->fd;
+		out.buf[0].pos = offset;
+		res = fuse_buf_copy(&out, in_buf, 0);
+	}
+	else if (in_buf->count == 1 && in_buf->idx == 0 && in_buf->off == 0 &&
+		 !(in_buf->buf[0].flags & FUSE_BUF_IS_FD)) {
+		res = encfs_handle_write(h, in_buf->buf[0].mem, size, offset);
+	}
+	else {
+		// the plaintext has to be in memory to be encrypted
+		buf = malloc(size);
+		if (buf == NULL) {
+			fuse_reply_err(req, ENOMEM);
+			return;
+		}
+		out.buf[0].mem = buf;
+		res = fuse_buf_copy(&out, in_buf, 0);
+		if (res >= 0)
+			res = encfs_handle_write(h, buf, res, offset);
+		free(buf);
+	}
+
+	if (res < 0)
+		fuse_reply_err(req, -res);
+	else
+		fuse_reply_write(req, res);
+}
+
+static void ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+	(void) ino;
+
+	fuse_reply_err(req, -encfs_handle_flush(get_handle(fi)));
+}
+
+static void ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+		     struct fuse_file_info* fi)
+{
+	(void) ino;
+
+	fuse_reply_err(req, -encfs_handle_fsync(get_handle(fi), datasync));
+}
+
+static void ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode,
+			 off_t offset, off_t length, struct fuse_file_info* fi)
+{
+	(void) ino;
+
+	fuse_reply_err(req, -encfs_handle_fallocate(get_handle(fi), mode,
+						    offset, length));
+}
+
+static void ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+	encfs_handle_release(get_handle(fi));
+	pin_node(get_inode(ino), -1);
+	fuse_reply_err(req, 0);
+}
+
+static void ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+	struct ll_dir* d;
+	int fd;
+
+	d = calloc(1, sizeof(*d));
+	if (d == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	fd = openat(get_inode(ino)->fd, ".", O_RDONLY | O_DIRECTORY);
+	if (fd == -1)
+		goto error;
+	d->dp = fdopendir(fd);
+	if (d->dp == NULL) {
+		close(fd);
+		goto error;
+	}
+
+	fi->fh = (uint64_t)(uintptr_t)d;
+	if (fuse_reply_open(req, fi) == -ENOENT) {
+		closedir(d->dp);
+		free(d);
+	}
+	return;
+
+error:
+	fuse_reply_err(req, errno);
+	free(d);
+}
+
+// Fill one reply with entries from offset on. An entry that does not fit
+// is kept for the next call, which normally asks for the offset after the
+// last entry returned.
+static void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+		       off_t offset, struct fuse_file_info* fi)
+{
+	struct ll_dir* d = (struct ll_dir*)(uintptr_t)fi->fh;
+	struct stat st;
+	size_t rem = size, len;
+	off_t next;
+	char* buf;
+
+	(void) ino;
+
+	buf = malloc(size);
+	if (buf == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	if (offset != d->offset) {
+		seekdir(d->dp, offset);
+		d->entry = NULL;
+		d->offset = offset;
+	}
+
+	for (;;) {
+		if (d->entry == NULL) {
+			errno = 0;
+			d->entry = readdir(d->dp);
+			if (d->entry == NULL) {
+				if (errno && rem == size) {
+					fuse_reply_err(req, errno);
+					free(buf);
+					return;
+				}
+				break;
+			}
+		}
+		next = telldir(d->dp);
+		memset(&st, 0, sizeof(st));
+		st.st_ino = d->entry->d_ino;
+		st.st_mode = d->entry->d_type << 12;
+		len = fuse_add_direntry(req, buf + size - rem, rem,
+					d->entry->d_name, &st, next);
+		if (len > rem)
+			break;
+		rem -= len;
+		d->entry = NULL;
+		d->offset = next;
+	}
+
+	fuse_reply_buf(req, buf, size - rem);
+	free(buf);
+}
+
+static void ll_releasedir(fuse_req_t req, fuse_ino_t ino,
+			  struct fuse_file_info* fi)
+{
+	struct ll_dir* d = (struct ll_dir*)(uintptr_t)fi->fh;
+
+	(void) ino;
+
+	closedir(d->dp);
+	free(d);
+	fuse_reply_err(req, 0);
+}
+
+static void ll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+	struct statvfs st;
+
+	(void) ino;
+
+	if (fstatvfs(mirror_fd, &st) == -1)
+		fuse_reply_err(req, errno);
+	else
+		fuse_reply_statfs(req, &st);
+}
+
+static void ll_access(fuse_req_t req, fuse_ino_t ino, int mask)
+{
+	struct ll_inode* node = get_inode(ino);
+	char path[PROC_PATH_MAX];
+	int fd, res;
+
+	fd = node_get(node);
+	if (fd < 0) {
+		fuse_reply_err(req, -fd);
+		return;
+	}
+	proc_path(fd, path);
+	res = access(path, mask);
+	res = (res == -1) ? errno : 0;
+	node_put(node);
+	fuse_reply_err(req, res);
+}
+
+// The xattr calls follow the /proc link, which for a symlink node would
+// land on its target; symlinks get no user attributes on Linux anyway.
+// On success the node's fd is held, until node_put()
+static int xattr_path(fuse_req_t req, struct ll_inode* node, char* path)
+{
+	int fd;
+
+	if (node->type == S_IFLNK) {
+		fuse_reply_err(req, ENOTSUP);
+		return -1;
+	}
+	fd = node_get(node);
+	if (fd < 0) {
+		fuse_reply_err(req, -fd);
+		return -1;
+	}
+	proc_path(fd, path);
+	return 0;
+}
+
+// user.encfs says how the file is read, which open handles would not
+// notice: it only changes while the inode is not open, and the inode is
+// claimed meanwhile so no open races the change. Returns 1 if it was
+// claimed, 0 for any other attribute, or -errno
+static int claim_attr(struct ll_inode* node, const char* name)
+{
+	int res;
+
+	if (strcmp(name, "user.encfs") != 0)
+		return 0;
+	res = encfs_meta_claim(node->dev, node->ino);
+	return (res < 0) ? res : 1;
+}
+
+// End claim_attr(). The kernel's pages hold what the file read as
+// before, the next open must not keep them
+static void unclaim_attr(struct ll_inode* node)
+{
+	encfs_meta_unclaim(node->dev, node->ino, 1);
+	pthread_mutex_lock(&table_lock);
+	node->mtime.tv_sec = 0;
+	node->mtime.tv_nsec = 0;
+	pthread_mutex_unlock(&table_lock);
+}
+
+static void ll_setxattr(fuse_req_t req, fuse_ino_t ino, const char* name,
+			const char* value, size_t size, int flags)
+{
+	struct ll_inode* node = get_inode(ino);
+	char path[PROC_PATH_MAX];
+	int res, claimed;
+
+	if (xattr_path(req, node, path) < 0)
+		return;
+	claimed = claim_attr(node, name);
+	if (claimed < 0) {
+		node_put(node);
+		fuse_reply_err(req, -claimed);
+		return;
+	}
+	res = (setxattr(path, name, value, size, flags) == -1) ? errno : 0;
+	node_put(node);
+	if (claimed)
+		unclaim_attr(node);
+	encfs_meta_invalidate(node->dev, node->ino);
+	fuse_reply_err(req, res);
+}
+
+static void ll_getxattr(fuse_req_t req, fuse_ino_t ino, const char* name,
+			size_t size)
+{
+	struct ll_inode* node = get_inode(ino);
+	char path[PROC_PATH_MAX];
+	char* value = NULL;
+	ssize_t res;
+
+	if (size) {
+		value = malloc(size);
+		if (value == NULL) {
+			fuse_reply_err(req, ENOMEM);
+			return;
+		}
+	}
+	if (xattr_path(req, node, path) < 0) {
+		free(value);
+		return;
+	}
+	res = getxattr(path, name, value, size);
+	if (res == -1)
+		res = -errno;
+	node_put(node);
+	if (res < 0)
+		fuse_reply_err(req, -res);
+	else if (size)
+		fuse_reply_buf(req, value, res);
+	else
+		fuse_reply_xattr(req, res);
+	free(value);
+}
+
+static void ll_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
+{
+	struct ll_inode* node = get_inode(ino);
+	char path[PROC_PATH_MAX];
+	char* list = NULL;
+	ssize_t res;
+
+	if (size) {
+		list = malloc(size);
+		if (list == NULL) {
+			fuse_reply_err(req, ENOMEM);
+			return;
+		}
+	}
+	if (xattr_path(req, node, path) < 0) {
+		free(list);
+		return;
+	}
+	res = listxattr(path, list, size);
+	if (res == -1)
+		res = -errno;
+	node_put(node);
+	if (res < 0)
+		fuse_reply_err(req, -res);
+	else if (size)
+		fuse_reply_buf(req, list, res);
+	else
+		fuse_reply_xattr(req, res);
+	free(list);
+}
+
+static void ll_removexattr(fuse_req_t req, fuse_ino_t ino, const char* name)
+{
+	struct ll_inode* node = get_inode(ino);
+	char path[PROC_PATH_MAX];
+	int res, claimed;
+
+	if (xattr_path(req, node, path) < 0)
+		return;
+	claimed = claim_attr(node, name);
+	if (claimed < 0) {
+		node_put(node);
+		fuse_reply_err(req, -claimed);
+		return;
+	}
+	res = (removexattr(path, name) == -1) ? errno : 0;
+	node_put(node);
+	if (claimed)
+		unclaim_attr(node);
+	encfs_meta_invalidate(node->dev, node->ino);
+	fuse_reply_err(req, res);
+}
+
+static struct fuse_lowlevel_ops ll_oper = {
+	.init		= ll_init,
+	.lookup		= ll_lookup,
+	.forget		= ll_forget,
+	.forget_multi	= ll_forget_multi,
+	.getattr	= ll_getattr,
+	.setattr	= ll_setattr,
+	.readlink	= ll_readlink,
+	.mknod		= ll_mknod,
+	.mkdir		= ll_mkdir,
+	.symlink	= ll_symlink,
+	.link		= ll_link,
+	.unlink		= ll_unlink,
+	.rmdir		= ll_rmdir,
+	.rename		= ll_rename,
+	.open		= ll_open,
+	.create		= ll_create,
+	.read		= ll_read,
+	.write_buf	= ll_write_buf,
+	.flush		= ll_flush,
+	.fsync		= ll_fsync,
+	.fallocate	= ll_fallocate,
+	.release	= ll_release,
+	.opendir	= ll_opendir,
+	.readdir	= ll_readdir,
+	.releasedir	= ll_releasedir,
+	.statfs		= ll_statfs,
+	.access		= ll_access,
+	.setxattr	= ll_setxattr,
+	.getxattr	= ll_getxattr,
+	.listxattr	= ll_listxattr,
+	.removexattr	= ll_removexattr,
+};
+
+// Half the open file limit, raised to the hard limit, goes to the fds of
+// files that are not directories; the rest is left for directories,
+// open handles and the cache
+static void set_fd_budget(void)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == -1)
+		return;
+	if (rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		if (setrlimit(RLIMIT_NOFILE, &rl) == -1)
+			getrlimit(RLIMIT_NOFILE, &rl);
+	}
+	if (rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur / 2 > UINT_MAX)
+		fd_budget = UINT_MAX;
+	else
+		fd_budget = rl.rlim_cur / 2;
+}
+
+int encfs_ll_main(struct fuse_args* args, int dir_fd)
+{
+	struct fuse_session* se;
+	struct fuse_chan* ch;
+	char* mountpoint = NULL;
+	int multithreaded, foreground;
+	int res = -1;
+
+	mirror_fd = dir_fd;
+	set_fd_budget();
+	root.fd = openat(dir_fd, ".", O_PATH);
+	root.type = S_IFDIR;
+	if (root.fd == -1) {
+		perror("Can not open mirror directory");
+		return 1;
+	}
+
+	if (fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground) == -1)
+		goto out;
+	ch = fuse_mount(mountpoint, args);
+	if (ch == NULL)
+		goto out;
+
+	se = fuse_lowlevel_new(args, &ll_oper, sizeof(ll_oper), NULL);
+	if (se != NULL) {
+		if (fuse_set_signal_handlers(se) != -1) {
+			fuse_session_add_chan(se, ch);
+			if (fuse_daemonize(foreground) != -1)
+				res = multithreaded ? fuse_session_loop_mt(se)
+						    : fuse_session_loop(se);
+			fuse_remove_signal_handlers(se);
+			fuse_session_remove_chan(ch);
+		}
+		fuse_session_destroy(se);
+	}
+	fuse_unmount(mountpoint, ch);
+
+out:
+	free(mountpoint);
+	close(root.fd);
+	return res == 0 ? 0 : 1;
+}
@@ -0,0 +1,28 @@
+/* encfs-ll.h
+ * Inode based front end for pa5-encfs, on the FUSE low-level API
+ *
+ * By Shane Sarnac
+ *
+ * The kernel names files by inode number here, not by path. Every inode
+ * it knows of is held open as an O_PATH fd on the backing file, up to
+ * half the open file limit for files that are not directories, and
+ * each call works from that fd instead of walking the mirror directory
+ * again. Reads of files that are not encrypted are spliced from the
+ * backing fd and writes spliced to it, without a copy through our
+ * buffers. File contents go through encfs-handle.h, as in pa5-encfs.c.
+ */
+
+#ifndef ENCFS_LL_H
+#define ENCFS_LL_H
+
+#include <fuse.h>
+
+/* int encfs_ll_main(struct fuse_args* args, int mirror_fd)
+ * Purpose: Mount the directory open as mirror_fd on the mount point in
+ *          args and serve it until unmounted. encfs_handle_setup() must
+ *          have been called
+ * Return: 0 on a clean unmount, 1 otherwise
+ */
+extern int encfs_ll_main(struct fuse_args* args, int mirror_fd);
+
+#endif
@@ -0,0 +1,381 @@
+/* encfs-meta.c
+ * Per-inode metadata cache for pa5-encfs
+ *
+ * By Shane Sarnac
+ *
+ * See encfs-meta.h. One mutex covers the whole table; it is only held
+ * for hash lookups, never across the syscalls that fill an entry. Holds
+ * on a claimed inode wait on claim_cond, which every unclaim wakes.
+ */
+
+/* For O_PATH */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/xattr.h>
+
+#include "encfs-meta.h"
+
+static struct encfs_meta* buckets[ENCFS_META_BUCKETS];
+static int count = 0;
+static pthread_mutex_t meta_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t claim_cond = PTHREAD_COND_INITIALIZER;
+static unsigned long changes = 0;	// atomic, see encfs_meta_changes()
+
+static unsigned int bucket(dev_t dev, ino_t ino)
+{
+	return (unsigned int)((ino * 31 + dev) % ENCFS_META_BUCKETS);
+}
+
+// caller holds meta_lock
+static struct encfs_meta* find(dev_t dev, ino_t ino)
+{
+	struct encfs_meta* m;
+
+	for (m = buckets[bucket(dev, ino)]; m; m = m->next)
+		if (m->dev == dev && m->ino == ino)
+			return m;
+
+	return NULL;
+}
+
+// Drop every entry no handle holds or claim involves, caller holds meta_lock
+static void shrink(void)
+{
+	struct encfs_meta** link;
+	struct encfs_meta* m;
+	int i;
+
+	for (i = 0; i < ENCFS_META_BUCKETS; i++) {
+		link = &buckets[i];
+		while ((m = *link) != NULL) {
+			if (m->holds == 0 && !m->claimed && m->waiting == 0) {
+				*link = m->next;
+				free(m);
+				count--;
+			}
+			else {
+				link = &m->next;
+			}
+		}
+	}
+}
+
+// Count a change to m, caller holds meta_lock
+static unsigned long bump(struct encfs_meta* m)
+{
+	__atomic_add_fetch(&changes, 1, __ATOMIC_RELEASE);
+	return ++m->gen;
+}
+
+// caller holds meta_lock
+static struct encfs_meta* add(dev_t dev, ino_t ino)
+{
+	struct encfs_meta* m;
+
+	if (count >= ENCFS_META_MAX)
+		shrink();
+	m = calloc(1, sizeof(*m));
+	if (m == NULL)
+		return NULL;
+	m->dev = dev;
+	m->ino = ino;
+	m->next = buckets[bucket(dev, ino)];
+	buckets[bucket(dev, ino)] = m;
+	count++;
+	return m;
+}
+
+// Wait for the claim on m to end, caller holds meta_lock. -EAGAIN if
+// the inode was replaced meanwhile, what the caller looked up is gone
+static int wait_claim(struct encfs_meta* m)
+{
+	m->waiting++;
+	while (m->claimed)
+		pthread_cond_wait(&claim_cond, &meta_lock);
+	m->waiting--;
+	return m->valid ? 0 : -EAGAIN;
+}
+
+// Read the attribute and header of st's file, the slow path
+static int probe(int dirfd, const char* path, int fd, const struct stat* st,
+		 struct encfs_meta* meta)
+{
+	char value[6], proc[64], rw_path[64];
+	struct stat now;
+	ssize_t len;
+	int own_fd = -1, path_fd = -1, rw_fd;
+	int res;
+
+	// path may name another inode by now (a rename or migration over
+	// it), whose header must not go in st's entry
+	if (fd < 0) {
+		path_fd = openat(dirfd, path, O_PATH);
+		if (path_fd == -1)
+			return -errno;
+		if (fstat(path_fd, &now) == -1 || now.st_dev != st->st_dev ||
+		    now.st_ino != st->st_ino) {
+			close(path_fd);
+			return -ESTALE;
+		}
+		snprintf(proc, sizeof(proc), "/proc/self/fd/%d", path_fd);
+		path = proc;
+	}
+
+	// the value may or may not include the terminating NUL. path is
+	// followed, it may be a /proc/self/fd link to a regular file.
+	if (fd >= 0)
+		len = fgetxattr(fd, "user.encfs", value, sizeof(value) - 1);
+	else
+		len = getxattr(path, "user.encfs", value, sizeof(value) - 1);
+	if (len < 0)
+		len = 0;
+	value[len] = '\0';
+
+	meta->length = -1;
+	if (strcmp(value, "true") != 0) {
+		meta->format = ENCFS_FORMAT_PLAIN;
+		res = 0;
+		goto out;
+	}
+
+	if (fd < 0) {
+		own_fd = open(path, O_RDONLY);
+		if (own_fd == -1) {
+			res = -errno;
+			goto out;
+		}
+		fd = own_fd;
+	}
+
+	// a conversion a crash cut short is finished before anything reads
+	// the file (see encfs_convert_begin())
+	if (fgetxattr(fd, ENCFS_CONVERT_ATTR, NULL, 0) >= 0) {
+		snprintf(rw_path, sizeof(rw_path), "/proc/self/fd/%d", fd);
+		rw_fd = open(rw_path, O_RDWR);
+		if (rw_fd == -1) {
+			res = -errno;
+			goto out;
+		}
+		res = encfs_convert_finish(rw_fd);
+		close(rw_fd);
+		if (res < 0)
+			goto out;
+	}
+
+	res = encfs_header_read(fd, &meta->hdr);
+	if (res == 0) {
+		meta->format = ENCFS_FORMAT_BLOCK;
+		// st is from before a finished conversion cut the file
+		if (fstat(fd, &now) == 0 && now.st_size != st->st_size)
+			meta->length = encfs_logical_size(&meta->hdr, now.st_size);
+	}
+	else if (res == -EINVAL) {
+		meta->format = ENCFS_FORMAT_LEGACY;
+		res = 0;
+	}
+
+out:
+	if (own_fd != -1)
+		close(own_fd);
+	if (path_fd != -1)
+		close(path_fd);
+	return res;
+}
+
+int encfs_meta_get(int dirfd, const char* path, int fd,
+		   const struct stat* st, struct encfs_meta* meta, int hold)
+{
+	struct encfs_meta* m;
+	struct encfs_meta fresh;
+	int res;
+
+retry:
+	pthread_mutex_lock(&meta_lock);
+	m = find(st->st_dev, st->st_ino);
+	if (m && m->valid) {
+		if (hold && m->claimed && wait_claim(m) < 0) {
+			pthread_mutex_unlock(&meta_lock);
+			goto retry;
+		}
+		if (hold)
+			m->holds++;
+		*meta = *m;
+		pthread_mutex_unlock(&meta_lock);
+		return 0;
+	}
+	pthread_mutex_unlock(&meta_lock);
+
+	res = probe(dirfd, path, fd, st, &fresh);
+	if (res < 0)
+		return res;
+
+	pthread_mutex_lock(&meta_lock);
+	// someone may have filled it meanwhile, theirs is as good as ours
+	m = find(st->st_dev, st->st_ino);
+	if (m == NULL) {
+		m = add(st->st_dev, st->st_ino);
+		if (m == NULL) {
+			pthread_mutex_unlock(&meta_lock);
+			return -ENOMEM;
+		}
+	}
+	if (hold && m->claimed) {
+		// what we probed may be the old inode's, look again after
+		wait_claim(m);
+		pthread_mutex_unlock(&meta_lock);
+		goto retry;
+	}
+	if (!m->valid) {
+		m->format = fresh.format;
+		m->hdr = fresh.hdr;
+		m->length = fresh.length;
+		m->valid = 1;
+	}
+	if (hold)
+		m->holds++;
+	*meta = *m;
+	pthread_mutex_unlock(&meta_lock);
+
+	return 0;
+}
+
+void encfs_meta_release(dev_t dev, ino_t ino)
+{
+	struct encfs_meta* m;
+
+	pthread_mutex_lock(&meta_lock);
+	m = find(dev, ino);
+	if (m && m->holds > 0)
+		m->holds--;
+	pthread_mutex_unlock(&meta_lock);
+}
+
+int encfs_meta_claim(dev_t dev, ino_t ino)
+{
+	struct encfs_meta* m;
+	int res = 0;
+
+	pthread_mutex_lock(&meta_lock);
+	m = find(dev, ino);
+	if (m == NULL)
+		m = add(dev, ino);
+	if (m == NULL)
+		res = -ENOMEM;
+	else if (m->holds > 0 || m->claimed)
+		res = -EBUSY;
+	else
+		m->claimed = 1;
+	pthread_mutex_unlock(&meta_lock);
+
+	return res;
+}
+
+int encfs_meta_waiting(dev_t dev, ino_t ino)
+{
+	struct encfs_meta* m;
+	int waiting;
+
+	pthread_mutex_lock(&meta_lock);
+	m = find(dev, ino);
+	waiting = m ? m->waiting : 0;
+	pthread_mutex_unlock(&meta_lock);
+
+	return waiting;
+}
+
+void encfs_meta_unclaim(dev_t dev, ino_t ino, int replaced)
+{
+	struct encfs_meta* m;
+
+	pthread_mutex_lock(&meta_lock);
+	m = find(dev, ino);
+	if (m) {
+		m->claimed = 0;
+		if (replaced)
+			m->valid = 0;
+	}
+	pthread_cond_broadcast(&claim_cond);
+	pthread_mutex_unlock(&meta_lock);
+}
+
+unsigned long encfs_meta_set_format(dev_t dev, ino_t ino, int format,
+				    const struct encfs_header* hdr)
+{
+	struct encfs_meta* m;
+	unsigned long gen = 0;
+
+	pthread_mutex_lock(&meta_lock);
+	m = find(dev, ino);
+	if (m) {
+		m->format = format;
+		if (hdr)
+			m->hdr = *hdr;
+		m->length = -1;
+		m->valid = 1;
+		gen = bump(m);
+	}
+	pthread_mutex_unlock(&meta_lock);
+
+	return gen;
+}
+
+unsigned long encfs_meta_truncated(dev_t dev, ino_t ino, off_t length)
+{
+	struct encfs_meta* m;
+	unsigned long gen = 0;
+
+	pthread_mutex_lock(&meta_lock);
+	m = find(dev, ino);
+	if (m) {
+		if (m->valid)
+			m->length = length;
+		gen = bump(m);
+	}
+	pthread_mutex_unlock(&meta_lock);
+
+	return gen;
+}
+
+unsigned long encfs_meta_changes(void)
+{
+	return __atomic_load_n(&changes, __ATOMIC_ACQUIRE);
+}
+
+void encfs_meta_set_length(dev_t dev, ino_t ino, off_t length, int grow)
+{
+	struct encfs_meta* m;
+
+	pthread_mutex_lock(&meta_lock);
+	m = find(dev, ino);
+	if (m && m->valid && (!grow || length > m->length))
+		m->length = length;
+	pthread_mutex_unlock(&meta_lock);
+}
+
+void encfs_meta_invalidate(dev_t dev, ino_t ino)
+{
+	struct encfs_meta* m;
+
+	pthread_mutex_lock(&meta_lock);
+	m = find(dev, ino);
+	if (m) {
+		m->valid = 0;
+		bump(m);
+	}
+	pthread_mutex_unlock(&meta_lock);
+}
+
+void encfs_meta_invalidate_at(int dirfd, const char* path)
+{
+	struct stat st;
+
+	if (fstatat(dirfd, path, &st, AT_SYMLINK_NOFOLLOW) == 0)
+		encfs_meta_invalidate(st.st_dev, st.st_ino);
+}
@@ -0,0 +1,133 @@
+/* encfs-meta.h
+ * Per-inode metadata cache for pa5-encfs
+ *
+ * By Shane Sarnac
+ *
+ * Remembers, per backing inode, whether the file is encrypted (the
+ * user.encfs attribute), which format it is stored in, its header (the
+ * per-file IV) and its plaintext length, so the data path does not
+ * getxattr or re-read the header on every call. Entries are keyed by
+ * device and inode number, so a rename does not move them; they are
+ * dropped when the attribute changes or the inode goes away. A file
+ * that is about to be replaced by another inode (encfs-migrate.h) is
+ * claimed first, so no new handle opens it meanwhile.
+ *
+ * Every change that open handles of the inode have to catch up with (a
+ * conversion, a truncate, a new attribute) counts up the entry's
+ * generation and a count of such changes across all inodes. A handle
+ * compares the latter on each call, which takes no lock, and only looks
+ * its entry up when it has moved.
+ *
+ * All functions are safe to call from several threads.
+ */
+
+#ifndef ENCFS_META_H
+#define ENCFS_META_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "encfs-block.h"
+
+#define ENCFS_META_BUCKETS 1024
+/* Entries kept before the unheld ones are dropped */
+#define ENCFS_META_MAX 8192
+
+/* Formats */
+#define ENCFS_FORMAT_PLAIN 0	/* not encrypted */
+#define ENCFS_FORMAT_BLOCK 1	/* encfs-block.h header and blocks */
+#define ENCFS_FORMAT_LEGACY 2	/* whole-file do_crypt() CBC */
+
+struct encfs_meta {
+	dev_t dev;
+	ino_t ino;
+	int format;
+	struct encfs_header hdr;	// block format only
+	off_t length;			// plaintext length, -1 until known
+	int valid;			// 0 after invalidation, refilled on next get
+	int holds;			// open handles, held entries are never dropped
+	int claimed;			// being replaced, see encfs_meta_claim()
+	int waiting;			// callers waiting for the claim to end
+	unsigned long gen;		// changes handles must catch up with
+	struct encfs_meta* next;
+};
+
+/* int encfs_meta_get(int dirfd, const char* path, int fd,
+ *                    const struct stat* st, struct encfs_meta* meta,
+ *                    int hold)
+ * Purpose: Copy the entry for st's inode into meta, reading the
+ *          attribute and header of path (relative to dirfd, as for
+ *          openat(), or through fd if it is not -1) first if there is
+ *          none. A non-zero hold also takes a hold on
+ *          the entry, to be dropped with encfs_meta_release(), and
+ *          waits while the inode is claimed
+ * Return: 0, -ESTALE if path names another inode by now, or -errno
+ */
+extern int encfs_meta_get(int dirfd, const char* path, int fd,
+			  const struct stat* st, struct encfs_meta* meta,
+			  int hold);
+
+/* void encfs_meta_release(dev_t dev, ino_t ino)
+ * Purpose: Drop a hold taken by encfs_meta_get()
+ */
+extern void encfs_meta_release(dev_t dev, ino_t ino);
+
+/* int encfs_meta_claim(dev_t dev, ino_t ino)
+ * Purpose: Claim an inode no handle holds, to replace it. Until
+ *          encfs_meta_unclaim(), taking a hold on it waits
+ * Return: 0, -EBUSY if it is held or already claimed, or -ENOMEM
+ */
+extern int encfs_meta_claim(dev_t dev, ino_t ino);
+
+/* int encfs_meta_waiting(dev_t dev, ino_t ino)
+ * Purpose: Whether anyone is waiting for a hold on the claimed inode
+ */
+extern int encfs_meta_waiting(dev_t dev, ino_t ino);
+
+/* void encfs_meta_unclaim(dev_t dev, ino_t ino, int replaced)
+ * Purpose: End a claim. If the inode was replaced its entry is
+ *          invalidated, and the waiters look the file up again
+ */
+extern void encfs_meta_unclaim(dev_t dev, ino_t ino, int replaced);
+
+/* unsigned long encfs_meta_set_format(...)
+ * Purpose: Record that the inode now has format and, for the block
+ *          format, header hdr (after create or converting an old file)
+ * Return: The entry's new generation
+ */
+extern unsigned long encfs_meta_set_format(dev_t dev, ino_t ino, int format,
+					   const struct encfs_header* hdr);
+
+/* unsigned long encfs_meta_truncated(dev_t dev, ino_t ino, off_t length)
+ * Purpose: Record a truncate or fallocate that left the plaintext
+ *          length at length, which other handles' caches must not outlive
+ * Return: The entry's new generation
+ */
+extern unsigned long encfs_meta_truncated(dev_t dev, ino_t ino, off_t length);
+
+/* unsigned long encfs_meta_changes(void)
+ * Purpose: Changes counted in any entry's generation so far, without
+ *          taking the lock
+ */
+extern unsigned long encfs_meta_changes(void);
+
+/* void encfs_meta_set_length(dev_t dev, ino_t ino, off_t length, int grow)
+ * Purpose: Record the plaintext length once it is known, or after a
+ *          write (grow non-zero, length only ever goes up)
+ */
+extern void encfs_meta_set_length(dev_t dev, ino_t ino, off_t length, int grow);
+
+/* void encfs_meta_invalidate(dev_t dev, ino_t ino)
+ * Purpose: Forget what is known about the inode, its next lookup
+ *          reads the attribute and header again. Holds are kept, and
+ *          the generation counts up
+ */
+extern void encfs_meta_invalidate(dev_t dev, ino_t ino);
+
+/* void encfs_meta_invalidate_at(int dirfd, const char* path)
+ * Purpose: encfs_meta_invalidate() for the inode at path (relative to
+ *          dirfd, as for fstatat()), if any
+ */
+extern void encfs_meta_invalidate_at(int dirfd, const char* path);
+
+#endif
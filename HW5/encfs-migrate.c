@@ -0,0 +1,605 @@
+/* encfs-migrate.c
+ * Background encryption of the plain files in a mounted mirror directory
+ *
+ * By Shane Sarnac
+ *
+ * See encfs-migrate.h. The walker owns the workers: it starts them,
+ * feeds them paths through a bounded queue, and joins them once the
+ * queue has run dry, so encfs_migrate_stop() only has to join it.
+ */
+
+/* For O_TMPFILE and renameat2() */
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#include "encfs-block.h"
+#include "encfs-handle.h"
+#include "encfs-meta.h"
+#include "encfs-migrate.h"
+
+#define PROC_PATH_MAX 64
+#define MIGRATE_CHUNK (ENCFS_CHUNK_BLOCKS * ENCFS_BLOCK_SIZE)
+
+// set before encfs_migrate_start()
+static int mirror_fd = -1;
+static int threads;
+static double rate;			// bytes a second, all workers together
+
+static pthread_t walker;
+static int started = 0;
+
+// paths relative to mirror_fd, from the walker to the workers
+static char* queue[ENCFS_MIGRATE_QUEUE];
+static int head = 0;
+static int queued = 0;
+static int walked = 0;			// everything is queued
+static int stopping = 0;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+static long long next_read = 0;		// CLOCK_MONOTONIC ns, see throttle()
+static pthread_mutex_t throttle_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// totals, under queue_lock
+static int encrypted = 0;
+static int left_plain = 0;
+static int failed = 0;
+static long long encrypted_bytes = 0;
+
+void encfs_migrate_setup(int dir_fd, int n, unsigned int mb_per_sec)
+{
+	mirror_fd = dir_fd;
+	threads = n ? n : ENCFS_MIGRATE_THREADS;
+	if (threads > ENCFS_MIGRATE_MAX_THREADS)
+		threads = ENCFS_MIGRATE_MAX_THREADS;
+	rate = (double)(mb_per_sec ? mb_per_sec : ENCFS_MIGRATE_MB) * 1024 * 1024;
+}
+
+static int is_stopping(void)
+{
+	int res;
+
+	pthread_mutex_lock(&queue_lock);
+	res = stopping;
+	pthread_mutex_unlock(&queue_lock);
+	return res;
+}
+
+// Queue path, which the queue then owns. -1 once stopping
+static int push(char* path)
+{
+	pthread_mutex_lock(&queue_lock);
+	while (queued == ENCFS_MIGRATE_QUEUE && !stopping)
+		pthread_cond_wait(&queue_cond, &queue_lock);
+	if (stopping) {
+		pthread_mutex_unlock(&queue_lock);
+		free(path);
+		return -1;
+	}
+	queue[(head + queued) % ENCFS_MIGRATE_QUEUE] = path;
+	queued++;
+	pthread_cond_broadcast(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+	return 0;
+}
+
+// The next path for a worker, NULL once everything is done or stopping
+static char* pop(void)
+{
+	char* path = NULL;
+
+	pthread_mutex_lock(&queue_lock);
+	while (queued == 0 && !walked && !stopping)
+		pthread_cond_wait(&queue_cond, &queue_lock);
+	if (!stopping && queued > 0) {
+		path = queue[head];
+		head = (head + 1) % ENCFS_MIGRATE_QUEUE;
+		queued--;
+		pthread_cond_broadcast(&queue_cond);
+	}
+	pthread_mutex_unlock(&queue_lock);
+	return path;
+}
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Sleep until bytes more may be read. Every read books the next slot
+// after the last one, so the workers together keep to rate
+static void throttle(size_t bytes)
+{
+	struct timespec ts;
+	long long now, at;
+
+	pthread_mutex_lock(&throttle_lock);
+	now = now_ns();
+	if (next_read < now)
+		next_read = now;
+	at = next_read;
+	next_read += (long long)(bytes / rate * 1e9);
+	pthread_mutex_unlock(&throttle_lock);
+
+	if (at > now) {
+		ts.tv_sec = (at - now) / 1000000000LL;
+		ts.tv_nsec = (at - now) % 1000000000LL;
+		nanosleep(&ts, NULL);
+	}
+}
+
+// Whether the file open as fd still looks as it did in st. A rename
+// changes ctime too, so after the exchange only the data counts
+static int unchanged(int fd, const struct stat* st, int check_ctime)
+{
+	struct stat now;
+
+	if (fstat(fd, &now) == -1)
+		return 0;
+	if (now.st_size != st->st_size ||
+	    now.st_mtim.tv_sec != st->st_mtim.tv_sec ||
+	    now.st_mtim.tv_nsec != st->st_mtim.tv_nsec)
+		return 0;
+	return !check_ctime || (now.st_ctim.tv_sec == st->st_ctim.tv_sec &&
+				now.st_ctim.tv_nsec == st->st_ctim.tv_nsec);
+}
+
+// Encrypt the plaintext of src into tmp, a new block format file
+static int copy_encrypted(int src, int tmp, const struct stat* st,
+			  char* chunk, ctr_cipher* cipher)
+{
+	struct encfs_header hdr;
+	off_t pos;
+	ssize_t len;
+	int res;
+
+	res = encfs_header_init(&hdr);
+	if (res == 0)
+		res = encfs_header_write(tmp, &hdr);
+
+	for (pos = 0; res == 0 && pos < st->st_size; pos += len) {
+		if (is_stopping())
+			return -ECANCELED;
+		throttle(MIGRATE_CHUNK);
+		len = pread(src, chunk, MIGRATE_CHUNK, pos);
+		if (len == -1)
+			return -errno;
+		// it shrank, the check before the exchange will say so
+		if (len == 0)
+			break;
+		res = encfs_write_blocks(tmp, &hdr, chunk, len,
+					 pos / ENCFS_BLOCK_SIZE, cipher);
+		if (res > 0)
+			res = 0;
+	}
+
+	// the mount's own reads need the page cache more than we do
+	posix_fadvise(src, 0, 0, POSIX_FADV_DONTNEED);
+	return res;
+}
+
+// Copy src's extended attributes to tmp, ACLs among them. -EBUSY if
+// one can not be set, the file then stays plain rather than lose it
+static int copy_xattrs(int src, int tmp)
+{
+	char names[XATTR_LIST_MAX];
+	char* value = NULL;
+	char* old = NULL;
+	const char* name;
+	ssize_t list, len, old_len;
+	int res = 0;
+
+	list = flistxattr(src, names, sizeof(names));
+	if (list == -1)
+		return (errno == ENOTSUP) ? 0 : -errno;
+	value = malloc(XATTR_SIZE_MAX);
+	old = malloc(XATTR_SIZE_MAX);
+	if (value == NULL || old == NULL) {
+		res = -ENOMEM;
+		goto out;
+	}
+
+	for (name = names; name < names + list; name += strlen(name) + 1) {
+		if (strcmp(name, "user.encfs") == 0)
+			continue;
+		len = fgetxattr(src, name, value, XATTR_SIZE_MAX);
+		if (len == -1) {
+			res = -errno;
+			break;
+		}
+		// one the new file got anyway (an SELinux label) may need no change
+		old_len = fgetxattr(tmp, name, old, XATTR_SIZE_MAX);
+		if (old_len == len && memcmp(old, value, len) == 0)
+			continue;
+		if (fsetxattr(tmp, name, value, len, 0) == -1) {
+			res = (errno == EPERM || errno == EACCES || errno == ENOTSUP)
+			      ? -EBUSY : -errno;
+			break;
+		}
+	}
+
+out:
+	free(value);
+	free(old);
+	return res;
+}
+
+// Give tmp what stat and the mount need from the original, then sync it
+static int finish_copy(int src, int tmp, const struct stat* st)
+{
+	struct timespec times[2];
+	int res;
+
+	if (fsetxattr(tmp, "user.encfs", "true", 5*sizeof(char), 0) == -1)
+		return -errno;
+	// only root can give a file away; one that is not ours stays plain
+	// rather than change owner
+	if (fchown(tmp, st->st_uid, st->st_gid) == -1)
+		return (errno == EPERM) ? -EBUSY : -errno;
+	// after the chown, which drops file capabilities
+	res = copy_xattrs(src, tmp);
+	if (res < 0)
+		return res;
+	if (fchmod(tmp, st->st_mode & 07777) == -1)
+		return -errno;
+	times[0] = st->st_atim;
+	times[1] = st->st_mtim;
+	if (futimens(tmp, times) == -1)
+		return -errno;
+	if (fsync(tmp) == -1)
+		return -errno;
+	return 0;
+}
+
+// Encrypt the file at path. Returns 1 when it was, 0 if it needs
+// nothing, -EBUSY if it has to stay plain for now, or -errno
+static int migrate_file(const char* path, char* chunk, ctr_cipher* cipher)
+{
+	struct stat st, swapped;
+	struct encfs_meta meta;
+	char dir[PATH_MAX], temp[PATH_MAX], proc[PROC_PATH_MAX];
+	const char* slash;
+	int src, tmp = -1, linked = 0, claimed = 0, res;
+
+	src = openat(mirror_fd, path, O_RDONLY | O_NOFOLLOW);
+	if (src == -1)
+		return (errno == ENOENT) ? 0 : -errno;
+	if (fstat(src, &st) == -1) {
+		res = -errno;
+		goto out;
+	}
+	res = 0;
+	if (!S_ISREG(st.st_mode))
+		goto out;
+	res = encfs_meta_get(AT_FDCWD, NULL, src, &st, &meta, 0);
+	if (res < 0 || meta.format != ENCFS_FORMAT_PLAIN)
+		goto out;
+	// another name would keep the plaintext, and the exchange only
+	// replaces this one
+	res = -EBUSY;
+	if (st.st_nlink != 1)
+		goto out;
+
+	// in the file's own directory, so the exchange is one rename
+	slash = strrchr(path, '/');
+	if (slash)
+		snprintf(dir, sizeof(dir), "%.*s", (int)(slash - path), path);
+	else
+		strcpy(dir, ".");
+	if (snprintf(temp, sizeof(temp), "%s/%s%ld-%lu", dir, ENCFS_MIGRATE_PREFIX,
+		     (long)getpid(), (unsigned long)st.st_ino) >= (int)sizeof(temp)) {
+		res = -ENAMETOOLONG;
+		goto out;
+	}
+
+	tmp = openat(mirror_fd, dir, O_TMPFILE | O_RDWR, st.st_mode & 0777);
+	if (tmp == -1) {
+		res = -errno;
+		goto out;
+	}
+	res = copy_encrypted(src, tmp, &st, chunk, cipher);
+	if (res == 0)
+		res = finish_copy(src, tmp, &st);
+	if (res < 0)
+		goto out;
+
+	// it needs a name to be exchanged
+	snprintf(proc, sizeof(proc), "/proc/self/fd/%d", tmp);
+	if (linkat(AT_FDCWD, proc, mirror_fd, temp, AT_SYMLINK_FOLLOW) == -1) {
+		res = -errno;
+		goto out;
+	}
+	linked = 1;
+
+	// from here to the exchange no handle may open the original, and
+	// nothing may have changed it since it was read
+	res = encfs_meta_claim(st.st_dev, st.st_ino);
+	if (res < 0)
+		goto out;
+	claimed = 1;
+	res = -EBUSY;
+	if (!unchanged(src, &st, 1))
+		goto out;
+
+	if (renameat2(mirror_fd, temp, mirror_fd, path, RENAME_EXCHANGE) == -1) {
+		res = -errno;
+		if (errno != EINVAL)
+			goto out;
+		// no exchange on this file system, the check above has to do
+		if (renameat(mirror_fd, temp, mirror_fd, path) == -1) {
+			res = -errno;
+			goto out;
+		}
+		linked = 0;
+	}
+	else if (fstatat(mirror_fd, temp, &swapped, AT_SYMLINK_NOFOLLOW) == -1 ||
+		 swapped.st_dev != st.st_dev || swapped.st_ino != st.st_ino ||
+		 !unchanged(src, &st, 0) ||
+		 encfs_meta_waiting(st.st_dev, st.st_ino)) {
+		// the name or the file changed during the exchange, or someone
+		// opened it and waits for the claim: put it back as it was
+		if (renameat2(mirror_fd, temp, mirror_fd, path, RENAME_EXCHANGE) == -1) {
+			res = -errno;
+			linked = 0;
+		}
+		goto out;
+	}
+
+	// the plaintext goes before the claim ends, a create that truncated
+	// it meanwhile then sees it unlinked (see encfs_handle_create())
+	if (linked && unlinkat(mirror_fd, temp, 0) == -1)
+		fprintf(stderr, "Could not remove %s: %s\n", temp, strerror(errno));
+	linked = 0;
+	encfs_meta_unclaim(st.st_dev, st.st_ino, 1);
+	claimed = 0;
+	res = 1;
+
+	pthread_mutex_lock(&queue_lock);
+	encrypted_bytes += st.st_size;
+	pthread_mutex_unlock(&queue_lock);
+
+out:
+	if (claimed)
+		encfs_meta_unclaim(st.st_dev, st.st_ino, 0);
+	if (linked)
+		unlinkat(mirror_fd, temp, 0);
+	if (tmp != -1)
+		close(tmp);
+	close(src);
+	return res;
+}
+
+static void* migrate_worker(void* arg)
+{
+	ctr_cipher* cipher = encfs_thread_cipher();
+	char* chunk = malloc(MIGRATE_CHUNK);
+	char* path;
+	int res;
+
+	(void) arg;
+
+	while ((path = pop()) != NULL) {
+		res = (cipher && chunk) ? migrate_file(path, chunk, cipher) : -ENOMEM;
+
+		pthread_mutex_lock(&queue_lock);
+		if (res == 1)
+			encrypted++;
+		else if (res == -EBUSY)
+			left_plain++;
+		else if (res < 0 && res != -ECANCELED)
+			failed++;
+		pthread_mutex_unlock(&queue_lock);
+
+		if (res < 0 && res != -EBUSY && res != -ECANCELED)
+			fprintf(stderr, "Could not encrypt %s: %s\n", path, strerror(-res));
+		free(path);
+	}
+
+	free(chunk);
+	return NULL;
+}
+
+// dir/name, or name in the mirror directory itself. NULL if too long
+static char* join(const char* dir, const char* name)
+{
+	char* path;
+
+	path = malloc(PATH_MAX);
+	if (path == NULL)
+		return NULL;
+	if (snprintf(path, PATH_MAX, "%s%s%s", strcmp(dir, ".") ? dir : "",
+		     strcmp(dir, ".") ? "/" : "", name) >= PATH_MAX) {
+		free(path);
+		return NULL;
+	}
+	return path;
+}
+
+// Whether the file name in dirfd has the user.encfs attribute
+static int encrypted_at(int dirfd, const char* name)
+{
+	char value[6];
+	ssize_t len;
+	int fd;
+
+	fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW);
+	if (fd == -1)
+		return 0;
+	len = fgetxattr(fd, "user.encfs", value, sizeof(value) - 1);
+	close(fd);
+	if (len < 0)
+		return 0;
+	value[len] = '\0';
+	return strcmp(value, "true") == 0;
+}
+
+// Whether name is a temp file's, exactly <prefix><pid>-<ino>
+static int temp_name(const char* name, long* pid, unsigned long* ino)
+{
+	size_t len = strlen(ENCFS_MIGRATE_PREFIX);
+	char* end;
+
+	if (strncmp(name, ENCFS_MIGRATE_PREFIX, len) != 0 || !isdigit(name[len]))
+		return 0;
+	errno = 0;
+	*pid = strtol(name + len, &end, 10);
+	if (errno || *pid <= 0 || *end != '-' || !isdigit(end[1]))
+		return 0;
+	*ino = strtoul(end + 1, &end, 10);
+	return !errno && *end == '\0';
+}
+
+// Whether the temp file name in dirfd was left by a migration that did
+// not finish: its process is gone, and it is either the encrypted copy
+// (it has user.encfs) or the plaintext that copy replaced (inode ino)
+static int stale_temp(int dirfd, const char* name, long pid, unsigned long ino)
+{
+	struct stat st;
+
+	if (pid == (long)getpid() || kill(pid, 0) == 0 || errno != ESRCH)
+		return 0;
+	if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == -1 ||
+	    !S_ISREG(st.st_mode))
+		return 0;
+	return st.st_ino == ino || encrypted_at(dirfd, name);
+}
+
+// Queue every regular file under dir, depth first. -1 once stopping
+static int walk(const char* dir)
+{
+	struct dirent* de;
+	struct stat st;
+	unsigned long ino;
+	char* path;
+	long pid;
+	DIR* dp;
+	int fd, type, res = 0;
+
+	fd = openat(mirror_fd, dir, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if (fd == -1)
+		return 0;
+	dp = fdopendir(fd);
+	if (dp == NULL) {
+		close(fd);
+		return 0;
+	}
+
+	while (res == 0 && (de = readdir(dp)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+		type = de->d_type;
+		if (type == DT_UNKNOWN) {
+			if (fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+				continue;
+			type = S_ISDIR(st.st_mode) ? DT_DIR :
+			       S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+		}
+		if (type != DT_DIR && type != DT_REG)
+			continue;
+
+		path = join(dir, de->d_name);
+		if (path == NULL)
+			continue;
+		if (type == DT_DIR) {
+			res = walk(path);
+			free(path);
+		}
+		else if (temp_name(de->d_name, &pid, &ino)) {
+			// one of another mount's, or of ours mid-exchange, is
+			// left alone
+			if (stale_temp(fd, de->d_name, pid, ino))
+				unlinkat(mirror_fd, path, 0);
+			free(path);
+		}
+		else {
+			res = push(path);
+		}
+	}
+
+	closedir(dp);
+	return res;
+}
+
+static void* migrate_walker(void* arg)
+{
+	pthread_t workers[ENCFS_MIGRATE_MAX_THREADS];
+	int i, n;
+
+	(void) arg;
+
+	for (n = 0; n < threads; n++)
+		if (pthread_create(&workers[n], NULL, migrate_worker, NULL) != 0)
+			break;
+	if (n > 0)
+		walk(".");
+	else
+		fprintf(stderr, "Could not start migration workers\n");
+
+	pthread_mutex_lock(&queue_lock);
+	walked = 1;
+	pthread_cond_broadcast(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+
+	for (i = 0; i < n; i++)
+		pthread_join(workers[i], NULL);
+
+	pthread_mutex_lock(&queue_lock);
+	printf("Migration %s: %d files encrypted (%lld MB), %d left plain, %d failed\n",
+	       stopping ? "stopped" : "done", encrypted, encrypted_bytes >> 20,
+	       left_plain, failed);
+	pthread_mutex_unlock(&queue_lock);
+	fflush(stdout);
+	return NULL;
+}
+
+void encfs_migrate_start(void)
+{
+	if (mirror_fd == -1 || started)
+		return;
+	stopping = 0;
+	walked = 0;
+	encrypted = left_plain = failed = 0;
+	encrypted_bytes = 0;
+	if (pthread_create(&walker, NULL, migrate_walker, NULL) != 0) {
+		fprintf(stderr, "Could not start migration\n");
+		return;
+	}
+	started = 1;
+}
+
+void encfs_migrate_stop(void)
+{
+	if (!started)
+		return;
+
+	pthread_mutex_lock(&queue_lock);
+	stopping = 1;
+	pthread_cond_broadcast(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+	pthread_join(walker, NULL);
+	started = 0;
+
+	// paths the workers never got to
+	while (queued > 0) {
+		free(queue[head]);
+		head = (head + 1) % ENCFS_MIGRATE_QUEUE;
+		queued--;
+	}
+}
@@ -0,0 +1,57 @@
+/* encfs-migrate.h
+ * Background encryption of the plain files in a mounted mirror directory
+ *
+ * By Shane Sarnac
+ *
+ * A walker thread lists the mirror directory while it is mounted and
+ * queues every regular file; a pool of workers encrypts the ones
+ * without the user.encfs attribute into the block format
+ * (encfs-block.h). Each file is encrypted into an unnamed temp file in
+ * its own directory, which gets the attribute, the file's mode, owner,
+ * extended attributes and times and is synced, and then exchanged with
+ * the original in one rename. The original is claimed in the metadata
+ * cache (encfs-meta.h) around the exchange, so no handle is open on it
+ * and none opens it meanwhile. Files that are open, were changed during
+ * the copy, have other hard links, or whose owner or attributes the
+ * process can not give the copy are left plain, for the next mount to
+ * try again. Temp files a mount that is gone left behind are removed.
+ *
+ * Between them the workers read at most a set number of MB a second,
+ * so the migration does not starve the mount's own I/O.
+ */
+
+#ifndef ENCFS_MIGRATE_H
+#define ENCFS_MIGRATE_H
+
+/* Default workers and read rate */
+#define ENCFS_MIGRATE_THREADS 2
+#define ENCFS_MIGRATE_MAX_THREADS 16
+#define ENCFS_MIGRATE_MB 32
+/* Paths queued ahead of the workers */
+#define ENCFS_MIGRATE_QUEUE 64
+/* Names a file has between the copy and the exchange */
+#define ENCFS_MIGRATE_PREFIX ".encfs-migrate-"
+
+/* void encfs_migrate_setup(int mirror_fd, int threads,
+ *                          unsigned int mb_per_sec)
+ * Purpose: Have encfs_migrate_start() migrate the directory open as
+ *          mirror_fd with threads workers (0 = ENCFS_MIGRATE_THREADS)
+ *          reading at most mb_per_sec MB a second (0 = ENCFS_MIGRATE_MB).
+ *          encfs_handle_setup() must have been called
+ */
+extern void encfs_migrate_setup(int mirror_fd, int threads,
+				unsigned int mb_per_sec);
+
+/* void encfs_migrate_start(void)
+ * Purpose: Start migrating in the background, if set up. Call it from
+ *          the mount's init callback, after FUSE has forked
+ */
+extern void encfs_migrate_start(void);
+
+/* void encfs_migrate_stop(void)
+ * Purpose: Stop migrating and wait for the threads. A file still being
+ *          copied is dropped, the original stays as it was
+ */
+extern void encfs_migrate_stop(void);
+
+#endif
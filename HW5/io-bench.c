@@ -0,0 +1,454 @@
+/* io-bench.c
+ * File system I/O patterns, timed in any directory
+ *
+ * By Shane Sarnac
+ *
+ * Runs each scenario below in <dir> and prints one CSV line per scenario:
+ *	label,scenario,MB/s,IOPS,p99 latency in microseconds
+ * where an operation is one read(), write(), create, stat(), unlink() or
+ * readdir() call. io-bench.sh points it at a raw directory, a fusexmp
+ * mirror and pa5-encfs mounts of the same disk.
+ *
+ *	seq_write	<MB> megabyte file in 1MB writes, then fsync()
+ *	seq_read	the same file in 1MB reads
+ *	rand_write	4KB writes at random 4KB offsets in it, then fsync()
+ *	rand_read	4KB reads at random 4KB offsets
+ *	churn		create and write 4KB, stat() and unlink() small files
+ *	readdir		list a directory of <entries> files
+ *	par_read	one reader thread per CPU, each on its own file
+ *
+ * Reads first drop the file's pages with posix_fadvise(), so they come
+ * from the file system, not the page cache above it. A FUSE mount's
+ * backing files may still be cached below it.
+ *
+ * usage: io-bench <label> <dir> [MB] [entries]
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#define SEQ_BLOCK (1024 * 1024)
+#define SMALL_BLOCK 4096
+#define RAND_OPS 8192
+#define CHURN_FILES 2000
+#define DIR_ENTRIES 100000
+
+static const char* label;
+static const char* dir;
+static char* buf;
+
+struct latencies {
+    double* us;
+    long n;
+    long max;
+};
+
+/* one reader of par_read */
+struct reader {
+    char path[1024];
+    long long bytes;
+    struct latencies lat;
+};
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void die(const char* what)
+{
+    perror(what);
+    exit(EXIT_FAILURE);
+}
+
+static void lat_init(struct latencies* lat, long max)
+{
+    lat->us = malloc(max * sizeof(double));
+    if(!lat->us){
+	die("malloc");
+    }
+    lat->n = 0;
+    lat->max = max;
+}
+
+static void lat_add(struct latencies* lat, double start)
+{
+    if(lat->n == lat->max){
+	lat->max *= 2;
+	lat->us = realloc(lat->us, lat->max * sizeof(double));
+	if(!lat->us){
+	    die("realloc");
+	}
+    }
+    lat->us[lat->n++] = (now() - start) * 1e6;
+}
+
+static int cmp_double(const void* a, const void* b)
+{
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+
+    return (x > y) - (x < y);
+}
+
+/* prints the CSV line and frees lat */
+static void report(const char* scenario, double seconds, long long bytes,
+		   struct latencies* lat)
+{
+    double p99 = 0;
+
+    if(lat->n > 0){
+	qsort(lat->us, lat->n, sizeof(double), cmp_double);
+	p99 = lat->us[(lat->n * 99 + 99) / 100 - 1];
+    }
+    printf("%s,%s,%.1f,%.0f,%.1f\n", label, scenario,
+	   bytes / seconds / 1e6, lat->n / seconds, p99);
+    fflush(stdout);
+    free(lat->us);
+}
+
+static void drop_cache(int fd)
+{
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+static void seq_write(const char* path, long long bytes)
+{
+    struct latencies lat;
+    long long done;
+    double start, t;
+    int fd;
+
+    lat_init(&lat, bytes / SEQ_BLOCK + 1);
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0){
+	die(path);
+    }
+
+    start = now();
+    for(done = 0; done < bytes; done += SEQ_BLOCK){
+	t = now();
+	if(write(fd, buf, SEQ_BLOCK) != SEQ_BLOCK){
+	    die("write");
+	}
+	lat_add(&lat, t);
+    }
+    if(fsync(fd) < 0){
+	die("fsync");
+    }
+    report("seq_write", now() - start, bytes, &lat);
+    close(fd);
+}
+
+static long long seq_read_file(const char* path, char* into,
+			       struct latencies* lat)
+{
+    long long done = 0;
+    ssize_t n;
+    double t;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if(fd < 0){
+	die(path);
+    }
+    drop_cache(fd);
+    for(;;){
+	t = now();
+	n = read(fd, into, SEQ_BLOCK);
+	if(n < 0){
+	    die("read");
+	}
+	lat_add(lat, t);
+	if(n == 0){
+	    break;
+	}
+	done += n;
+    }
+    close(fd);
+    return done;
+}
+
+static void seq_read(const char* path, long long bytes)
+{
+    struct latencies lat;
+    double start;
+    long long done;
+
+    lat_init(&lat, bytes / SEQ_BLOCK + 2);
+    start = now();
+    done = seq_read_file(path, buf, &lat);
+    report("seq_read", now() - start, done, &lat);
+}
+
+static void rand_io(const char* path, long long bytes, int writing)
+{
+    struct latencies lat;
+    long long blocks = bytes / SMALL_BLOCK;
+    off_t off;
+    double start, t;
+    ssize_t n;
+    int fd;
+    int i;
+
+    lat_init(&lat, RAND_OPS);
+    fd = open(path, writing ? O_WRONLY : O_RDONLY);
+    if(fd < 0){
+	die(path);
+    }
+    if(!writing){
+	drop_cache(fd);
+    }
+
+    start = now();
+    for(i = 0; i < RAND_OPS; i++){
+	off = (off_t)(random() % blocks) * SMALL_BLOCK;
+	t = now();
+	if(writing){
+	    n = pwrite(fd, buf, SMALL_BLOCK, off);
+	}
+	else{
+	    n = pread(fd, buf, SMALL_BLOCK, off);
+	}
+	if(n != SMALL_BLOCK){
+	    die(writing ? "pwrite" : "pread");
+	}
+	lat_add(&lat, t);
+    }
+    if(writing && fsync(fd) < 0){
+	die("fsync");
+    }
+    report(writing ? "rand_write" : "rand_read", now() - start,
+	   (long long)RAND_OPS * SMALL_BLOCK, &lat);
+    close(fd);
+}
+
+static void churn(void)
+{
+    struct latencies lat;
+    struct stat st;
+    char path[1024];
+    double start, t;
+    int fd;
+    int i;
+
+    lat_init(&lat, 3 * CHURN_FILES);
+    start = now();
+    for(i = 0; i < CHURN_FILES; i++){
+	snprintf(path, sizeof(path), "%s/churn.%d", dir, i);
+	t = now();
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0 || write(fd, buf, SMALL_BLOCK) != SMALL_BLOCK || close(fd) < 0){
+	    die(path);
+	}
+	lat_add(&lat, t);
+    }
+    for(i = 0; i < CHURN_FILES; i++){
+	snprintf(path, sizeof(path), "%s/churn.%d", dir, i);
+	t = now();
+	if(stat(path, &st) < 0){
+	    die(path);
+	}
+	lat_add(&lat, t);
+    }
+    for(i = 0; i < CHURN_FILES; i++){
+	snprintf(path, sizeof(path), "%s/churn.%d", dir, i);
+	t = now();
+	if(unlink(path) < 0){
+	    die(path);
+	}
+	lat_add(&lat, t);
+    }
+    report("churn", now() - start, (long long)CHURN_FILES * SMALL_BLOCK, &lat);
+}
+
+static void list_dir(int entries)
+{
+    struct latencies lat;
+    struct dirent* de;
+    char sub[1024];
+    char path[1100];
+    double start, t;
+    DIR* dp;
+    int fd;
+    int i;
+
+    /* untimed: fill the directory */
+    snprintf(sub, sizeof(sub), "%s/readdir", dir);
+    if(mkdir(sub, 0755) < 0){
+	die(sub);
+    }
+    for(i = 0; i < entries; i++){
+	snprintf(path, sizeof(path), "%s/%d", sub, i);
+	fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if(fd < 0){
+	    die(path);
+	}
+	close(fd);
+    }
+
+    lat_init(&lat, entries + 3);
+    start = now();
+    dp = opendir(sub);
+    if(!dp){
+	die(sub);
+    }
+    for(;;){
+	t = now();
+	de = readdir(dp);
+	lat_add(&lat, t);
+	if(!de){
+	    break;
+	}
+    }
+    closedir(dp);
+    report("readdir", now() - start, 0, &lat);
+
+    for(i = 0; i < entries; i++){
+	snprintf(path, sizeof(path), "%s/%d", sub, i);
+	unlink(path);
+    }
+    rmdir(sub);
+}
+
+static void* reader_run(void* arg)
+{
+    struct reader* r = arg;
+    char* into = malloc(SEQ_BLOCK);
+
+    if(!into){
+	die("malloc");
+    }
+    r->bytes = seq_read_file(r->path, into, &r->lat);
+    free(into);
+    return NULL;
+}
+
+static void par_read(long long bytes)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    long long each = bytes / n / SEQ_BLOCK * SEQ_BLOCK;
+    struct reader* readers;
+    struct latencies lat;
+    pthread_t* threads;
+    long long done = 0;
+    long long written;
+    double start;
+    long i, j;
+    int fd;
+
+    if(each == 0){
+	each = SEQ_BLOCK;
+    }
+    readers = calloc(n, sizeof(*readers));
+    threads = calloc(n, sizeof(*threads));
+    if(!readers || !threads){
+	die("calloc");
+    }
+    for(i = 0; i < n; i++){
+	snprintf(readers[i].path, sizeof(readers[i].path), "%s/par.%ld", dir, i);
+	fd = open(readers[i].path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0){
+	    die(readers[i].path);
+	}
+	for(written = 0; written < each; written += SEQ_BLOCK){
+	    if(write(fd, buf, SEQ_BLOCK) != SEQ_BLOCK){
+		die("write");
+	    }
+	}
+	if(fsync(fd) < 0 || close(fd) < 0){
+	    die(readers[i].path);
+	}
+	lat_init(&readers[i].lat, each / SEQ_BLOCK + 2);
+    }
+
+    start = now();
+    for(i = 0; i < n; i++){
+	if(pthread_create(&threads[i], NULL, reader_run, &readers[i]) != 0){
+	    die("pthread_create");
+	}
+    }
+    for(i = 0; i < n; i++){
+	pthread_join(threads[i], NULL);
+    }
+    start = now() - start;
+
+    lat_init(&lat, n * (each / SEQ_BLOCK + 2));
+    for(i = 0; i < n; i++){
+	done += readers[i].bytes;
+	for(j = 0; j < readers[i].lat.n; j++){
+	    lat.us[lat.n++] = readers[i].lat.us[j];
+	}
+	free(readers[i].lat.us);
+	unlink(readers[i].path);
+    }
+    report("par_read", start, done, &lat);
+
+    free(threads);
+    free(readers);
+}
+
+int main(int argc, char **argv)
+{
+    char path[1024];
+    long long bytes;
+    int mb = 256;
+    int entries = DIR_ENTRIES;
+    int i;
+
+    if(argc < 3 || argc > 5){
+	fprintf(stderr, "usage: %s <label> <dir> [MB] [entries]\n", argv[0]);
+	exit(EXIT_FAILURE);
+    }
+    label = argv[1];
+    dir = argv[2];
+    if(argc >= 4){
+	mb = atoi(argv[3]);
+    }
+    if(argc == 5){
+	entries = atoi(argv[4]);
+    }
+    if(mb <= 0 || entries < 0){
+	fprintf(stderr, "MB must be positive and entries not negative\n");
+	exit(EXIT_FAILURE);
+    }
+    bytes = (long long)mb * 1024 * 1024;
+
+    /* incompressible, and the same on every run */
+    buf = malloc(SEQ_BLOCK);
+    if(!buf){
+	die("malloc");
+    }
+    srandom(3753);
+    for(i = 0; i < SEQ_BLOCK; i++){
+	buf[i] = random();
+    }
+
+    snprintf(path, sizeof(path), "%s/seq", dir);
+    seq_write(path, bytes);
+    seq_read(path, bytes);
+    rand_io(path, bytes, 1);
+    rand_io(path, bytes, 0);
+    unlink(path);
+
+    churn();
+    if(entries > 0){
+	list_dir(entries);
+    }
+    par_read(bytes);
+
+    free(buf);
+    return EXIT_SUCCESS;
+}
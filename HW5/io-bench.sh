@@ -0,0 +1,64 @@
+#!/bin/bash
+# File: io-bench.sh
+# Author: Shane Sarnac
+# Project: CSCI 3753 Programming Assignment 5
+# Description:
+#	Runs io-bench (sequential and random 4KB I/O, small file churn,
+#	a directory listing and parallel readers) on the same disk four
+#	ways, and prints one CSV with a line per target and scenario:
+#		raw		a plain directory in the scratch directory
+#		fusexmp		the same, through the reference fusexmp mirror
+#		pa5-encfs	a pa5-encfs mount with its default options
+#		pa5-encfs-ll	a pa5-encfs mount with -o lowlevel
+#	Every target gets a fresh, empty directory.
+#
+# Usage: ./io-bench.sh [scratch dir] [MB] [entries] > io-bench.csv
+#	MB is the sequential file size (default 256), entries the size
+#	of the listed directory (default 100000).
+
+SCRATCH=${1:-/tmp}
+MB=${2:-256}
+ENTRIES=${3:-100000}
+KEY=io-bench
+
+for bin in ./io-bench ./fusexmp ./pa5-encfs; do
+	if [ ! -x $bin ]; then
+		echo "$bin not built, run make fs-bench" >&2
+		exit 1
+	fi
+done
+
+WORK=$(mktemp -d "$(realpath "$SCRATCH")/io-bench.XXXXXX")
+MOUNT="$WORK/mnt"
+mkdir "$MOUNT"
+
+cleanup() {
+	fusermount -u "$MOUNT" 2>/dev/null
+	rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+bench() {
+	./io-bench "$1" "$2" $MB $ENTRIES || exit 1
+}
+
+echo "target,scenario,MB/s,IOPS,p99_us"
+
+mkdir "$WORK/raw"
+bench raw "$WORK/raw"
+
+# fusexmp mirrors / at the mount point
+mkdir "$WORK/xmp"
+./fusexmp "$MOUNT" || exit 1
+bench fusexmp "$MOUNT$WORK/xmp"
+fusermount -u "$MOUNT" || exit 1
+
+mkdir "$WORK/encfs"
+./pa5-encfs $KEY "$WORK/encfs" "$MOUNT" > /dev/null || exit 1
+bench pa5-encfs "$MOUNT"
+fusermount -u "$MOUNT" || exit 1
+
+mkdir "$WORK/encfs-ll"
+./pa5-encfs -o lowlevel $KEY "$WORK/encfs-ll" "$MOUNT" > /dev/null || exit 1
+bench pa5-encfs-ll "$MOUNT"
+fusermount -u "$MOUNT" || exit 1
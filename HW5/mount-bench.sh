@@ -0,0 +1,117 @@
+#!/bin/bash
+# File: mount-bench.sh
+# Author: Shane Sarnac
+# Project: CSCI 3753 Programming Assignment 5
+# Description:
+#	Sequential throughput of a pa5-encfs mount, with the default
+#	mount tuning (auto_cache, big_writes, max_write and
+#	max_readahead of 128KB) and with -o no_tuning (stock FUSE
+#	options). Each run mounts a fresh mirror directory in the
+#	scratch directory, writes an MB megabyte file with dd, remounts,
+#	and reads it back twice: once cold, and once more while the
+#	kernel may still hold its pages.
+#	Then READERS files of MB/READERS megabytes each are read by
+#	READERS dd processes at once, through the default multithreaded
+#	loop and through a single threaded (-s) mount, for the aggregate
+#	cold read rate.
+#
+# Usage: ./mount-bench.sh [scratch dir] [MB]
+# Tunables (environment): BS (dd block size, default 1M)
+#	READERS (parallel readers, default one per CPU)
+
+SCRATCH=${1:-/tmp}
+MB=${2:-256}
+BS=${BS:-1M}
+READERS=${READERS:-$(nproc)}
+KEY=mount-bench
+
+BIN=./pa5-encfs
+if [ ! -x $BIN ]; then
+	echo "$BIN not built, run make" >&2
+	exit 1
+fi
+
+WORK=$(mktemp -d "$SCRATCH/mount-bench.XXXXXX")
+MIRROR="$WORK/mirror"
+MOUNT="$WORK/mnt"
+mkdir "$MIRROR" "$MOUNT"
+
+cleanup() {
+	fusermount -u "$MOUNT" 2>/dev/null
+	rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+do_mount() {
+	$BIN "$@" $KEY "$MIRROR" "$MOUNT" || exit 1
+}
+
+do_umount() {
+	fusermount -u "$MOUNT" || exit 1
+}
+
+# dd's rate, the last field of its summary line
+rate() {
+	LC_ALL=C dd "$@" 2>&1 | tail -n 1 | awk -F, '{ print $NF }'
+}
+
+run() {
+	local name=$1
+	shift
+
+	rm -rf "$MIRROR"/*
+	do_mount "$@"
+	write=$(rate if=/dev/zero of="$MOUNT/seq" bs=$BS \
+		count=$((MB * 1024 * 1024)) iflag=count_bytes conv=fsync)
+	do_umount
+
+	do_mount "$@"
+	cold=$(rate if="$MOUNT/seq" of=/dev/null bs=$BS)
+	warm=$(rate if="$MOUNT/seq" of=/dev/null bs=$BS)
+	do_umount
+
+	printf "%-12s write %12s   cold read %12s   warm read %12s\n" \
+		"$name" "$write" "$cold" "$warm"
+}
+
+now() {
+	date +%s.%N
+}
+
+# READERS readers of READERS files at once
+parallel() {
+	local name=$1
+	local size=$((MB * 1024 * 1024 / READERS))
+	local start end i
+	shift
+
+	rm -rf "$MIRROR"/*
+	do_mount "$@"
+	for ((i = 0; i < READERS; i++)); do
+		dd if=/dev/urandom of="$MOUNT/par$i" bs=$BS count=$size \
+			iflag=count_bytes 2>/dev/null
+	done
+	do_umount
+
+	do_mount "$@"
+	start=$(now)
+	for ((i = 0; i < READERS; i++)); do
+		dd if="$MOUNT/par$i" of=/dev/null bs=$BS 2>/dev/null &
+	done
+	wait
+	end=$(now)
+	do_umount
+
+	awk -v name="$name" -v n=$READERS -v bytes=$((size * READERS)) \
+		-v start=$start -v end=$end 'BEGIN {
+		printf "%-12s %d readers %10.1f MB/s\n", name, n,
+			bytes / (end - start) / 1e6 }'
+}
+
+echo "$MB MB, bs=$BS"
+run no_tuning -o no_tuning
+run default
+
+echo "$READERS parallel readers, $MB MB in total"
+parallel single -s
+parallel threaded
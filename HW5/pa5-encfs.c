@@ -12,13 +12,25 @@
 
   gcc -Wall `pkg-config fuse --cflags` fusexmp.c -o fusexmp `pkg-config fuse --libs`
 
-  Note: This implementation is largely stateless and does not maintain
-        open file handels between open and release calls (fi->fh).
-        Instead, files are opened and closed as necessary inside read(), write(),
-        etc calls. As such, the functions that rely on maintaining file handles are
-        not implmented (fgetattr(), etc). Those seeking a more efficient and
-        more complete implementation may wish to add fi->fh support to minimize
-        open() and close() calls and support fh dependent functions.
+  Note: open() and create() keep the backing file open in a per-handle
+        struct encfs_handle (encfs-handle.h, in fi->fh) until release().
+        For encrypted files the handle also holds a cache of decrypted
+        blocks; cached writes reach the backing file on flush(), fsync()
+        and release(), and whenever a chunk of whole blocks has filled
+        up. fsync() then also syncs the backing file. Path based calls
+        such as truncate() still open the file themselves and do not
+        see other handles' caches.
+
+        Safe for FUSE's multithreaded loop: the globals below are only
+        written in main() before fuse_main(), and encfs-handle.h locks
+        each handle and gives every thread its own cipher context.
+
+        -o lowlevel mounts the inode based front end in encfs-ll.c
+        instead of the callbacks here.
+
+        -o migrate encrypts the mirror's plain files in background
+        threads while it is mounted (encfs-migrate.h), started from
+        init() once FUSE has forked.
 
 */
 
@@ -30,8 +42,8 @@
 #endif
 
 #ifdef linux
-/* For pread()/pwrite() */
-#define _XOPEN_SOURCE 500
+/* For pread()/pwrite() and the *at() calls */
+#define _XOPEN_SOURCE 700
 #define ENCRYPT 1
 #define DECRYPT 0
 #define PASS_THROUGH -1
@@ -46,45 +58,47 @@
 #include <errno.h>
 #include <sys/time.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+#include <pthread.h>
 #ifdef HAVE_SETXATTR
 #include <sys/xattr.h>
 #endif
 
+#include <openssl/rand.h>
+
 #include "aes-crypt.h"
+#include "encfs-handle.h"
+#include "encfs-ll.h"
+#include "encfs-meta.h"
+#include "encfs-migrate.h"
+
+// set in main(), read-only once fuse_main() runs
+static char debug = 0;
+static char * mirror_dir = NULL;
+static int mirror_fd = -1;		// mirror_dir, every path is looked up from it
+static char * mount_point = NULL;
+static crypt_key mount_key;		// derived once in main(), never per call
 
-char debug = 0;
-char * mirror_dir = NULL;
-char * mount_point = NULL;
-char * key_phrase = NULL;
 const char * log_file_path = "/media/storage/Documents/College/Computer Programming/CSCI-3753/HW5/Test/logfile.txt";
 
-// returns 1 if the file at file_location has a user.encfs attribute set to true
-// returns 0 otherwise
-char is_encrypted(const char* file_location) {
-	char file_attributes[5];
-	getxattr(file_location, "user.encfs", file_attributes, 5*sizeof(char));
-	
-	return (strcmp(file_attributes, "true") == 0);
-}
-
-// returns 1 if encryption attribute is successfully set, 0 otherwise
-char set_encryption_attr(const char* file_location) {
-	return !setxattr(file_location, "user.encfs", "true", 5*sizeof(char), 0);
+// path relative to mirror_fd, for the *at() calls. FUSE paths all start
+// with '/', and "/" itself is the mirror directory.
+static const char* relative_path(const char* path)
+{
+	while (*path == '/')
+		path++;
+	return *path ? path : ".";
 }
 
-
-char* absolute_path(const char* original_path) {
-	if (debug) {
-		printf("Entering absolute_path\n");
-	}
-	
-	size_t len = strlen(original_path) + strlen(mirror_dir) + 1;
-	char * root_path = malloc(len*sizeof(char));
-	
-	strcpy(root_path, mirror_dir);
-	strcat(root_path, original_path);
-	
-	return root_path;
+// mirror_dir + path in buf (PATH_MAX bytes), for the xattr calls, which
+// have no *at() form
+static int mirror_path(const char* path, char* buf)
+{
+	if (snprintf(buf, PATH_MAX, "%s%s", mirror_dir, path) >= PATH_MAX)
+		return -ENAMETOOLONG;
+	return 0;
 }
 
 static int pa5_encfs_getattr(const char *path, struct stat *stbuf)
@@ -96,12 +110,14 @@ static int pa5_encfs_getattr(const char *path, struct stat *stbuf)
 	
 	int res;
 	
-	char* full_path = absolute_path(path);
-	
-	res = lstat(full_path, stbuf);
+	res = fstatat(mirror_fd, relative_path(path), stbuf, AT_SYMLINK_NOFOLLOW);
 	if (res == -1)
 		return -errno;
 
+	// plaintext sizes, without decrypting anything
+	if (S_ISREG(stbuf->st_mode))
+		encfs_plain_size(mirror_fd, relative_path(path), stbuf);
+
 	return 0;
 }
 
@@ -113,9 +129,7 @@ static int pa5_encfs_access(const char *path, int mask)
 	
 	int res;
 	
-	char* full_path = absolute_path(path);
-
-	res = access(full_path, mask);
+	res = faccessat(mirror_fd, relative_path(path), mask, 0);
 	if (res == -1)
 		return -errno;
 
@@ -129,9 +143,7 @@ static int pa5_encfs_readlink(const char *path, char *buf, size_t size)
 	}	
 	int res;
 	
-	char* full_path = absolute_path(path);
-
-	res = readlink(full_path, buf, size - 1);
+	res = readlinkat(mirror_fd, relative_path(path), buf, size - 1);
 	if (res == -1)
 		return -errno;
 
@@ -140,6 +152,46 @@ static int pa5_encfs_readlink(const char *path, char *buf, size_t size)
 }
 
 
+// An open directory, in fi->fh from opendir() to releasedir(). entry was
+// read but did not fit in the last reply; offset is where dp stands.
+struct pa5_dir {
+	DIR* dp;
+	struct dirent* entry;
+	off_t offset;
+};
+
+static int pa5_encfs_opendir(const char *path, struct fuse_file_info *fi)
+{
+	if (debug) {
+		printf("Entering pa5_encfs_opendir\n");
+	}
+	
+	struct pa5_dir* d;
+	int fd, res;
+	
+	d = calloc(1, sizeof(*d));
+	if (d == NULL)
+		return -ENOMEM;
+	fd = openat(mirror_fd, relative_path(path), O_RDONLY | O_DIRECTORY);
+	if (fd == -1) {
+		res = -errno;
+		free(d);
+		return res;
+	}
+	d->dp = fdopendir(fd);
+	if (d->dp == NULL) {
+		res = -errno;
+		close(fd);
+		free(d);
+		return res;
+	}
+	
+	fi->fh = (uintptr_t)d;
+	return 0;
+}
+
+// Streams the directory: each call fills one kernel sized reply from
+// offset on, a telldir() cookie, instead of listing it all again.
 static int pa5_encfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 		       off_t offset, struct fuse_file_info *fi)
 {
@@ -147,29 +199,48 @@ static int pa5_encfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler
 		printf("Entering pa5_encfs_readdir\n");
 	}
 	
-	char * full_path = absolute_path(path);
-	
-	DIR *dp;
-	struct dirent *de;
+	struct pa5_dir* d = (struct pa5_dir*)(uintptr_t)fi->fh;
+	struct stat st;
+	off_t next;
 
-	(void) offset;
-	(void) fi;
+	(void) path;
 
-	//dp = opendir(path);
-	dp = opendir(full_path);
-	if (dp == NULL)
-		return -errno;
+	if (offset != d->offset) {
+		seekdir(d->dp, offset);
+		d->entry = NULL;
+		d->offset = offset;
+	}
 
-	while ((de = readdir(dp)) != NULL) {
-		struct stat st;
+	for (;;) {
+		if (d->entry == NULL) {
+			d->entry = readdir(d->dp);
+			if (d->entry == NULL)
+				break;
+		}
+		next = telldir(d->dp);
 		memset(&st, 0, sizeof(st));
-		st.st_ino = de->d_ino;
-		st.st_mode = de->d_type << 12;
-		if (filler(buf, de->d_name, &st, 0))
+		st.st_ino = d->entry->d_ino;
+		st.st_mode = d->entry->d_type << 12;
+		if (filler(buf, d->entry->d_name, &st, next))
 			break;
+		d->entry = NULL;
+		d->offset = next;
 	}
 
-	closedir(dp);
+	return 0;
+}
+
+static int pa5_encfs_releasedir(const char *path, struct fuse_file_info *fi)
+{
+	if (debug) {
+		printf("Entering pa5_encfs_releasedir\n");
+	}
+	
+	struct pa5_dir* d = (struct pa5_dir*)(uintptr_t)fi->fh;
+	
+	(void) path;
+	closedir(d->dp);
+	free(d);
 	return 0;
 }
 
@@ -179,20 +250,20 @@ static int pa5_encfs_mknod(const char *path, mode_t mode, dev_t rdev)
 		printf("Entering pa5_encfs_mknod\n");
 	}
 	
-	char* full_path = absolute_path(path);
+	const char* rel_path = relative_path(path);
 		
 	int res;
 
 	/* On Linux this could just be 'mknod(path, mode, rdev)' but this
 	   is more portable */
 	if (S_ISREG(mode)) {
-		res = open(full_path, O_CREAT | O_EXCL | O_WRONLY, mode);
+		res = openat(mirror_fd, rel_path, O_CREAT | O_EXCL | O_WRONLY, mode);
 		if (res >= 0)
 			res = close(res);
 	} else if (S_ISFIFO(mode))
-		res = mkfifo(full_path, mode);
+		res = mkfifoat(mirror_fd, rel_path, mode);
 	else
-		res = mknod(full_path, mode, rdev);
+		res = mknodat(mirror_fd, rel_path, mode, rdev);
 	if (res == -1)
 		return -errno;
 
@@ -205,11 +276,9 @@ static int pa5_encfs_mkdir(const char *path, mode_t mode)
 		printf("Entering pa5_encfs_mkdir\n");
 	}
 	
-	char* full_path = absolute_path(path);
-	
 	int res;
 
-	res = mkdir(full_path, mode);
+	res = mkdirat(mirror_fd, relative_path(path), mode);
 	if (res == -1)
 		return -errno;
 
@@ -222,11 +291,11 @@ static int pa5_encfs_unlink(const char *path)
 		printf("Entering pa5_encfs_unlink\n");
 	}
 	
-	char* full_path = absolute_path(path);
-	
 	int res;
 
-	res = unlink(full_path);
+	// the inode number may come back on an unrelated file
+	encfs_meta_invalidate_at(mirror_fd, relative_path(path));
+	res = unlinkat(mirror_fd, relative_path(path), 0);
 	if (res == -1)
 		return -errno;
 
@@ -239,11 +308,9 @@ static int pa5_encfs_rmdir(const char *path)
 		printf("Entering pa5_encfs_rmdir\n");
 	}	
 	
-	char* full_path = absolute_path(path);
-	
 	int res;
 
-	res = rmdir(full_path);
+	res = unlinkat(mirror_fd, relative_path(path), AT_REMOVEDIR);
 	if (res == -1)
 		return -errno;
 
@@ -258,7 +325,8 @@ static int pa5_encfs_symlink(const char *from, const char *to)
 	
 	int res;
 
-	res = symlink(from, to);
+	// from is the link's contents, stored as given
+	res = symlinkat(from, mirror_fd, relative_path(to));
 	if (res == -1)
 		return -errno;
 
@@ -273,7 +341,9 @@ static int pa5_encfs_rename(const char *from, const char *to)
 	
 	int res;
 
-	res = rename(from, to);
+	// a file renamed over is gone, entries follow inodes not names
+	encfs_meta_invalidate_at(mirror_fd, relative_path(to));
+	res = renameat(mirror_fd, relative_path(from), mirror_fd, relative_path(to));
 	if (res == -1)
 		return -errno;
 
@@ -288,7 +358,7 @@ static int pa5_encfs_link(const char *from, const char *to)
 		
 	int res;
 
-	res = link(from, to);
+	res = linkat(mirror_fd, relative_path(from), mirror_fd, relative_path(to), 0);
 	if (res == -1)
 		return -errno;
 
@@ -301,11 +371,9 @@ static int pa5_encfs_chmod(const char *path, mode_t mode)
 		printf("Entering pa5_encfs_chmod\n");
 	}
 		
-	char* full_path = absolute_path(path);
-	
 	int res;
 
-	res = chmod(full_path, mode);
+	res = fchmodat(mirror_fd, relative_path(path), mode, 0);
 	if (res == -1)
 		return -errno;
 
@@ -319,10 +387,8 @@ static int pa5_encfs_chown(const char *path, uid_t uid, gid_t gid)
 	}
 	
 	int res;
-	
-	char* full_path = absolute_path(path);
 
-	res = lchown(full_path, uid, gid);
+	res = fchownat(mirror_fd, relative_path(path), uid, gid, AT_SYMLINK_NOFOLLOW);
 	if (res == -1)
 		return -errno;
 
@@ -335,15 +401,7 @@ static int pa5_encfs_truncate(const char *path, off_t size)
 		printf("Entering pa5_encfs_truncate\n");
 	}
 		
-	int res;
-	
-	char* full_path = absolute_path(path);
-
-	res = truncate(full_path, size);
-	if (res == -1)
-		return -errno;
-
-	return 0;
+	return encfs_truncate_at(mirror_fd, relative_path(path), size);
 }
 
 static int pa5_encfs_utimens(const char *path, const struct timespec ts[2])
@@ -353,21 +411,19 @@ static int pa5_encfs_utimens(const char *path, const struct timespec ts[2])
 	}
 		
 	int res;
-	struct timeval tv[2];
-	char* full_path = absolute_path(path);
-
-	tv[0].tv_sec = ts[0].tv_sec;
-	tv[0].tv_usec = ts[0].tv_nsec / 1000;
-	tv[1].tv_sec = ts[1].tv_sec;
-	tv[1].tv_usec = ts[1].tv_nsec / 1000;
 
-	res = utimes(full_path, tv);
+	res = utimensat(mirror_fd, relative_path(path), ts, AT_SYMLINK_NOFOLLOW);
 	if (res == -1)
 		return -errno;
 
 	return 0;
 }
 
+static struct encfs_handle* get_handle(struct fuse_file_info* fi)
+{
+	return (struct encfs_handle*)(uintptr_t)fi->fh;
+}
+
 static int pa5_encfs_open(const char *path, struct fuse_file_info *fi)
 {
 	if (debug) {
@@ -375,15 +431,13 @@ static int pa5_encfs_open(const char *path, struct fuse_file_info *fi)
 	}
 	
 	int res;
+	struct encfs_handle* h;
 	
-	char* full_path = absolute_path(path);
-
-	res = open(full_path, fi->flags);
-	if (res == -1)
-		return -errno;
-
-	close(res);
-	return 0;
+	// the open file lives in fi->fh until release
+	res = encfs_handle_open(mirror_fd, relative_path(path), fi->flags, &h);
+	if (res == 0)
+		fi->fh = (uintptr_t)h;
+	return res;
 }
 
 static int pa5_encfs_read(const char *path, char *buf, size_t size, off_t offset,
@@ -393,135 +447,101 @@ static int pa5_encfs_read(const char *path, char *buf, size_t size, off_t offset
 		printf("Entering pa5_encfs_read\n");
 	}
 	
-	(void) fi;
-	char* full_path = absolute_path(path);
-	int res, encryption_action;
-	
-	FILE *read_file, *temp_file;
-	read_file = fopen(full_path, "r");
-	temp_file = tmpfile();
-	
-	
-	if (is_encrypted(full_path) == 1) {
-		encryption_action = DECRYPT;
-	}
-	else {
-		encryption_action = PASS_THROUGH;
-	}
-	
-	if(!do_crypt(read_file, temp_file, encryption_action, key_phrase)) {
-		fprintf(stderr, "Unable to decrypt file\n");
-		return errno;
-	}
-	
-	fflush(temp_file);
-	fseek(temp_file, offset, SEEK_SET);
-	
-	res = fread(buf, 1, size, temp_file);
-	if (res < 0) {
-		fprintf(stderr, "Unable to read file\n");
-		res = errno;
-	}
-	
-	fclose(temp_file);
-	fclose(read_file);
-	
-	
-	return res;
+	(void) path;
+	return encfs_handle_read(get_handle(fi), buf, size, offset);
 }
 
 static int pa5_encfs_write(const char *path, const char *buf, size_t size,
 		     off_t offset, struct fuse_file_info *fi)
 {
-	/*(void) fi;
-	FILE *path_ptr, *tmpf;
-	char *full_path;
-	int res, action;
-	int tmpf_descriptor;
-
-	full_path = absolute_path(path);
-	path_ptr = fopen(full_path, "r+");
-	tmpf = tmpfile();
-	tmpf_descriptor = fileno(tmpf);
-
-
-	// Something went terribly wrong if this is the case. 
-	if (path_ptr == NULL || tmpf == NULL)
-		return -errno;
-	
-	fseek(path_ptr, 0, SEEK_END);
-	int length = ftell(path_ptr);
-	fseek(path_ptr, 0, SEEK_SET);
-
-	// if the file to write to exists, read it into the tempfile 
-	if (access(path, R_OK) == 0 && length > 0) {
-		action = is_encrypted(full_path) ? DECRYPT : PASS_THROUGH;
-		if (do_crypt(path_ptr, tmpf, action, key_phrase) == 0)
-			return --errno;
-
-		rewind(path_ptr);
-		rewind(tmpf);
-	}
-
-	// Read our tmpfile into the buffer.
-	res = pwrite(tmpf_descriptor, buf, size, offset);
-	if (res == -1)
-		res = -errno;
-
-	// Either encrypt, or just move along. 
-	action = is_encrypted(path) ? ENCRYPT : PASS_THROUGH;
-
-	if (do_crypt(tmpf, path_ptr, action, key_phrase) == 0)
-		return -errno;
-
-	fclose(tmpf);
-	fclose(path_ptr);
-
-	return res; */
-	
 	if (debug) {
 		printf("Entering pa5_encfs_write\n");
 	}
 	
-	(void) fi;
-	int res, encryption_action;
-	char* full_path = absolute_path(path);
+	(void) path;
+	return encfs_handle_write(get_handle(fi), buf, size, offset);
+}
+
+// Used by FUSE in place of read(). Pass-through files are handed back as
+// the backing fd and offset, for FUSE to splice or pread() from straight
+// into the reply; encrypted ones are decrypted into a buffer FUSE frees.
+static int pa5_encfs_read_buf(const char *path, struct fuse_bufvec **bufp,
+			size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	if (debug) {
+		printf("Entering pa5_encfs_read_buf\n");
+	}
 	
-	FILE * write_file, *temp_file;
-	write_file = fopen(full_path, "w+");
-	temp_file = tmpfile();
+	struct encfs_handle* h = get_handle(fi);
+	struct fuse_bufvec* src;
+	int res;
 	
-	if (is_encrypted(full_path)) {
-		encryption_action = DECRYPT;
+	(void) path;
+	src = malloc(sizeof(*src));
+	if (src == NULL)
+		return -ENOMEM;
+	*src = FUSE_BUFVEC_INIT(size);
+	
+	if (h->plain) {
+		src->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		src->buf[0].fd = h->fd;
+		src->buf[0].pos = offset;
 	}
 	else {
-		encryption_action = PASS_THROUGH;
-	}
-	
-	if(!do_crypt(write_file, temp_file, encryption_action, key_phrase)) {
-		fprintf(stderr, "Could not decrypt file\n");
-		return errno;
+		src->buf[0].mem = malloc(size);
+		if (src->buf[0].mem == NULL) {
+			free(src);
+			return -ENOMEM;
+		}
+		res = encfs_handle_read(h, src->buf[0].mem, size, offset);
+		if (res < 0) {
+			free(src->buf[0].mem);
+			free(src);
+			return res;
+		}
+		src->buf[0].size = res;
 	}
 	
-	fseek(temp_file, offset, SEEK_SET);
-	
-	res = fwrite(buf, 1, size, temp_file);
-	if (res < 0) {
-		fprintf(stderr, "Unable to write to file\n");
-		return errno;
+	*bufp = src;
+	return 0;
+}
+
+// Used by FUSE in place of write(). Pass-through data goes from the
+// request to the backing fd without an extra copy.
+static int pa5_encfs_write_buf(const char *path, struct fuse_bufvec *buf,
+			 off_t offset, struct fuse_file_info *fi)
+{
+	if (debug) {
+		printf("Entering pa5_encfs_write_buf\n");
 	}
 	
-	fseek(temp_file, offset, SEEK_SET);
-	fseek(write_file, offset, SEEK_SET);
+	struct encfs_handle* h = get_handle(fi);
+	size_t size = fuse_buf_size(buf);
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+	char* mem;
+	int res;
 	
-	if(!do_crypt(temp_file, write_file, encryption_action, key_phrase)) {
-		fprintf(stderr, "Could not write to file\n");
-		return errno;
+	(void) path;
+	if (h->plain) {
+		dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		dst.buf[0].fd = h->fd;
+		dst.buf[0].pos = offset;
+		return fuse_buf_copy(&dst, buf, 0);
 	}
 	
-	fclose(write_file);
-	fclose(temp_file);
-	
+	// already one plain buffer, the usual case without splice
+	if (buf->count == 1 && buf->idx == 0 && buf->off == 0 &&
+	    !(buf->buf[0].flags & FUSE_BUF_IS_FD))
+		return encfs_handle_write(h, buf->buf[0].mem, size, offset);
+	
+	mem = malloc(size);
+	if (mem == NULL)
+		return -ENOMEM;
+	dst.buf[0].mem = mem;
+	res = fuse_buf_copy(&dst, buf, 0);
+	if (res >= 0)
+		res = encfs_handle_write(h, mem, res, offset);
+	free(mem);
 	return res;
 }
 
@@ -533,9 +553,9 @@ static int pa5_encfs_statfs(const char *path, struct statvfs *stbuf)
 	
 	int res;
 	
-	char* full_path = absolute_path(path);
-
-	res = statvfs(full_path, stbuf);
+	// the same answer anywhere in the mirror directory's file system
+	(void) path;
+	res = fstatvfs(mirror_fd, stbuf);
 	if (res == -1)
 		return -errno;
 
@@ -548,69 +568,138 @@ static int pa5_encfs_create(const char* path, mode_t mode, struct fuse_file_info
 		printf("Entering pa5_encfs_create\n");
 	}
 	
-	(void) fi;
-    int res;
-    FILE * file_in;
+    int fd, res;
+    struct encfs_handle* h;
     
-    char* full_path = absolute_path(path);
+    // read access too, partial block writes decrypt the old bytes
+    fd = openat(mirror_fd, relative_path(path), O_CREAT | O_TRUNC | O_RDWR, mode);
     
-    res = creat(full_path, mode);
-    
-    if(res == -1) {
+    if(fd == -1) {
 		printf("Failed to create path");
 		return -errno;
 	}
 	
-    close(res);
-    
-    file_in = fopen(full_path, "r+");   
-    
-    if (do_crypt(file_in, file_in, ENCRYPT , key_phrase)) {
-		if (!set_encryption_attr(full_path)) {
-			fprintf(stderr, "Failed to set encryption attribute\n");
-		}
-	}
-	else {
-		fprintf(stderr, "Failed to encrypt file\n");
-	}
-	
-	fclose(file_in);
+	res = encfs_handle_create(fd, &h);
+	if (res == 0)
+		fi->fh = (uintptr_t)h;
 
-    return 0;
+    return res;
 }
 
+static int pa5_encfs_flush(const char *path, struct fuse_file_info *fi)
+{
+	if (debug) {
+		printf("Entering pa5_encfs_flush\n");
+	}
+	
+	(void) path;
+	// called on every close() of the file, so the data is in the
+	// backing file when close returns
+	return encfs_handle_flush(get_handle(fi));
+}
 
 static int pa5_encfs_release(const char *path, struct fuse_file_info *fi)
 {
-	/* Just a stub.	 This method is optional and can safely be left
-	   unimplemented */
-	   
 	if (debug) {
 		printf("Entering pa5_encfs_release\n");
 	}
 
 	(void) path;
-	(void) fi;
+	encfs_handle_release(get_handle(fi));
 	return 0;
 }
 
 static int pa5_encfs_fsync(const char *path, int isdatasync,
 		     struct fuse_file_info *fi)
 {
-	/* Just a stub.	 This method is optional and can safely be left
-	   unimplemented */
 	if (debug) {
 		printf("Entering pa5_encfs_fsync\n");
 	}
-	   
 
 	(void) path;
-	(void) isdatasync;
-	(void) fi;
-	return 0;
+	return encfs_handle_fsync(get_handle(fi), isdatasync);
+}
+
+static int pa5_encfs_ftruncate(const char *path, off_t size,
+			struct fuse_file_info *fi)
+{
+	if (debug) {
+		printf("Entering pa5_encfs_ftruncate\n");
+	}
+	
+	(void) path;
+	return encfs_handle_truncate(get_handle(fi), size);
+}
+
+static int pa5_encfs_fallocate(const char *path, int mode, off_t offset,
+			off_t length, struct fuse_file_info *fi)
+{
+	if (debug) {
+		printf("Entering pa5_encfs_fallocate\n");
+	}
+	
+	(void) path;
+	return encfs_handle_fallocate(get_handle(fi), mode, offset, length);
+}
+
+static int pa5_encfs_fgetattr(const char *path, struct stat *stbuf,
+			struct fuse_file_info *fi)
+{
+	if (debug) {
+		printf("Entering pa5_encfs_fgetattr\n");
+	}
+	
+	(void) path;
+	return encfs_handle_getattr(get_handle(fi), stbuf);
+}
+
+static void* pa5_encfs_init(struct fuse_conn_info *conn)
+{
+	if (debug) {
+		printf("Entering pa5_encfs_init\n");
+	}
+	
+	// whole-block writes skip the read-modify-write, and readahead
+	// fills the block cache a chunk at a time
+	if (conn->capable & FUSE_CAP_BIG_WRITES)
+		conn->want |= FUSE_CAP_BIG_WRITES;
+	if (conn->capable & FUSE_CAP_ASYNC_READ)
+		conn->want |= FUSE_CAP_ASYNC_READ;
+	// lets read_buf()/write_buf() move pass-through pages by splice
+	conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE |
+				       FUSE_CAP_SPLICE_MOVE |
+				       FUSE_CAP_SPLICE_READ);
+	
+	if (debug) {
+		printf("max_write = %u, max_readahead = %u, big_writes = %d\n",
+		       conn->max_write, conn->max_readahead,
+		       (conn->want & FUSE_CAP_BIG_WRITES) != 0);
+	}
+	
+	// threads do not survive the fork into the background, start here
+	encfs_migrate_start();
+	
+	return NULL;
 }
 
 #ifdef HAVE_SETXATTR
+// user.encfs says how the file is read, which open handles would not
+// notice: it only changes while the file is not open, and the inode is
+// claimed meanwhile so no open races the change. Returns 1 if st's
+// inode was claimed, 0 for any other attribute, or -errno
+static int claim_attr(const char* full_path, const char* name,
+		      struct stat* st)
+{
+	int res;
+
+	if (strcmp(name, "user.encfs") != 0)
+		return 0;
+	if (lstat(full_path, st) == -1)
+		return -errno;
+	res = encfs_meta_claim(st->st_dev, st->st_ino);
+	return (res < 0) ? res : 1;
+}
+
 static int pa5_encfs_setxattr(const char *path, const char *name, const char *value,
 			size_t size, int flags)
 {
@@ -618,12 +707,24 @@ static int pa5_encfs_setxattr(const char *path, const char *name, const char *va
 		printf("Entering pa5_encfs_setxattr\n");
 	}	
 	
-	char* full_path = absolute_path(path);
-	
-	int res = lsetxattr(full_path, name, value, size, flags);
+	char full_path[PATH_MAX];
+	struct stat st;
+	int res, claimed;
+	
+	res = mirror_path(path, full_path);
+	if (res < 0)
+		return res;
+	claimed = claim_attr(full_path, name, &st);
+	if (claimed < 0)
+		return claimed;
+	res = lsetxattr(full_path, name, value, size, flags);
 	if (res == -1)
-		return -errno;
-	return 0;
+		res = -errno;
+	if (claimed)
+		encfs_meta_unclaim(st.st_dev, st.st_ino, 1);
+	// user.encfs may have changed
+	encfs_meta_invalidate_at(mirror_fd, relative_path(path));
+	return res;
 }
 
 static int pa5_encfs_getxattr(const char *path, const char *name, char *value,
@@ -633,9 +734,13 @@ static int pa5_encfs_getxattr(const char *path, const char *name, char *value,
 		printf("Entering pa5_encfs_getxattr\n");
 	}
 	
-	char* full_path = absolute_path(path);
+	char full_path[PATH_MAX];
+	int res;
 	
-	int res = lgetxattr(full_path, name, value, size);
+	res = mirror_path(path, full_path);
+	if (res < 0)
+		return res;
+	res = lgetxattr(full_path, name, value, size);
 	if (res == -1)
 		return -errno;
 	return res;
@@ -647,9 +752,13 @@ static int pa5_encfs_listxattr(const char *path, char *list, size_t size)
 		printf("Entering pa5_encfs_listxattr\n");
 	}
 	
-	char* full_path = absolute_path(path);
+	char full_path[PATH_MAX];
+	int res;
 	
-	int res = llistxattr(full_path, list, size);
+	res = mirror_path(path, full_path);
+	if (res < 0)
+		return res;
+	res = llistxattr(full_path, list, size);
 	if (res == -1)
 		return -errno;
 	return res;
@@ -661,12 +770,23 @@ static int pa5_encfs_removexattr(const char *path, const char *name)
 		printf("Entering pa5_encfs_removexattr\n");
 	}
 	
-	char* full_path = absolute_path(path);
-	
-	int res = lremovexattr(full_path, name);
+	char full_path[PATH_MAX];
+	struct stat st;
+	int res, claimed;
+	
+	res = mirror_path(path, full_path);
+	if (res < 0)
+		return res;
+	claimed = claim_attr(full_path, name, &st);
+	if (claimed < 0)
+		return claimed;
+	res = lremovexattr(full_path, name);
 	if (res == -1)
-		return -errno;
-	return 0;
+		res = -errno;
+	if (claimed)
+		encfs_meta_unclaim(st.st_dev, st.st_ino, 1);
+	encfs_meta_invalidate_at(mirror_fd, relative_path(path));
+	return res;
 }
 
 
@@ -676,7 +796,9 @@ static struct fuse_operations pa5_encfs_oper = {
 	.getattr	= pa5_encfs_getattr,
 	.access		= pa5_encfs_access,
 	.readlink	= pa5_encfs_readlink,
+	.opendir	= pa5_encfs_opendir,
 	.readdir	= pa5_encfs_readdir,
+	.releasedir	= pa5_encfs_releasedir,
 	.mknod		= pa5_encfs_mknod,
 	.mkdir		= pa5_encfs_mkdir,
 	.symlink	= pa5_encfs_symlink,
@@ -691,10 +813,17 @@ static struct fuse_operations pa5_encfs_oper = {
 	.open		= pa5_encfs_open,
 	.read		= pa5_encfs_read,
 	.write		= pa5_encfs_write,
+	.read_buf	= pa5_encfs_read_buf,
+	.write_buf	= pa5_encfs_write_buf,
 	.statfs		= pa5_encfs_statfs,
 	.create     = pa5_encfs_create,
+	.flush		= pa5_encfs_flush,
 	.release	= pa5_encfs_release,
 	.fsync		= pa5_encfs_fsync,
+	.ftruncate	= pa5_encfs_ftruncate,
+	.fgetattr	= pa5_encfs_fgetattr,
+	.fallocate	= pa5_encfs_fallocate,
+	.init		= pa5_encfs_init,
 #ifdef HAVE_SETXATTR
 	.setxattr	= pa5_encfs_setxattr,
 	.getxattr	= pa5_encfs_getxattr,
@@ -704,9 +833,162 @@ static struct fuse_operations pa5_encfs_oper = {
 };
 
 
+// Key derivation settings for a mirror directory, stored in KDF_ATTR on
+// the directory itself so every later mount derives the same key
+#define KDF_ATTR "user.encfs.kdf"
+
+struct pa5_options {
+	char* kdf;
+	unsigned int kdf_iter;
+	int no_tuning;
+	int lowlevel;
+	unsigned int cache_mb;
+	int migrate;
+	unsigned int migrate_threads;
+	unsigned int migrate_mb;
+};
+
+static struct fuse_opt pa5_opts[] = {
+	{ "kdf=%s", offsetof(struct pa5_options, kdf), 0 },
+	{ "kdf_iter=%u", offsetof(struct pa5_options, kdf_iter), 0 },
+	{ "no_tuning", offsetof(struct pa5_options, no_tuning), 1 },
+	{ "lowlevel", offsetof(struct pa5_options, lowlevel), 1 },
+	{ "cache_mb=%u", offsetof(struct pa5_options, cache_mb), 0 },
+	{ "migrate", offsetof(struct pa5_options, migrate), 1 },
+	{ "migrate_threads=%u", offsetof(struct pa5_options, migrate_threads), 0 },
+	{ "migrate_mb=%u", offsetof(struct pa5_options, migrate_mb), 0 },
+	FUSE_OPT_END
+};
+
+// Mount options added in front of the user's own, so any of them can be
+// overridden on the command line (noauto_cache, max_write=4096, ...).
+// auto_cache keeps file pages in the kernel between opens unless the
+// size or mtime getattr reports has changed; getattr reports plaintext
+// sizes, so cached pages line up with what read() returns.
+#define PA5_TUNING_OPTS "-oauto_cache,big_writes,max_write=131072," \
+	"max_readahead=131072,attr_timeout=1,entry_timeout=1"
+
+// auto_cache and the timeouts belong to the path based library, the
+// inode based mount does the same itself (encfs-ll.c)
+#define PA5_LL_TUNING_OPTS "-obig_writes,max_write=131072,max_readahead=131072"
+
+static void to_hex(const unsigned char* in, int len, char* out)
+{
+	int i;
+	
+	for (i = 0; i < len; i++)
+		sprintf(out + 2 * i, "%02x", in[i]);
+}
+
+static int from_hex(const char* in, unsigned char* out, int len)
+{
+	int i;
+	unsigned int byte;
+	
+	if ((int)strlen(in) != 2 * len)
+		return 0;
+	for (i = 0; i < len; i++) {
+		if (sscanf(in + 2 * i, "%2x", &byte) != 1)
+			return 0;
+		out[i] = byte;
+	}
+	return 1;
+}
+
+// returns 1 if dir holds nothing but . and ..
+static int dir_is_empty(const char* dir)
+{
+	DIR* dp;
+	struct dirent* de;
+	int empty = 1;
+	
+	dp = opendir(dir);
+	if (dp == NULL)
+		return 0;
+	while ((de = readdir(dp)) != NULL) {
+		if (strcmp(de->d_name, ".") && strcmp(de->d_name, "..")) {
+			empty = 0;
+			break;
+		}
+	}
+	closedir(dp);
+	return empty;
+}
+
+// Run the mirror directory's KDF on passphrase into mount_key. A
+// directory without KDF_ATTR uses the legacy KDF its files were written
+// with; a new, empty one may pick PBKDF2 with -o kdf=pbkdf2.
+// returns 0 on success, -1 after printing why not
+static int mount_derive_key(char* passphrase, const struct pa5_options* opts)
+{
+	char attr[256], salt_hex[2 * KDF_SALT_SIZE + 1], check_hex[2 * KEY_CHECK_SIZE + 1];
+	unsigned char salt[KDF_SALT_SIZE], check[KEY_CHECK_SIZE], stored[KEY_CHECK_SIZE];
+	unsigned int iter;
+	ssize_t len;
+	
+	len = getxattr(mirror_dir, KDF_ATTR, attr, sizeof(attr) - 1);
+	if (len > 0) {
+		attr[len] = '\0';
+		if (sscanf(attr, "pbkdf2 %u %32s %32s", &iter, salt_hex, check_hex) != 3
+		    || !from_hex(salt_hex, salt, KDF_SALT_SIZE)
+		    || !from_hex(check_hex, stored, KEY_CHECK_SIZE)) {
+			fprintf(stderr, "Unreadable %s on %s\n", KDF_ATTR, mirror_dir);
+			return -1;
+		}
+		if (opts->kdf && strcmp(opts->kdf, "pbkdf2"))
+			fprintf(stderr, "%s already uses pbkdf2, ignoring kdf=%s\n", mirror_dir, opts->kdf);
+		
+		if (!derive_key(&mount_key, passphrase, KDF_PBKDF2, salt, KDF_SALT_SIZE, iter))
+			return -1;
+		key_check(&mount_key, check);
+		if (memcmp(check, stored, KEY_CHECK_SIZE) != 0) {
+			fprintf(stderr, "Wrong passphrase for %s\n", mirror_dir);
+			key_cleanup(&mount_key);
+			return -1;
+		}
+		return 0;
+	}
+	
+	if (opts->kdf == NULL || strcmp(opts->kdf, "legacy") == 0)
+		return derive_key(&mount_key, passphrase, KDF_LEGACY, NULL, 0, 0) ? 0 : -1;
+	
+	if (strcmp(opts->kdf, "pbkdf2") != 0) {
+		fprintf(stderr, "Unknown kdf %s, use legacy or pbkdf2\n", opts->kdf);
+		return -1;
+	}
+	
+	// files already in the directory were encrypted with the legacy key
+	if (!dir_is_empty(mirror_dir)) {
+		fprintf(stderr, "kdf=pbkdf2 needs an empty mirror directory\n");
+		return -1;
+	}
+	
+	iter = opts->kdf_iter ? opts->kdf_iter : KDF_PBKDF2_ITER;
+	if (RAND_bytes(salt, KDF_SALT_SIZE) != 1
+	    || !derive_key(&mount_key, passphrase, KDF_PBKDF2, salt, KDF_SALT_SIZE, iter))
+		return -1;
+	
+	key_check(&mount_key, check);
+	to_hex(salt, KDF_SALT_SIZE, salt_hex);
+	to_hex(check, KEY_CHECK_SIZE, check_hex);
+	snprintf(attr, sizeof(attr), "pbkdf2 %u %s %s", iter, salt_hex, check_hex);
+	if (setxattr(mirror_dir, KDF_ATTR, attr, strlen(attr), 0) == -1) {
+		perror("Could not store kdf settings");
+		key_cleanup(&mount_key);
+		return -1;
+	}
+	
+	return 0;
+}
+
 // ./pa5-encfs [options] <key phrase> <mirror directory> <mount point>
 int main(int argc, char *argv[])
 {
+	struct pa5_options opts;
+	struct fuse_args args;
+	char* key_phrase;
+	int res;
+	
 	umask(0);
 	if ((argc < 4) || (argv[argc-2][0] == '-') || (argv[argc-1][0] == '-')) {
 		fprintf(stderr, "usage:  pa5-encfs [FUSE and mount options] <Key Phrase> <Mirror Directory> <Mount Point>\n");
@@ -731,10 +1013,53 @@ int main(int argc, char *argv[])
 		fprintf(stderr, "Enter a passphrase\n");
 	}
 	
-	printf("key phrase = %s\n", key_phrase);
 	printf("mirror directory = %s\n", mirror_dir);
 	printf("mount point = %s\n", mount_point);
 	
 	argc--;
-	return fuse_main(argc, argv, &pa5_encfs_oper, NULL);
+	
+	// pull our -o options out before FUSE sees them
+	memset(&opts, 0, sizeof(opts));
+	args.argc = argc;
+	args.argv = argv;
+	args.allocated = 0;
+	if (fuse_opt_parse(&args, &opts, pa5_opts, NULL) == -1)
+		exit(1);
+	if (!opts.no_tuning && fuse_opt_insert_arg(&args, 1, opts.lowlevel ?
+			PA5_LL_TUNING_OPTS : PA5_TUNING_OPTS) == -1)
+		exit(1);
+	
+	// the only key derivation, before any file is touched
+	if (mirror_dir == NULL || mount_derive_key(key_phrase, &opts) < 0)
+		exit(1);
+	memset(key_phrase, 0, strlen(key_phrase));
+	// new files are sealed with whatever wins the cipher self-tests
+	key_init_aead(&mount_key);
+	aead_select(stdout);
+	encfs_handle_setup(&mount_key);
+	if (opts.cache_mb)
+		encfs_cache_set_memory((size_t)opts.cache_mb * 1024 * 1024);
+	
+	// every callback resolves its path from here; opened before mounting,
+	// so it still reaches the mirror if the mount point covers it
+	mirror_fd = open(mirror_dir, O_RDONLY | O_DIRECTORY);
+	if (mirror_fd == -1) {
+		perror("Can not open mirror directory");
+		exit(1);
+	}
+	if (opts.migrate)
+		encfs_migrate_setup(mirror_fd, opts.migrate_threads, opts.migrate_mb);
+	
+	if (opts.lowlevel)
+		res = encfs_ll_main(&args, mirror_fd);
+	else
+		res = fuse_main(args.argc, args.argv, &pa5_encfs_oper, NULL);
+	
+	// the workers use the key and mirror_fd
+	encfs_migrate_stop();
+	close(mirror_fd);
+	key_cleanup(&mount_key);
+	fuse_opt_free_args(&args);
+	free(opts.kdf);
+	return res;
 }